@@ -0,0 +1,82 @@
+#pragma once
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace storage
+{
+    //
+    // 解压后的块的LRU缓存 所有工作线程共享
+    // - key为块容器的Identity加块号 同一个冷文件的多个并发流式下载共用同一份解压结果
+    //   各个下载的进度不同 落后的下载在缓存中找到领先的下载刚解压的块
+    // - 按字节数淘汰 按key的哈希分为shard_count个分片 各自加锁和淘汰 每个分片最多capacity/shard_count字节(向上取整)
+    // - 文件被覆盖后Identity变化 旧文件的块不会再被命中 随后被淘汰
+    // - capacity为0时不缓存
+    // - Hits()/Misses() 命中和未命中的次数
+    //
+    class BlockCache
+    {
+    private:
+        typedef std::pair<std::string, std::shared_ptr<const std::string>> Entry;
+        struct Shard
+        {
+            std::mutex mutex_;
+            std::list<Entry> lru_; // 最近使用的在前
+            std::unordered_map<std::string, std::list<Entry>::iterator> map_;
+            size_t bytes_ = 0;
+        };
+        static const size_t shard_count = 16;
+        Shard shards_[shard_count];
+        size_t capacity_; // 每个分片的字节数
+        std::atomic<uint64_t> hits_{0};
+        std::atomic<uint64_t> misses_{0};
+    public:
+        explicit BlockCache(size_t capacity) : capacity_((capacity + shard_count - 1) / shard_count) {}
+
+        bool Get(const std::string &key, std::shared_ptr<const std::string> *block) {
+            Shard &shard = GetShard(key);
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            auto it = shard.map_.find(key);
+            if (it == shard.map_.end()) {
+                misses_++;
+                return false;
+            }
+            shard.lru_.splice(shard.lru_.begin(), shard.lru_, it->second);
+            *block = it->second->second;
+            hits_++;
+            return true;
+        }
+
+        void Put(const std::string &key, std::shared_ptr<const std::string> block) {
+            Shard &shard = GetShard(key);
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            if (block->size() > capacity_ || shard.map_.count(key)) {
+                return;
+            }
+            shard.bytes_ += block->size();
+            shard.lru_.emplace_front(key, std::move(block));
+            shard.map_[key] = shard.lru_.begin();
+            while (shard.bytes_ > capacity_) {
+                shard.bytes_ -= shard.lru_.back().second->size();
+                shard.map_.erase(shard.lru_.back().first);
+                shard.lru_.pop_back();
+            }
+        }
+
+        uint64_t Hits() const {
+            return hits_;
+        }
+
+        uint64_t Misses() const {
+            return misses_;
+        }
+
+    private:
+        Shard &GetShard(const std::string &key) {
+            return shards_[std::hash<std::string>()(key) % shard_count];
+        }
+    };
+}
@@ -0,0 +1,542 @@
+#pragma once
+#include "Util.hpp"
+#include "ThreadPool.hpp"
+#include "StorageIo.hpp"
+#include "Sha256.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace storage
+{
+    //
+    // 深度存储的块容器文件格式 (本机字节序)
+    // +--------------------+
+    // | 压缩块 * N          | 原文件按block_size_切成定长块 每块单独bundle::pack
+    //                      | 压缩后没有变小的块原样保存
+    // +--------------------+
+    // | BlockEntry * N     | 块索引 记录每块在文件中的偏移和长度
+    // +--------------------+
+    // | BlockFooter        | 48字节 位于文件末尾 以magic_结尾
+    // +--------------------+
+    // 读取任意区间只需要解压它覆盖的块 各块之间没有依赖 可以并行压缩和解压
+    // 版本2: 块的原长度可以不同(不超过block_size_) 块可以引用分块存储中的分块(block_chunk)
+    //        此时块数据是分块的32字节SHA-256 分块的内容保存在分块存储中 见ChunkStore.hpp
+    //
+    const char block_magic[8] = {'N', 'A', 'S', 'B', 'L', 'K', '\0', '\0'};
+    const uint32_t block_version = 1;
+    const uint32_t block_version_chunked = 2;
+    const uint32_t block_stored = 1; // BlockEntry::flags_ 块未压缩
+    const uint32_t block_chunk = 2;  // BlockEntry::flags_ 块引用分块存储中的分块
+    const uint32_t chunk_hash_size = 32;
+    // 引用分块的块容器(分块去重的清单)在存储信息中记录的压缩格式 不是bundle的枚举值
+    const int32_t chunk_manifest_format = 0x100;
+
+    //
+    // 分块存储中分块文件的路径 chunk_storage_dir/前两位十六进制/完整的十六进制SHA-256
+    //
+    inline std::string ChunkPath(const std::string &hash) {
+        std::string hex = Sha256::Hex(hash);
+        return Config::GetInstance()->GetChunkStorageDir() + hex.substr(0, 2) + "/" + hex;
+    }
+
+    struct BlockEntry
+    {
+        uint64_t offset_;     // 块在文件中的偏移
+        uint32_t packed_len_; // 块在文件中的长度
+        uint32_t raw_len_;    // 解压后的长度 版本1除最后一块外都等于block_size_
+        uint32_t flags_;
+        uint32_t reserved_;
+    };
+    static_assert(sizeof(BlockEntry) == 24, "BlockEntry must be 24 bytes");
+
+    struct BlockFooter
+    {
+        uint64_t index_offset_; // 块索引在文件中的偏移
+        uint64_t block_count_;
+        uint64_t raw_size_;     // 原文件大小
+        uint32_t block_size_;
+        int32_t format_;        // 压缩格式
+        uint32_t version_;
+        uint32_t entry_size_;   // sizeof(BlockEntry) 用于检查格式是否一致
+        char magic_[8];
+    };
+    static_assert(sizeof(BlockFooter) == 48, "BlockFooter must be 48 bytes");
+
+    //
+    // 块解压使用的线程池 线程数等于CPU核数 第一次使用时创建
+    //
+    inline ThreadPool *CodecPool() {
+        static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+        return &pool;
+    }
+
+    //
+    // 块容器生成器
+    // 传入线程池时各块在池中并行压缩 按提交顺序写入文件 同时压缩中的块不超过max_inflight_
+    // - bool Open(const std::string &path, int format, uint32_t block_size, ThreadPool *pool) 创建容器文件
+    // - bool Append(std::string block) 压缩并写入一块 除最后一块外长度必须等于block_size
+    // - bool AppendChunk(const std::string &hash, uint32_t raw_len) 写入一个引用分块的块 长度不超过block_size 容器为版本2
+    // - bool Finish() 等待压缩中的块 写入块索引和footer并关闭文件
+    // - void Abort() 关闭并删除未完成的文件
+    //
+    class BlockWriter
+    {
+    private:
+        struct PackedBlock
+        {
+            std::string data_;
+            uint32_t raw_len_ = 0;
+            bool stored_ = false;
+        };
+        int fd_ = -1;
+        std::string path_;
+        int format_ = 0;
+        uint32_t block_size_ = 0;
+        uint64_t offset_ = 0;
+        uint64_t raw_size_ = 0;
+        bool last_ = false; // 已经提交了不满一块的最后一块
+        bool chunked_ = false; // 有引用分块的块
+        std::vector<BlockEntry> entries_;
+        ThreadPool *pool_ = nullptr;
+        size_t max_inflight_ = 0;
+        std::deque<std::future<PackedBlock>> inflight_; // 按提交顺序排列的压缩任务
+    public:
+        BlockWriter() {}
+        BlockWriter(const BlockWriter &) = delete;
+        BlockWriter &operator=(const BlockWriter &) = delete;
+        ~BlockWriter() {
+            Abort();
+        }
+
+        //
+        // 创建容器文件
+        // - pool为nullptr时在当前线程压缩
+        // - max_inflight为0时取线程池大小的两倍 内存占用约为max_inflight个块
+        //
+        bool Open(const std::string &path, int format, uint32_t block_size,
+                  ThreadPool *pool = nullptr, size_t max_inflight = 0) {
+            Abort();
+            if (block_size == 0) {
+                return false;
+            }
+            fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd_ == -1) {
+                return false;
+            }
+            path_ = path;
+            format_ = format;
+            block_size_ = block_size;
+            offset_ = 0;
+            raw_size_ = 0;
+            last_ = false;
+            chunked_ = false;
+            entries_.clear();
+            pool_ = pool;
+            max_inflight_ = max_inflight ? max_inflight : (pool ? pool->Size() * 2 : 1);
+            return true;
+        }
+
+        bool Append(std::string block) {
+            if (fd_ == -1 || last_ || block.empty() || block.size() > block_size_) {
+                return false;
+            }
+            last_ = block.size() < block_size_;
+            if (pool_ == nullptr) {
+                return WriteBlock(Pack(format_, block));
+            }
+            int format = format_;
+            auto raw = std::make_shared<std::string>(std::move(block));
+            inflight_.push_back(pool_->Async([format, raw]() { return Pack(format, *raw); }));
+            while (inflight_.size() >= max_inflight_) {
+                if (WriteFront() == false) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool AppendChunk(const std::string &hash, uint32_t raw_len) {
+            if (fd_ == -1 || hash.size() != chunk_hash_size || raw_len == 0 || raw_len > block_size_) {
+                return false;
+            }
+            while (inflight_.empty() == false) {
+                if (WriteFront() == false) {
+                    return false;
+                }
+            }
+            chunked_ = true;
+            PackedBlock block;
+            block.data_ = hash;
+            block.raw_len_ = raw_len;
+            return WriteBlock(block, block_chunk);
+        }
+
+        bool Finish() {
+            if (fd_ == -1) {
+                return false;
+            }
+            while (inflight_.empty() == false) {
+                if (WriteFront() == false) {
+                    Abort();
+                    return false;
+                }
+            }
+            BlockFooter footer;
+            memset(&footer, 0, sizeof(footer));
+            footer.index_offset_ = offset_;
+            footer.block_count_ = entries_.size();
+            footer.raw_size_ = raw_size_;
+            footer.block_size_ = block_size_;
+            footer.format_ = format_;
+            footer.version_ = chunked_ ? block_version_chunked : block_version;
+            footer.entry_size_ = sizeof(BlockEntry);
+            memcpy(footer.magic_, block_magic, sizeof(block_magic));
+            if (WriteAll(entries_.data(), entries_.size() * sizeof(BlockEntry)) == false ||
+                WriteAll(&footer, sizeof(footer)) == false ||
+                fsync(fd_) == -1) {
+                Abort();
+                return false;
+            }
+            close(fd_);
+            fd_ = -1;
+            return true;
+        }
+
+        void Abort() {
+            // 压缩任务持有自己的数据副本 丢弃future不需要等待任务结束
+            inflight_.clear();
+            if (fd_ != -1) {
+                close(fd_);
+                fd_ = -1;
+                unlink(path_.c_str());
+            }
+        }
+
+    private:
+        //
+        // 压缩一块 压缩后没有变小的块原样保存
+        //
+        static PackedBlock Pack(int format, const std::string &raw) {
+            PackedBlock block;
+            block.raw_len_ = raw.size();
+            block.data_ = bundle::pack(format, raw);
+            if (block.data_.empty() || block.data_.size() >= raw.size()) {
+                block.data_ = raw;
+                block.stored_ = true;
+            }
+            return block;
+        }
+
+        //
+        // 等待最早提交的块压缩完成并写入文件
+        //
+        bool WriteFront() {
+            PackedBlock block = inflight_.front().get();
+            inflight_.pop_front();
+            return WriteBlock(block);
+        }
+
+        bool WriteBlock(const PackedBlock &block, uint32_t flags = 0) {
+            BlockEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.offset_ = offset_;
+            entry.packed_len_ = block.data_.size();
+            entry.raw_len_ = block.raw_len_;
+            entry.flags_ = flags;
+            if (block.stored_) {
+                entry.flags_ |= block_stored;
+            }
+            if (WriteAll(block.data_.data(), block.data_.size()) == false) {
+                return false;
+            }
+            offset_ += block.data_.size();
+            raw_size_ += block.raw_len_;
+            entries_.push_back(entry);
+            return true;
+        }
+
+        bool WriteAll(const void *data, size_t len) {
+            const char *p = (const char *)data;
+            while (len > 0) {
+                ssize_t n = write(fd_, p, len);
+                if (n == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                p += n;
+                len -= n;
+            }
+            return true;
+        }
+    };
+
+    //
+    // 块容器读取器
+    // 打开时只读取footer和块索引 之后按区间读取 只解压区间覆盖的块
+    // - bool Open(const std::string &path) 打开并校验容器文件 不是块容器返回false
+    // - uint64_t RawSize() 原文件大小
+    // - const std::string &Identity() 打开的文件的设备号、inode、修改时间和大小 文件被覆盖或重写后不同
+    // - size_t BlockIndex(uint64_t offset) / uint64_t BlockStart(size_t i) 原文件偏移所在的块 / 块在原文件中的起始偏移
+    // - bool ReadBlock(size_t i, std::string *block) 读取并解压第i块
+    // - bool Chunks(std::vector<std::pair<std::string, uint32_t>> *chunks) 引用的分块及其长度
+    // - bool Read(uint64_t offset, uint64_t len, std::string *content, ThreadPool *pool) 读取原文件的[offset, offset+len)
+    //
+    class BlockReader
+    {
+    private:
+        int fd_ = -1;
+        BlockFooter footer_;
+        std::vector<BlockEntry> entries_;
+        std::vector<uint64_t> starts_; // 版本2各块在原文件中的起始偏移 版本1按block_size_直接计算
+        std::string identity_;
+    public:
+        BlockReader() {}
+        BlockReader(const BlockReader &) = delete;
+        BlockReader &operator=(const BlockReader &) = delete;
+        ~BlockReader() {
+            Close();
+        }
+
+        bool Open(const std::string &path) {
+            Close();
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                return false;
+            }
+            struct stat st;
+            BlockFooter footer;
+            if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(footer) ||
+                ReadAll(fd, &footer, sizeof(footer), st.st_size - sizeof(footer)) == false ||
+                memcmp(footer.magic_, block_magic, sizeof(block_magic)) != 0 ||
+                (footer.version_ != block_version && footer.version_ != block_version_chunked) ||
+                footer.entry_size_ != sizeof(BlockEntry) ||
+                footer.block_size_ == 0 ||
+                footer.index_offset_ > st.st_size - sizeof(footer) ||
+                footer.block_count_ > (uint64_t)st.st_size / sizeof(BlockEntry) ||
+                footer.block_count_ * sizeof(BlockEntry) != st.st_size - sizeof(footer) - footer.index_offset_) {
+                close(fd);
+                return false;
+            }
+            std::vector<BlockEntry> entries(footer.block_count_);
+            if (ReadAll(fd, entries.data(), entries.size() * sizeof(BlockEntry), footer.index_offset_) == false) {
+                close(fd);
+                return false;
+            }
+            // 版本1除最后一块外每块都是block_size_ 区间到块的映射才能直接做除法
+            bool variable = footer.version_ == block_version_chunked;
+            std::vector<uint64_t> starts;
+            uint64_t raw_size = 0;
+            for (size_t i = 0; i < entries.size(); ++i) {
+                const BlockEntry &e = entries[i];
+                if (e.offset_ > footer.index_offset_ || e.packed_len_ > footer.index_offset_ - e.offset_ ||
+                    e.raw_len_ == 0 || e.raw_len_ > footer.block_size_ ||
+                    (!variable && i + 1 < entries.size() && e.raw_len_ != footer.block_size_) ||
+                    ((e.flags_ & block_chunk) && (!variable || e.packed_len_ != chunk_hash_size))) {
+                    close(fd);
+                    return false;
+                }
+                if (variable) {
+                    starts.push_back(raw_size);
+                }
+                raw_size += e.raw_len_;
+            }
+            if (raw_size != footer.raw_size_) {
+                close(fd);
+                return false;
+            }
+            fd_ = fd;
+            footer_ = footer;
+            entries_.swap(entries);
+            starts_.swap(starts);
+            identity_ = std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" +
+                        std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec) + ":" +
+                        std::to_string(st.st_size);
+            return true;
+        }
+
+        void Close() {
+            if (fd_ != -1) {
+                close(fd_);
+            }
+            fd_ = -1;
+            entries_.clear();
+            starts_.clear();
+            identity_.clear();
+        }
+
+        uint64_t RawSize() const {
+            return footer_.raw_size_;
+        }
+
+        const std::string &Identity() const {
+            return identity_;
+        }
+
+        size_t BlockCount() const {
+            return entries_.size();
+        }
+
+        uint32_t BlockSize() const {
+            return footer_.block_size_;
+        }
+
+        //
+        // 原文件偏移offset所在的块 版本2在各块的起始偏移上二分
+        //
+        size_t BlockIndex(uint64_t offset) const {
+            if (starts_.empty()) {
+                return offset / footer_.block_size_;
+            }
+            return std::upper_bound(starts_.begin(), starts_.end(), offset) - starts_.begin() - 1;
+        }
+
+        uint64_t BlockStart(size_t i) const {
+            return starts_.empty() ? (uint64_t)i * footer_.block_size_ : starts_[i];
+        }
+
+        //
+        // 引用的分块及其长度 按块的顺序 同一分块出现几次就返回几次
+        //
+        bool Chunks(std::vector<std::pair<std::string, uint32_t>> *chunks) const {
+            for (const BlockEntry &e : entries_) {
+                if ((e.flags_ & block_chunk) == 0) {
+                    continue;
+                }
+                std::string hash(chunk_hash_size, '\0');
+                if (ReadAll(fd_, &hash[0], hash.size(), e.offset_) == false) {
+                    return false;
+                }
+                chunks->emplace_back(std::move(hash), e.raw_len_);
+            }
+            return true;
+        }
+
+        //
+        // 读取并解压第i块 通过当前线程的存储IO后端定位读取 可以在多个线程中同时调用
+        // - 未压缩的块直接读入block
+        // - 压缩的块读入注册缓冲区后直接解压 没有空闲的注册缓冲区时读入临时内存
+        // - 引用分块的块先读出SHA-256 再从分块存储中读取分块
+        //
+        bool ReadBlock(size_t i, std::string *block) const {
+            if (fd_ == -1 || i >= entries_.size()) {
+                return false;
+            }
+            const BlockEntry &e = entries_[i];
+            StorageIo *io = StorageIo::Local();
+            if (e.flags_ & block_chunk) {
+                std::string hash(chunk_hash_size, '\0');
+                if (io->ReadAt(fd_, &hash[0], hash.size(), e.offset_) == false) {
+                    return false;
+                }
+                int fd = open(ChunkPath(hash).c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd == -1) {
+                    return false;
+                }
+                block->resize(e.raw_len_);
+                bool ok = io->ReadAt(fd, &(*block)[0], e.raw_len_, 0);
+                close(fd);
+                return ok;
+            }
+            if (e.flags_ & block_stored) {
+                block->resize(e.packed_len_);
+                return io->ReadAt(fd_, &(*block)[0], e.packed_len_, e.offset_) && block->size() == e.raw_len_;
+            }
+            char *packed = nullptr;
+            int buf_index = io->AcquireBuffer(e.packed_len_, &packed);
+            std::string heap;
+            if (buf_index < 0) {
+                heap.resize(e.packed_len_);
+                packed = &heap[0];
+            }
+            bool ok = io->ReadAt(fd_, packed, e.packed_len_, e.offset_, buf_index) &&
+                      Unpack(packed, e.packed_len_, block);
+            io->ReleaseBuffer(buf_index);
+            return ok && block->size() == e.raw_len_;
+        }
+
+        //
+        // 读取原文件的[offset, offset+len)到content
+        // - 区间超出文件大小返回false
+        // - 区间覆盖多个块时在pool中并行解压 pool为nullptr时在当前线程解压
+        //
+        bool Read(uint64_t offset, uint64_t len, std::string *content, ThreadPool *pool = CodecPool()) const {
+            content->clear();
+            if (offset > RawSize() || len > RawSize() - offset) {
+                return false;
+            }
+            if (len == 0) {
+                return true;
+            }
+            size_t first = BlockIndex(offset);
+            size_t last = BlockIndex(offset + len - 1);
+            std::vector<std::string> blocks(last - first + 1);
+            if (pool == nullptr || blocks.size() == 1) {
+                for (size_t i = first; i <= last; ++i) {
+                    if (ReadBlock(i, &blocks[i - first]) == false) {
+                        return false;
+                    }
+                }
+            }
+            else {
+                std::vector<std::future<bool>> results;
+                for (size_t i = first; i <= last; ++i) {
+                    std::string *block = &blocks[i - first];
+                    results.push_back(pool->Async([this, i, block]() { return ReadBlock(i, block); }));
+                }
+                bool ok = true;
+                for (auto &r : results) {
+                    ok = r.get() && ok; // 等待全部任务结束 blocks才能安全释放
+                }
+                if (ok == false) {
+                    return false;
+                }
+            }
+            content->reserve(len);
+            uint64_t skip = offset - BlockStart(first);
+            for (auto &block : blocks) {
+                size_t n = std::min<uint64_t>(block.size() - skip, len - content->size());
+                content->append(block, skip, n);
+                skip = 0;
+            }
+            return true;
+        }
+
+    private:
+        static bool ReadAll(int fd, void *buf, size_t len, uint64_t offset) {
+            return StorageIo::Local()->ReadAt(fd, buf, len, offset);
+        }
+
+        //
+        // 解压内存中的一块bundle数据 与bundle::unpack相同 但不需要先拷贝到std::string
+        //
+        static bool Unpack(const char *data, size_t len, std::string *out) {
+            if (len < bundle::MAX_HEADER_SIZE || bundle::is_packed(data, len) == false) {
+                return false;
+            }
+            size_t pad = bundle::padding(data, len);
+            if (pad + 2 >= bundle::MAX_HEADER_SIZE) {
+                return false;
+            }
+            unsigned q = (unsigned char)data[pad + 1];
+            const char *ptr = data + pad + 2;
+            size_t raw_len = bundle::vlebit(ptr);
+            size_t zlen = bundle::vlebit(ptr);
+            if (ptr > data + len || zlen > (size_t)(data + len - ptr)) {
+                return false;
+            }
+            size_t out_len = raw_len + bundle::unc_payload(q);
+            out->resize(out_len);
+            if (bundle::unpack(q, ptr, zlen, &(*out)[0], out_len) == false) {
+                return false;
+            }
+            out->resize(out_len);
+            return true;
+        }
+    };
+}
@@ -0,0 +1,479 @@
+#pragma once
+#include "BlockContainer.hpp"
+#include <condition_variable>
+#include <deque>
+#include <dirent.h>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+
+namespace storage
+{
+    //
+    // 按内容切分数据 FastCDC
+    // - gear哈希 fp = (fp << 1) + gear[byte] fp的高位只由最近64个字节决定 相当于64字节的滑动窗口
+    // - 前min_size字节不找切点 到avg_size之前用多一位的掩码 之后用少一位的掩码 分块长度集中在avg_size附近
+    // - 分块最长max_size 切点只由内容决定 文件中间插入或删除数据只影响附近的分块
+    // - size_t Cut(const char *data, size_t len) 第一个分块的长度 len小于max_size时视为数据的末尾
+    //
+    class ContentChunker
+    {
+    private:
+        uint64_t gear_[256];
+        size_t min_size_;
+        size_t avg_size_;
+        size_t max_size_;
+        uint64_t mask_small_; // avg_size之前使用 切点更少
+        uint64_t mask_large_; // avg_size之后使用 切点更多
+    public:
+        ContentChunker(size_t min_size, size_t avg_size, size_t max_size)
+            : min_size_(min_size), avg_size_(avg_size), max_size_(max_size) {
+            // gear表由固定的种子生成 重启后切点不变 相同的数据总能切出相同的分块
+            uint64_t seed = 0x4e41534348554e4bull;
+            for (auto &g : gear_) {
+                seed += 0x9E3779B97F4A7C15ull;
+                uint64_t z = seed;
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                g = z ^ (z >> 31);
+            }
+            int bits = 0;
+            while ((2ull << bits) <= avg_size_) {
+                bits++;
+            }
+            mask_small_ = ~0ull << (64 - (bits + 1));
+            mask_large_ = ~0ull << (64 - (bits - 1));
+        }
+
+        size_t MaxSize() const {
+            return max_size_;
+        }
+
+        size_t Cut(const char *data, size_t len) const {
+            if (len <= min_size_) {
+                return len;
+            }
+            const uint8_t *p = (const uint8_t *)data;
+            size_t limit = std::min(len, max_size_);
+            size_t normal = std::min(avg_size_, limit);
+            uint64_t fp = 0;
+            size_t i = min_size_;
+            for (; i < normal; i++) {
+                fp = (fp << 1) + gear_[p[i]];
+                if ((fp & mask_small_) == 0) {
+                    return i + 1;
+                }
+            }
+            for (; i < limit; i++) {
+                fp = (fp << 1) + gear_[p[i]];
+                if ((fp & mask_large_) == 0) {
+                    return i + 1;
+                }
+            }
+            return limit;
+        }
+    };
+
+    //
+    // 内容寻址的分块存储
+    // - 分块以内容的SHA-256命名 路径见ChunkPath 相同内容的分块只保存一份
+    // - 引用计数只保存在内存中 启动后在后台由存储信息中的清单重建(AddRef) 再由Sweep删除没有引用的分块
+    // - 引用计数降为0的分块过chunk_gc_delay秒后由后台线程删除 期间正在发送的下载可以继续读取 再次写入时直接复用
+    // - 重建完成(SetLoaded)之前引用计数不完整 后台线程不删除任何分块
+    // - bool Put(const char *data, size_t len, std::string *hash) 存入一个分块并取得一个引用 不等待写盘
+    // - bool Sync() 让此前存入的分块及其目录持久化 一个文件的分块全部存入后、清单记录之前调用一次
+    // - void AddRef(const std::string &hash, uint32_t size) 增加一个引用 启动时按清单重建引用、秒传链接清单时使用
+    // - void Release(const std::string &hash) 释放一个引用
+    // - void Sweep() 删除目录中没有引用的分块和上次运行遗留的临时文件 重建引用之后、SetLoaded之前调用一次
+    // - void SetLoaded() 引用计数已重建完整 开始删除引用计数为0的分块
+    // - Stats GetStats() 分块数、占用字节数、写入的分块数和其中重复的分块数
+    //
+    class ChunkStore
+    {
+    public:
+        struct Stats
+        {
+            uint64_t chunks_ = 0;
+            uint64_t bytes_ = 0;           // 分块占用的字节数
+            uint64_t puts_ = 0;            // 写入的分块数
+            uint64_t duplicates_ = 0;      // 其中已经存在的分块数
+            uint64_t duplicate_bytes_ = 0; // 去重节省的字节数
+        };
+    private:
+        struct Chunk
+        {
+            uint64_t refs_ = 0;
+            uint32_t size_ = 0;
+            time_t dead_ = 0; // 引用计数降为0的时间
+        };
+        std::string dir_;
+        ContentChunker chunker_;
+        time_t gc_delay_;
+        std::mutex mutex_; // 保护chunks_、dead_、stats_ 分块文件的rename和删除也在锁内进行
+        std::unordered_map<std::string, Chunk> chunks_; // key为32字节的SHA-256 只包含文件存在的分块
+        std::deque<std::pair<time_t, std::string>> dead_; // 引用计数降为0的分块 按时间排列
+        Stats stats_;
+        uint64_t written_ = 0;  // 已rename的新分块数 mutex_保护
+        std::mutex sync_mutex_; // 同一时间只有一个syncfs
+        uint64_t synced_ = 0;   // syncfs覆盖的新分块数 持有sync_mutex_时访问
+        time_t start_;        // 创建时间 早于它的临时文件是上次运行遗留的
+        bool loaded_ = false; // 引用计数已重建完整
+        std::thread gc_thread_;
+        std::condition_variable gc_cond_;
+        bool stop_ = false;
+    public:
+        ChunkStore()
+            : dir_(Config::GetInstance()->GetChunkStorageDir()),
+              chunker_(Config::GetInstance()->GetChunkMinSize(), Config::GetInstance()->GetChunkAvgSize(),
+                       Config::GetInstance()->GetChunkMaxSize()),
+              gc_delay_(Config::GetInstance()->GetChunkGcDelay()),
+              start_(time(nullptr)) {
+            gc_thread_ = std::thread(&ChunkStore::GcLoop, this);
+        }
+        ~ChunkStore() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            gc_cond_.notify_one();
+            if (gc_thread_.joinable()) {
+                gc_thread_.join();
+            }
+        }
+
+        const ContentChunker &Chunker() const {
+            return chunker_;
+        }
+
+        //
+        // 存入一个分块并取得一个引用
+        // - 已经存在的分块只增加引用计数 不写盘
+        // - 新分块先写临时文件 在锁内rename 与删除分块互斥
+        // - 不单独fdatasync 分块约64KB 逐个同步会让写盘退化为每个分块一次磁盘刷新 由Sync按文件批量持久化
+        //
+        bool Put(const char *data, size_t len, std::string *hash) {
+            *hash = Sha256::Digest(data, len);
+            if (AddExisting(*hash)) {
+                return true;
+            }
+            std::string path = ChunkPath(*hash);
+            std::string tmp_path = path + ".tmp.XXXXXX";
+            if (FileUtil(path).CreateParentDirectory() == false) {
+                return false;
+            }
+            int fd = mkstemp(&tmp_path[0]);
+            if (fd == -1) {
+                return false;
+            }
+            bool ok = StorageIo::Local()->WriteAt(fd, data, len, 0);
+            if (close(fd) != 0) {
+                ok = false;
+            }
+            if (ok == false) {
+                unlink(tmp_path.c_str());
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_.puts_++;
+            auto it = chunks_.find(*hash);
+            if (it != chunks_.end()) {
+                // 写临时文件期间其他上传存入了同一分块
+                unlink(tmp_path.c_str());
+                Ref(it->second);
+                return true;
+            }
+            if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+                unlink(tmp_path.c_str());
+                return false;
+            }
+            Chunk &chunk = chunks_[*hash];
+            chunk.refs_ = 1;
+            chunk.size_ = len;
+            stats_.chunks_++;
+            stats_.bytes_ += len;
+            written_++;
+            return true;
+        }
+
+        //
+        // 让此前rename的全部分块和所在目录持久化
+        // - 分块存储所在的文件系统整体syncfs一次 包括其他上传存入、本文件复用的分块
+        // - 组提交 调用前已rename的分块被其他线程的同步覆盖时直接返回 并发完成的上传共用一次syncfs
+        //
+        bool Sync() {
+            uint64_t ticket;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ticket = written_;
+            }
+            std::lock_guard<std::mutex> sync_lock(sync_mutex_);
+            if (synced_ >= ticket) {
+                return true;
+            }
+            uint64_t target;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                target = written_; // 同步开始前已rename的分块都会被这次同步覆盖
+            }
+            int fd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd == -1) {
+                return false;
+            }
+            bool ok = syncfs(fd) == 0;
+            close(fd);
+            if (ok) {
+                synced_ = target;
+            }
+            return ok;
+        }
+
+        void AddRef(const std::string &hash, uint32_t size) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = chunks_.find(hash);
+            if (it == chunks_.end()) {
+                it = chunks_.emplace(hash, Chunk()).first;
+                it->second.size_ = size;
+                stats_.chunks_++;
+                stats_.bytes_ += size;
+            }
+            it->second.refs_++;
+        }
+
+        void Release(const std::string &hash) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = chunks_.find(hash);
+            if (it == chunks_.end() || it->second.refs_ == 0) {
+                return;
+            }
+            if (--it->second.refs_ == 0) {
+                it->second.dead_ = time(nullptr);
+                dead_.emplace_back(it->second.dead_, hash);
+            }
+        }
+
+        void Sweep() {
+            DIR *d = opendir(dir_.c_str());
+            if (d == nullptr) {
+                return;
+            }
+            struct dirent *entry;
+            while ((entry = readdir(d)) != nullptr) {
+                std::string sub = entry->d_name;
+                if (sub.size() != 2 || sub.find_first_not_of("0123456789abcdef") != std::string::npos) {
+                    continue;
+                }
+                std::string sub_dir = dir_ + sub + "/";
+                DIR *s = opendir(sub_dir.c_str());
+                if (s == nullptr) {
+                    continue;
+                }
+                struct dirent *file;
+                while ((file = readdir(s)) != nullptr) {
+                    std::string name = file->d_name;
+                    if (name == "." || name == "..") {
+                        continue;
+                    }
+                    std::string hash;
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (Sha256::FromHex(name, &hash)) {
+                        if (chunks_.count(hash) == 0) {
+                            unlink((sub_dir + name).c_str());
+                        }
+                    }
+                    else if ((time_t)FileUtil(sub_dir + name).GetLastModifyTime() < start_) {
+                        unlink((sub_dir + name).c_str()); // 本次运行中正在写入的临时文件不删除
+                    }
+                }
+                closedir(s);
+            }
+            closedir(d);
+        }
+
+        void SetLoaded() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                loaded_ = true;
+            }
+            gc_cond_.notify_one();
+        }
+
+        Stats GetStats() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return stats_;
+        }
+
+    private:
+        //
+        // 分块已经存在时增加引用
+        //
+        bool AddExisting(const std::string &hash) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = chunks_.find(hash);
+            if (it == chunks_.end()) {
+                return false;
+            }
+            stats_.puts_++;
+            Ref(it->second);
+            return true;
+        }
+
+        void Ref(Chunk &chunk) {
+            chunk.refs_++;
+            chunk.dead_ = 0;
+            stats_.duplicates_++;
+            stats_.duplicate_bytes_ += chunk.size_;
+        }
+
+        //
+        // 后台删除引用计数为0超过gc_delay_的分块
+        // - 分块在等待期间被重新引用时dead_被清零 不删除
+        // - 引用计数重建完成之前不删除 计数为0可能只是引用它的清单还没有读到
+        //
+        void GcLoop() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!stop_) {
+                time_t now = time(nullptr);
+                while (loaded_ && !dead_.empty() && now - dead_.front().first >= gc_delay_) {
+                    auto it = chunks_.find(dead_.front().second);
+                    if (it != chunks_.end() && it->second.refs_ == 0 && it->second.dead_ == dead_.front().first) {
+                        unlink(ChunkPath(it->first).c_str());
+                        stats_.chunks_--;
+                        stats_.bytes_ -= it->second.size_;
+                        chunks_.erase(it);
+                    }
+                    dead_.pop_front();
+                }
+                gc_cond_.wait_for(lock, std::chrono::seconds(std::max<time_t>(1, std::min<time_t>(gc_delay_, 60))),
+                                  [this]() { return stop_; });
+            }
+        }
+    };
+
+    //
+    // 把一个文件的内容分块存入分块存储 并写出清单
+    // - 数据可以分多次追加 攒够max_size后按内容切分 每个分块存入分块存储 已经存在的只增加引用计数
+    // - 清单是引用分块的块容器(版本2) 按块容器读取 见BlockContainer.hpp
+    // - bool Open(const std::string &manifest_path) 创建清单文件
+    // - bool Append(const char *data, size_t len) 追加数据
+    // - bool AppendFile(int fd, uint64_t size) 追加fd中[0, size)的数据
+    // - bool Finish() 存入剩余数据 让分块持久化(ChunkStore::Sync)并写完清单
+    // - void Abort() 删除清单 释放已经取得的分块引用 Finish失败或析构时自动调用
+    // - uint64_t Size() 已追加的字节数 即原文件大小
+    // - std::string Digest() 原文件内容的SHA-256 Finish之后调用
+    //
+    class ChunkWriter
+    {
+    private:
+        ChunkStore *store_;
+        BlockWriter manifest_;
+        std::string pending_; // 尚未切分的数据 从pos_开始
+        size_t pos_ = 0;
+        uint64_t size_ = 0;
+        Sha256 sha_;          // 原文件内容的摘要
+        std::string digest_;
+        std::vector<std::string> refs_; // 已取得引用的分块
+        bool open_ = false;
+    public:
+        explicit ChunkWriter(ChunkStore *store) : store_(store) {}
+        ChunkWriter(const ChunkWriter &) = delete;
+        ChunkWriter &operator=(const ChunkWriter &) = delete;
+        ~ChunkWriter() {
+            Abort();
+        }
+
+        bool Open(const std::string &manifest_path) {
+            Abort();
+            open_ = manifest_.Open(manifest_path, chunk_manifest_format, store_->Chunker().MaxSize());
+            return open_;
+        }
+
+        bool Append(const char *data, size_t len) {
+            if (open_ == false) {
+                return false;
+            }
+            pending_.append(data, len);
+            sha_.Update(data, len);
+            size_ += len;
+            size_t max_size = store_->Chunker().MaxSize();
+            while (pending_.size() - pos_ >= max_size) {
+                if (Flush() == false) {
+                    return false;
+                }
+            }
+            // 已切分的数据超过一半时整理 避免每个分块都移动剩余数据
+            if (pos_ > pending_.size() / 2) {
+                pending_.erase(0, pos_);
+                pos_ = 0;
+            }
+            return true;
+        }
+
+        bool AppendFile(int fd, uint64_t size) {
+            const size_t piece = 1024 * 1024;
+            std::string buf;
+            for (uint64_t offset = 0; offset < size; offset += buf.size()) {
+                buf.resize(std::min<uint64_t>(piece, size - offset));
+                if (StorageIo::Local()->ReadAt(fd, &buf[0], buf.size(), offset) == false ||
+                    Append(buf.data(), buf.size()) == false) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool Finish() {
+            while (open_ && pos_ < pending_.size()) {
+                if (Flush() == false) {
+                    Abort();
+                    return false;
+                }
+            }
+            if (open_ == false || store_->Sync() == false || manifest_.Finish() == false) {
+                Abort();
+                return false;
+            }
+            open_ = false;
+            refs_.clear(); // 引用转移给清单
+            digest_ = sha_.Final();
+            return true;
+        }
+
+        void Abort() {
+            manifest_.Abort();
+            for (auto &hash : refs_) {
+                store_->Release(hash);
+            }
+            refs_.clear();
+            pending_.clear();
+            pos_ = 0;
+            size_ = 0;
+            sha_ = Sha256();
+            digest_.clear();
+            open_ = false;
+        }
+
+        uint64_t Size() const {
+            return size_;
+        }
+
+        const std::string &Digest() const {
+            return digest_;
+        }
+
+    private:
+        //
+        // 切出一个分块 存入分块存储并写入清单
+        //
+        bool Flush() {
+            size_t len = store_->Chunker().Cut(pending_.data() + pos_, pending_.size() - pos_);
+            std::string hash;
+            if (store_->Put(pending_.data() + pos_, len, &hash) == false) {
+                return false;
+            }
+            refs_.push_back(hash);
+            pos_ += len;
+            return manifest_.AppendChunk(hash, len);
+        }
+    };
+}
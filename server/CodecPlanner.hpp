@@ -0,0 +1,123 @@
+#pragma once
+#include "Util.hpp"
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace storage
+{
+    //
+    // 压缩格式规划
+    // 归档前从文件的开头/中间/结尾各取一段样本 估计熵并用候选格式试压缩 为每个文件选择压缩格式
+    // - 熵接近8bit/字节或最好的压缩率仍高于min_ratio的文件(jpg mp4 zip docx等)不压缩
+    // - 候选格式按速度从快到慢排列 较慢的格式比当前选择至少再小step_gain才会被选中
+    // - 策略: fast 只用LZ4F / balanced LZ4F ZSTDF ZSTD / ratio ZSTD BROTLI9 LZMA20 / fixed 只用bundle_format
+    // - int Choose(const std::string &path) 返回选中的压缩格式 -1表示不压缩
+    //
+    class CodecPlanner
+    {
+    private:
+        std::vector<int> candidates_;
+        double min_ratio_;
+        const double step_gain = 0.05;
+        const double max_entropy = 7.9;       // bit/字节
+        const size_t sample_size = 128 * 1024; // 每段样本的长度
+    public:
+        CodecPlanner(const std::string &policy, int fixed_format, double min_ratio) : min_ratio_(min_ratio) {
+            if (policy == "fast") {
+                candidates_ = {bundle::LZ4F};
+            }
+            else if (policy == "ratio") {
+                candidates_ = {bundle::ZSTD, bundle::BROTLI9, bundle::LZMA20};
+            }
+            else if (policy == "fixed") {
+                candidates_ = {fixed_format};
+            }
+            else {
+                candidates_ = {bundle::LZ4F, bundle::ZSTDF, bundle::ZSTD};
+            }
+        }
+
+        int Choose(const std::string &path) const {
+            std::string sample;
+            if (ReadSample(path, &sample) == false || sample.empty()) {
+                return -1;
+            }
+            if (Entropy(sample) >= max_entropy) {
+                return -1; // 已经压缩或加密过的数据 不用试压缩
+            }
+            int chosen = -1;
+            size_t chosen_size = 0;
+            for (int format : candidates_) {
+                size_t size = bundle::pack(format, sample).size();
+                if (size == 0) {
+                    continue;
+                }
+                if (chosen == -1 || size <= chosen_size * (1 - step_gain)) {
+                    chosen = format;
+                    chosen_size = size;
+                }
+            }
+            if (chosen == -1 || chosen_size > sample.size() * min_ratio_) {
+                return -1;
+            }
+            return chosen;
+        }
+
+        //
+        // 按字节频率估计的熵 单位bit/字节
+        //
+        static double Entropy(const std::string &data) {
+            size_t count[256] = {0};
+            for (unsigned char c : data) {
+                count[c]++;
+            }
+            double entropy = 0;
+            for (size_t n : count) {
+                if (n) {
+                    double p = (double)n / data.size();
+                    entropy -= p * std::log2(p);
+                }
+            }
+            return entropy;
+        }
+
+    private:
+        //
+        // 读取开头/中间/结尾三段样本 小文件整体作为样本
+        //
+        bool ReadSample(const std::string &path, std::string *sample) const {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) == -1) {
+                close(fd);
+                return false;
+            }
+            uint64_t fsize = st.st_size;
+            std::vector<std::pair<uint64_t, uint64_t>> parts;
+            if (fsize <= 3 * sample_size) {
+                parts.emplace_back(0, fsize);
+            }
+            else {
+                parts.emplace_back(0, sample_size);
+                parts.emplace_back(fsize / 2 - sample_size / 2, sample_size);
+                parts.emplace_back(fsize - sample_size, sample_size);
+            }
+            for (auto &part : parts) {
+                size_t old = sample->size();
+                sample->resize(old + part.second);
+                ssize_t n = pread(fd, &(*sample)[old], part.second, part.first);
+                if (n < 0) {
+                    close(fd);
+                    return false;
+                }
+                sample->resize(old + n);
+            }
+            close(fd);
+            return true;
+        }
+    };
+}
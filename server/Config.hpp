@@ -1,6 +1,8 @@
 #pragma once
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <algorithm>
 #include "Util.hpp"
 
 
@@ -19,8 +21,42 @@ namespace storage
         std::string download_prefix_;
         std::string deep_storage_dir_;
         std::string low_storage_dir_;
-        int bundle_format_; // 压缩格式
+        int bundle_format_; // 压缩格式 compress_policy为fixed时使用
         std::string storage_info_;
+        int server_threads_; // 工作线程数 每个线程独占一个event_base 0表示按CPU核数
+        size_t upload_buffer_size_; // 上传时每个请求在内存中缓存的最大字节数
+        size_t upload_max_body_size_; // libevent 2.1下由evhttp整体缓存的请求体(会话分块、chunked上传)的上限 超过时回复413
+        int io_threads_;            // 执行阻塞文件操作的IO线程数
+        int64_t upload_session_timeout_; // 分块上传会话超过该时间没有活动就删除 秒
+        size_t fd_cache_size_;      // 下载文件缓存最多保持打开的文件数 0表示不缓存
+        size_t memory_cache_size_;  // 小文件内存缓存的字节数 0表示不缓存
+        size_t memory_cache_max_file_; // 超过该大小的文件不放入内存缓存
+        size_t block_cache_size_;   // 流式下载共用的解压块缓存的字节数 0表示不缓存
+        int64_t cache_max_age_;     // 下载响应Cache-Control的max-age 秒 0表示每次使用前都要验证
+        std::string storage_io_;    // 存储IO后端 posix或io_uring
+        int io_uring_buffers_;      // io_uring每个线程注册的缓冲区数 每块deep_block_size字节
+        size_t journal_compact_threshold_; // 元数据日志记录数达到该值时压缩为快照
+        int64_t tiering_idle_seconds_;  // 普通存储中的文件超过该时间未访问就压缩到深度存储 0表示不分层
+        int tiering_scan_interval_;     // 分层扫描间隔 秒
+        int tiering_threads_;           // 压缩线程数
+        uint64_t tiering_rate_limit_;   // 分层时读写磁盘的速率上限 字节/秒 0表示不限速
+        uint32_t deep_block_size_;      // 深度存储块容器的块大小
+        int compress_threads_;          // 归档时并行压缩块的线程数 0表示按CPU核数
+        std::string compress_policy_;   // 压缩格式的选择策略 fast/balanced/ratio/fixed
+        double compress_min_ratio_;     // 样本压缩后与原大小之比高于该值时不压缩
+        bool chunk_dedup_;              // 上传的文件按内容分块去重 保存在分块存储中 默认关闭
+                                        // 去重的文件只保存清单 不参与冷热分层 开启后普通存储的冷文件不再压缩到深度存储
+        std::string chunk_storage_dir_; // 分块存储目录
+        uint32_t chunk_min_size_;       // 分块的最小、平均、最大长度
+        uint32_t chunk_avg_size_;
+        uint32_t chunk_max_size_;
+        int64_t chunk_gc_delay_;        // 引用计数降为0的分块过该时间才删除 秒
+        std::string segment_storage_dir_; // 段存储目录
+        size_t segment_max_file_;         // 不超过该大小的上传文件追加到段文件中 0表示不使用段存储
+        uint64_t segment_size_;           // 段文件写到该大小后换新段
+        double segment_compact_garbage_;  // 段中已删除数据的比例达到该值时压缩
+        int segment_compact_interval_;    // 段压缩的扫描间隔 秒
+        int validate_threads_;            // 启动后在后台校验存储文件的线程数
     public:
         static std::mutex _mutex;  // 声明（告诉编译器存在这个静态成员）
         static Config *_instance; // 声明 单例模式
@@ -51,6 +87,120 @@ namespace storage
             low_storage_dir_ = config_json["low_storage_dir"].asString();
             bundle_format_ = config_json["bundle_format"].asInt();
             storage_info_ = config_json["storage_info"].asString();
+            server_threads_ = config_json["server_threads"].asInt();
+            upload_buffer_size_ = config_json["upload_buffer_size"].asUInt64();
+            if (upload_buffer_size_ == 0) {
+                upload_buffer_size_ = 1024 * 1024;
+            }
+            upload_max_body_size_ = config_json["upload_max_body_size"].asUInt64();
+            if (upload_max_body_size_ == 0) {
+                upload_max_body_size_ = 64 * 1024 * 1024;
+            }
+            io_threads_ = config_json["io_threads"].asInt();
+            if (io_threads_ <= 0) {
+                io_threads_ = 4;
+            }
+            upload_session_timeout_ = config_json["upload_session_timeout"].asInt64();
+            if (upload_session_timeout_ <= 0) {
+                upload_session_timeout_ = 24 * 3600;
+            }
+            fd_cache_size_ = 256;
+            if (config_json.isMember("fd_cache_size")) {
+                fd_cache_size_ = std::max(0, config_json["fd_cache_size"].asInt());
+            }
+            memory_cache_size_ = 64 * 1024 * 1024;
+            if (config_json.isMember("memory_cache_size")) {
+                memory_cache_size_ = config_json["memory_cache_size"].asUInt64();
+            }
+            memory_cache_max_file_ = config_json["memory_cache_max_file"].asUInt64();
+            if (memory_cache_max_file_ == 0) {
+                memory_cache_max_file_ = 1024 * 1024;
+            }
+            block_cache_size_ = 32 * 1024 * 1024;
+            if (config_json.isMember("block_cache_size")) {
+                block_cache_size_ = config_json["block_cache_size"].asUInt64();
+            }
+            cache_max_age_ = std::max<int64_t>(0, config_json["cache_max_age"].asInt64());
+            storage_io_ = config_json["storage_io"].asString();
+            if (storage_io_.empty()) {
+                storage_io_ = "posix";
+            }
+            io_uring_buffers_ = config_json["io_uring_buffers"].asInt();
+            if (io_uring_buffers_ < 0) {
+                io_uring_buffers_ = 0;
+            }
+            journal_compact_threshold_ = config_json["journal_compact_threshold"].asUInt64();
+            if (journal_compact_threshold_ == 0) {
+                journal_compact_threshold_ = 10000;
+            }
+            tiering_idle_seconds_ = config_json["tiering_idle_seconds"].asInt64();
+            tiering_scan_interval_ = config_json["tiering_scan_interval"].asInt();
+            if (tiering_scan_interval_ <= 0) {
+                tiering_scan_interval_ = 600;
+            }
+            tiering_threads_ = config_json["tiering_threads"].asInt();
+            if (tiering_threads_ <= 0) {
+                tiering_threads_ = 1;
+            }
+            tiering_rate_limit_ = config_json["tiering_rate_limit"].asUInt64();
+            deep_block_size_ = config_json["deep_block_size"].asUInt();
+            if (deep_block_size_ == 0) {
+                deep_block_size_ = 1024 * 1024;
+            }
+            compress_threads_ = config_json["compress_threads"].asInt();
+            if (compress_threads_ <= 0) {
+                compress_threads_ = std::max(1u, std::thread::hardware_concurrency());
+            }
+            compress_policy_ = config_json["compress_policy"].asString();
+            if (compress_policy_.empty()) {
+                compress_policy_ = "balanced";
+            }
+            compress_min_ratio_ = config_json["compress_min_ratio"].asDouble();
+            if (compress_min_ratio_ <= 0) {
+                compress_min_ratio_ = 0.9;
+            }
+            chunk_dedup_ = config_json["chunk_dedup"].asBool();
+            chunk_storage_dir_ = config_json["chunk_storage_dir"].asString();
+            if (chunk_storage_dir_.empty()) {
+                chunk_storage_dir_ = "./chunk_storage/";
+            }
+            chunk_avg_size_ = config_json["chunk_avg_size"].asUInt();
+            if (chunk_avg_size_ < 256) {
+                chunk_avg_size_ = 64 * 1024;
+            }
+            chunk_min_size_ = config_json["chunk_min_size"].asUInt();
+            if (chunk_min_size_ == 0 || chunk_min_size_ > chunk_avg_size_) {
+                chunk_min_size_ = chunk_avg_size_ / 4;
+            }
+            chunk_max_size_ = config_json["chunk_max_size"].asUInt();
+            if (chunk_max_size_ < chunk_avg_size_) {
+                chunk_max_size_ = chunk_avg_size_ * 4;
+            }
+            chunk_gc_delay_ = 3600;
+            if (config_json.isMember("chunk_gc_delay")) {
+                chunk_gc_delay_ = std::max<int64_t>(0, config_json["chunk_gc_delay"].asInt64());
+            }
+            segment_storage_dir_ = config_json["segment_storage_dir"].asString();
+            if (segment_storage_dir_.empty()) {
+                segment_storage_dir_ = "./segment_storage/";
+            }
+            segment_max_file_ = config_json["segment_max_file"].asUInt64();
+            segment_size_ = config_json["segment_size"].asUInt64();
+            if (segment_size_ < segment_max_file_ || segment_size_ == 0) {
+                segment_size_ = std::max<uint64_t>(segment_max_file_, 64 * 1024 * 1024);
+            }
+            segment_compact_garbage_ = config_json["segment_compact_garbage"].asDouble();
+            if (segment_compact_garbage_ <= 0 || segment_compact_garbage_ > 1) {
+                segment_compact_garbage_ = 0.5;
+            }
+            segment_compact_interval_ = config_json["segment_compact_interval"].asInt();
+            if (segment_compact_interval_ <= 0) {
+                segment_compact_interval_ = 600;
+            }
+            validate_threads_ = config_json["validate_threads"].asInt();
+            if (validate_threads_ <= 0) {
+                validate_threads_ = 8;
+            }
             return true;
         }
 
@@ -89,6 +239,169 @@ namespace storage
             return low_storage_dir_;
         }
 
+        // 获取工作线程数
+        int GetServerThreads() {
+            return server_threads_;
+        }
+
+        // 获取上传缓冲区大小
+        size_t GetUploadBufferSize() {
+            return upload_buffer_size_;
+        }
+
+        // 获取整体缓存的请求体上限
+        size_t GetUploadMaxBodySize() {
+            return upload_max_body_size_;
+        }
+
+        // 获取IO线程数
+        int GetIoThreads() {
+            return io_threads_;
+        }
+
+        // 获取分块上传会话的超时时间
+        int64_t GetUploadSessionTimeout() {
+            return upload_session_timeout_;
+        }
+
+        // 获取下载文件缓存的容量
+        size_t GetFdCacheSize() {
+            return fd_cache_size_;
+        }
+
+        // 获取小文件内存缓存的字节数
+        size_t GetMemoryCacheSize() {
+            return memory_cache_size_;
+        }
+
+        // 获取放入内存缓存的文件大小上限
+        size_t GetMemoryCacheMaxFile() {
+            return memory_cache_max_file_;
+        }
+
+        // 获取解压块缓存的字节数
+        size_t GetBlockCacheSize() {
+            return block_cache_size_;
+        }
+
+        // 获取下载响应的缓存有效期
+        int64_t GetCacheMaxAge() {
+            return cache_max_age_;
+        }
+
+        // 获取存储IO后端
+        std::string GetStorageIo() {
+            return storage_io_;
+        }
+
+        // 获取io_uring注册缓冲区数
+        int GetIoUringBuffers() {
+            return io_uring_buffers_;
+        }
+
+        // 获取元数据日志压缩阈值
+        size_t GetJournalCompactThreshold() {
+            return journal_compact_threshold_;
+        }
+
+        // 获取分层的空闲时间阈值
+        int64_t GetTieringIdleSeconds() {
+            return tiering_idle_seconds_;
+        }
+
+        // 获取分层扫描间隔
+        int GetTieringScanInterval() {
+            return tiering_scan_interval_;
+        }
+
+        // 获取分层压缩线程数
+        int GetTieringThreads() {
+            return tiering_threads_;
+        }
+
+        // 获取分层读写速率上限
+        uint64_t GetTieringRateLimit() {
+            return tiering_rate_limit_;
+        }
+
+        // 获取深度存储的块大小
+        uint32_t GetDeepBlockSize() {
+            return deep_block_size_;
+        }
+
+        // 获取并行压缩线程数
+        int GetCompressThreads() {
+            return compress_threads_;
+        }
+
+        // 获取压缩格式的选择策略
+        std::string GetCompressPolicy() {
+            return compress_policy_;
+        }
+
+        // 获取压缩的最低收益
+        double GetCompressMinRatio() {
+            return compress_min_ratio_;
+        }
+
+        // 是否按内容分块去重
+        bool GetChunkDedup() {
+            return chunk_dedup_;
+        }
+
+        // 获取分块存储目录
+        std::string GetChunkStorageDir() {
+            return chunk_storage_dir_;
+        }
+
+        // 获取分块的最小、平均、最大长度
+        uint32_t GetChunkMinSize() {
+            return chunk_min_size_;
+        }
+
+        uint32_t GetChunkAvgSize() {
+            return chunk_avg_size_;
+        }
+
+        uint32_t GetChunkMaxSize() {
+            return chunk_max_size_;
+        }
+
+        // 获取无引用分块的删除延迟
+        int64_t GetChunkGcDelay() {
+            return chunk_gc_delay_;
+        }
+
+        // 获取段存储目录
+        std::string GetSegmentStorageDir() {
+            return segment_storage_dir_;
+        }
+
+        // 获取追加到段文件的最大文件大小
+        size_t GetSegmentMaxFile() {
+            return segment_max_file_;
+        }
+
+        // 获取段文件的大小
+        uint64_t GetSegmentSize() {
+            return segment_size_;
+        }
+
+        // 获取触发段压缩的垃圾比例
+        double GetSegmentCompactGarbage() {
+            return segment_compact_garbage_;
+        }
+
+        // 获取段压缩的扫描间隔
+        int GetSegmentCompactInterval() {
+            return segment_compact_interval_;
+        }
+
+        // 获取校验存储文件的线程数
+        int GetValidateThreads() {
+            return validate_threads_;
+        }
+
         // 获取存储信息文件路径
         std::string GetStorageInfoFile() {
             return storage_info_;
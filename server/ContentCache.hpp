@@ -0,0 +1,257 @@
+#pragma once
+#include "FileCache.hpp"
+
+namespace storage
+{
+    //
+    // 访问频率的近似计数 Count-Min Sketch
+    // - depth行 每行width个4bit计数器(用uint8_t保存 上限15)
+    // - 计数总数达到width*10时所有计数器减半 让频率随时间衰减
+    //
+    class FrequencySketch
+    {
+    private:
+        static const int depth = 4;
+        std::vector<uint8_t> table_;
+        size_t mask_;
+        size_t additions_ = 0;
+        size_t sample_size_;
+    public:
+        explicit FrequencySketch(size_t width) {
+            size_t n = 1024;
+            while (n < width && n < (1u << 20)) {
+                n <<= 1;
+            }
+            table_.assign(n * depth, 0);
+            mask_ = n - 1;
+            sample_size_ = n * 10;
+        }
+
+        void Increment(size_t hash) {
+            bool added = false;
+            for (int i = 0; i < depth; i++) {
+                uint8_t &c = table_[Index(hash, i)];
+                if (c < 15) {
+                    c++;
+                    added = true;
+                }
+            }
+            if (added && ++additions_ >= sample_size_) {
+                for (auto &c : table_) {
+                    c >>= 1;
+                }
+                additions_ /= 2;
+            }
+        }
+
+        int Frequency(size_t hash) const {
+            int freq = 15;
+            for (int i = 0; i < depth; i++) {
+                freq = std::min<int>(freq, table_[Index(hash, i)]);
+            }
+            return freq;
+        }
+
+    private:
+        size_t Index(size_t hash, int row) const {
+            uint64_t h = (hash + row) * 0x9E3779B97F4A7C15ull;
+            h ^= h >> 32;
+            return row * (mask_ + 1) + (h & mask_);
+        }
+    };
+
+    //
+    // 小文件的内存缓存
+    // - 按字节数限制总大小 超过max_file的文件不缓存
+    // - 按url的哈希分为shard_count个分片 各自加锁 每个分片有自己的容量(总容量/shard_count)、分段LRU和频率计数
+    //   每次下载都要查找 分片后不同url的下载不在同一把锁上排队
+    // - 分段LRU: 新文件进入试用段 再次命中后升入保护段 保护段最多占分片容量的protected_ratio 超出的部分降回试用段
+    // - TinyLFU准入: 空间不足时 新文件的访问频率高于将被淘汰的文件才放入 偶尔访问的大量文件不会冲掉热点文件
+    // - 文件内容保存在CachedFile::content_中 以evbuffer_add_reference零拷贝发送
+    // - 与FileCache一样按url失效 并用所在分片的generation避免把旧内容放回缓存
+    //
+    class ContentCache
+    {
+    public:
+        struct Stats
+        {
+            uint64_t hits_ = 0;
+            uint64_t misses_ = 0;
+            size_t used_ = 0;     // 已用字节数
+            size_t entries_ = 0;
+            size_t capacity_ = 0;
+        };
+    private:
+        struct Entry
+        {
+            std::string url_;
+            std::shared_ptr<const CachedFile> file_;
+            size_t bytes_;
+            bool protected_;
+        };
+        struct Shard
+        {
+            std::mutex mutex_;
+            std::list<Entry> probation_; // 试用段 最近使用的在前
+            std::list<Entry> protected_; // 保护段 最近使用的在前
+            std::unordered_map<std::string, std::list<Entry>::iterator> map_;
+            FrequencySketch sketch_;
+            size_t used_ = 0;
+            size_t protected_used_ = 0;
+            uint64_t hits_ = 0;
+            uint64_t misses_ = 0;
+            uint64_t generation_ = 0;
+
+            explicit Shard(size_t width) : sketch_(width) {}
+        };
+        static const size_t shard_count = 16;
+        const double protected_ratio = 0.8;
+        const size_t entry_overhead = 128; // 每项的簿记开销 计入已用字节数
+        std::vector<std::unique_ptr<Shard>> shards_;
+        size_t capacity_;       // 每个分片的容量
+        size_t total_capacity_;
+        size_t max_file_;
+    public:
+        ContentCache(size_t capacity, size_t max_file)
+            : capacity_(capacity / shard_count), total_capacity_(capacity), max_file_(std::min(max_file, capacity_)) {
+            for (size_t i = 0; i < shard_count; i++) {
+                shards_.emplace_back(new Shard(capacity_ / 4096));
+            }
+        }
+
+        //
+        // 查找并记录一次访问 未命中也计入频率
+        //
+        bool Get(const std::string &url, std::shared_ptr<const CachedFile> *file) {
+            if (capacity_ == 0) {
+                return false;
+            }
+            Shard &shard = GetShard(url);
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            shard.sketch_.Increment(Hash(url));
+            auto it = shard.map_.find(url);
+            if (it == shard.map_.end()) {
+                shard.misses_++;
+                return false;
+            }
+            shard.hits_++;
+            auto pos = it->second;
+            *file = pos->file_;
+            if (pos->protected_) {
+                shard.protected_.splice(shard.protected_.begin(), shard.protected_, pos);
+                return true;
+            }
+            // 试用段中再次命中 升入保护段
+            pos->protected_ = true;
+            shard.protected_used_ += pos->bytes_;
+            shard.protected_.splice(shard.protected_.begin(), shard.probation_, pos);
+            while (shard.protected_used_ > capacity_ * protected_ratio && shard.protected_.size() > 1) {
+                auto last = std::prev(shard.protected_.end());
+                last->protected_ = false;
+                shard.protected_used_ -= last->bytes_;
+                shard.probation_.splice(shard.probation_.begin(), shard.protected_, last);
+            }
+            return true;
+        }
+
+        uint64_t Generation(const std::string &url) {
+            Shard &shard = GetShard(url);
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            return shard.generation_;
+        }
+
+        //
+        // 大小为size的文件是否可能被放入缓存 用于在读取文件内容之前判断
+        //
+        bool Admit(const std::string &url, size_t size) {
+            if (size == 0 || size > max_file_) {
+                return false;
+            }
+            Shard &shard = GetShard(url);
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            return AdmitLocked(shard, url, size + url.size() + entry_overhead);
+        }
+
+        void Put(const std::string &url, std::shared_ptr<const CachedFile> file, uint64_t generation) {
+            size_t bytes = file->content_->size() + url.size() + entry_overhead;
+            Shard &shard = GetShard(url);
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            if (generation != shard.generation_ || file->content_->size() > max_file_) {
+                return;
+            }
+            auto it = shard.map_.find(url);
+            if (it != shard.map_.end()) {
+                Erase(shard, it);
+            }
+            if (AdmitLocked(shard, url, bytes) == false) {
+                return;
+            }
+            while (shard.used_ + bytes > capacity_) {
+                std::list<Entry> &segment = shard.probation_.empty() ? shard.protected_ : shard.probation_;
+                Erase(shard, shard.map_.find(segment.back().url_));
+            }
+            shard.probation_.push_front(Entry{url, std::move(file), bytes, false});
+            shard.map_[url] = shard.probation_.begin();
+            shard.used_ += bytes;
+        }
+
+        void Invalidate(const std::string &url) {
+            Shard &shard = GetShard(url);
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            shard.generation_++;
+            auto it = shard.map_.find(url);
+            if (it != shard.map_.end()) {
+                Erase(shard, it);
+            }
+        }
+
+        Stats GetStats() {
+            Stats stats;
+            for (auto &shard : shards_) {
+                std::lock_guard<std::mutex> lock(shard->mutex_);
+                stats.hits_ += shard->hits_;
+                stats.misses_ += shard->misses_;
+                stats.used_ += shard->used_;
+                stats.entries_ += shard->map_.size();
+            }
+            stats.capacity_ = total_capacity_;
+            return stats;
+        }
+
+    private:
+        Shard &GetShard(const std::string &url) {
+            return *shards_[Hash(url) % shard_count];
+        }
+
+        //
+        // 空间足够时直接准入 否则与第一个要淘汰的文件比较访问频率
+        //
+        bool AdmitLocked(Shard &shard, const std::string &url, size_t bytes) {
+            if (bytes > capacity_) {
+                return false;
+            }
+            if (shard.used_ + bytes <= capacity_) {
+                return true;
+            }
+            const std::list<Entry> &segment = shard.probation_.empty() ? shard.protected_ : shard.probation_;
+            return shard.sketch_.Frequency(Hash(url)) > shard.sketch_.Frequency(Hash(segment.back().url_));
+        }
+
+        void Erase(Shard &shard, std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it) {
+            auto pos = it->second;
+            shard.used_ -= pos->bytes_;
+            if (pos->protected_) {
+                shard.protected_used_ -= pos->bytes_;
+                shard.protected_.erase(pos);
+            }
+            else {
+                shard.probation_.erase(pos);
+            }
+            shard.map_.erase(it);
+        }
+
+        static size_t Hash(const std::string &url) {
+            return std::hash<std::string>()(url);
+        }
+    };
+}
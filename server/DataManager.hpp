@@ -1,6 +1,19 @@
 #pragma once
 #include "Config.hpp"
+#include "MetaIndex.hpp"
+#include "Sha256.hpp"
+#include "ThreadPool.hpp"
+#include <map>
 #include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 namespace storage
 {
     //
@@ -12,122 +25,1136 @@ namespace storage
         time_t atime_;
         size_t fsize_;
         std::string storage_path_; // 文件存储路径
-        std::string url_;          // 请求URL中的资源路径 
+        std::string url_;          // 请求URL中的资源路径
+        int pack_format_ = -1;     // 压缩格式 bundle的枚举值 -1表示未压缩
+        std::string hash_;         // 原文件内容的SHA-256 32字节 空表示未知
+        uint64_t offset_ = 0;      // 数据在存储文件中的偏移 段文件中的小文件使用
     };
 
+    // StorageInfo::pack_format_ 存储文件是段文件 数据从offset_开始 长度为fsize_ 见SegmentStore.hpp
+    const int32_t segment_needle_format = 0x200;
+
     //
     // 文件管理器类
     // 传入一个文件名，创建一个DataManager对象，该对象可以对该文件进行操作
-    // - bool Insert(const StorageInfo &info) 插入一条存储信息到文件管理器类初始化时的storage_info_file_中
-    // - bool Store() 将文件管理器类中的信息存到storage_info_file_中
+    // 快照为mmap的二进制索引storage_info_file_.idx(见MetaIndex.hpp) 查找直接在映射上二分
+    // 快照之后的每次修改以一行json追加到日志文件storage_info_file_.journal中 同时记录在内存的overlay中
+    // 日志记录数超过阈值时由后台线程把快照和overlay合并成新的索引并清空日志
+    // 首次启动时若只有旧的json格式storage_info_file_ 会一次性转换为二进制索引
+    // #### 并发
+    // - overlay按url的哈希分成shard_count个分片 每个分片一把读写锁
+    // - 读只持有所在分片的读锁 不同分片的写互不阻塞 写也不阻塞其他分片的读
+    // #### 有序索引
+    // - url可以是以'/'分隔的多级路径 快照按url有序 overlay分片是按url有序的map
+    // - 前缀和区间查询在快照上二分定位 在各分片上lower_bound 只读取区间内的记录 O(log N + k)
+    // - 索引快照不可变 持有全部分片的写锁时替换 按url查找在分片读锁内直接使用 不复制shared_ptr
+    //   遍历和区间查询在锁内复制shared_ptr 之后持有旧快照时不受替换影响
+    // #### 内容哈希索引
+    // - 内存中记录内容哈希到url的映射 启动后由后台校验生成 插入和替换时更新
+    // - 删除或覆盖时不更新 查找时再按url核对存储信息 不一致的映射在查找时删除
+    // #### 启动校验
+    // - 启动时只映射索引和重放日志 不访问存储文件 启动时间与文件数无关
+    // - 后台线程遍历全部存储信息 每批交给validate_threads个线程并行stat
+    //   存储文件不存在或段文件被截断的记录在遍历结束后一次性删除 只压缩一次索引
+    //   未压缩文件的大小与记录不同时按文件更新记录
+    // - 校验完成之前 存储文件已丢失的下载返回错误 秒传查不到内容时客户端照常上传
+    // - 校验线程由StartValidation启动 调用方先设置好回调 校验期间的修改都能通知到
+    // #### 接口
+    // - bool Insert(const StorageInfo &info) 插入或更新一条存储信息 并追加一条日志
+    // - bool Delete(const std::string &url) 删除一条存储信息 并追加一条日志
+    // - bool Replace(const StorageInfo &old_info, const StorageInfo &new_info) 存储信息未变化时替换为new_info
+    // - void Touch(const std::string &url, time_t atime) 更新最近访问时间
+    // - void SetChangeCallback(std::function<void(const std::string &)> callback) 插入、删除、替换存储信息时以url回调 不包括Touch
+    //   在StartValidation之前调用
+    // - void StartValidation(std::function<void()> after) 启动后台校验 校验完成后在校验线程中执行after
+    // - void Stop() 停止后台校验和压缩 等待线程结束 校验线程中的after使用其他全局对象时在它们析构前调用
+    // - bool Stopping() 是否已经调用Stop 供after中的长任务提前结束
+    // - bool Store() 将文件管理器类中的信息存成新的索引 即日志压缩
+    // - bool GetOneByURL(const std::string &key, StorageInfo *info) 根据url获取存储信息
+    // - bool FindByHash(const std::string &hash, size_t fsize, StorageInfo *info) 查找内容哈希和大小相同的存储信息
     // - bool GetInfo(std::vector<StorageInfo> *arry) 读取文件管理器类中的信息
-    // - bool InitLoad() 初始化文件管理器类
+    // - void ForEach(Func func) 遍历全部存储信息 不复制整个列表
+    // - ValidateStats GetValidateStats() 启动校验的进度
+    // - void List(order, desc, cursor, limit, page, more) 按url/mtime/fsize的顺序分页读取
+    // - void ListRange(from, to, limit, page, more) 按url顺序读取[from, to)区间内的存储信息
+    // - void ListPrefix(prefix, start_after, limit, page, more) 按url顺序读取以prefix开头的存储信息
+    // - size_t Count(const std::string &prefix) url以prefix开头的存储信息条数
+    // - void ListDirectory(dir, start_after, limit, entries, more) 列出目录下的文件和子目录 子目录带文件数
+    // - bool InitLoad() 初始化文件管理器类 映射索引并重放日志
+    // - static bool ConvertFromJson(json_file, index_file) 把json格式的存储信息转换为二进制索引
 
     class DataManager
     {
+    public:
+        enum ListOrder { LIST_BY_URL, LIST_BY_MTIME, LIST_BY_SIZE };
+
+        //
+        // 分页游标 排在该位置之后的记录属于下一页
+        // - value_为排序键mtime或fsize 按url排序时不使用
+        //
+        struct ListCursor
+        {
+            uint64_t value_ = 0;
+            std::string url_;
+        };
+
+        //
+        // 目录列表中的一项
+        // - 子目录的name_以'/'结尾 count_为其下各级的文件总数
+        // - 文件的info_为其存储信息
+        //
+        struct DirEntry
+        {
+            std::string name_;
+            bool dir_ = false;
+            size_t count_ = 0;
+            StorageInfo info_;
+        };
+
+        //
+        // 启动校验的进度
+        // - checked_ 已校验的记录数 purged_ 删除的记录数 refreshed_ 按文件更新了大小的记录数
+        //
+        struct ValidateStats
+        {
+            bool done_ = false;
+            uint64_t checked_ = 0;
+            uint64_t purged_ = 0;
+            uint64_t refreshed_ = 0;
+        };
     private:
-        std::string storage_info_file_; // 保存存储文件信息的文件
-        std::unordered_map<std::string, StorageInfo> storage_info_map_; // 保存存储文件信息的map key为url value为StorageInfo对象
+        //
+        // 快照之后的修改 deleted_为true表示删除
+        // seq_用于压缩完成后判断该修改是否已经包含在新索引中
+        //
+        struct OverlayEntry
+        {
+            StorageInfo info_;
+            bool deleted_;
+            uint64_t seq_;
+        };
+        typedef std::map<std::string, OverlayEntry, std::less<>> Overlay; // 按url有序 支持前缀和区间查询
+
+        //
+        // overlay分片
+        //
+        struct Shard
+        {
+            std::shared_mutex mutex_;
+            Overlay overlay_; // 快照之后的修改 key为url
+        };
+        static const size_t shard_count = 64;
+        static const time_t atime_granularity = 3600; // 最近访问时间的精度 避免每次下载都写日志
+
+        std::string storage_info_file_; // 旧的json格式存储信息文件 只用于首次转换
+        std::string index_file_;        // 二进制索引快照
+        std::string journal_file_;      // 追加写的日志文件
+        std::string compacting_file_;   // 压缩过程中被换下的日志文件
+        std::shared_ptr<MetaIndex> index_; // 映射到内存的快照 持有全部分片的写锁时替换 持有任一分片的锁时可以读取
+        Shard shards_[shard_count];
+        std::atomic<uint64_t> seq_{0};
+        std::mutex journal_mutex_;   // 保护日志文件、journal_records_和stop_
+        int journal_fd_ = -1;        // 日志文件描述符 以O_APPEND打开
+        size_t journal_records_ = 0; // 当前日志中的记录数
+        size_t compact_threshold_;   // 日志记录数超过该值时触发压缩
+        std::mutex store_mutex_;     // 串行化快照的写入
+        std::thread compact_thread_; // 后台压缩线程
+        std::condition_variable compact_cond_;
+        bool stop_ = false;
+        std::function<void(const std::string &)> on_change_; // 在分片写锁内调用
+        std::mutex hash_mutex_; // 保护hash_index_ 不在持有它时获取分片锁
+        std::unordered_map<std::string, std::string> hash_index_; // 内容哈希到url 同一内容只记录最近的一个url
+        std::thread validate_thread_; // 启动校验线程
+        std::mutex validate_mutex_;   // 保护validate_stats_
+        ValidateStats validate_stats_;
     public:
         //
         // 类构造
         //
-        DataManager() {
-            storage_info_file_ = storage::Config::GetInstance()->GetStorageInfoFile();
+        DataManager() : DataManager(storage::Config::GetInstance()->GetStorageInfoFile()) {}
+
+        explicit DataManager(const std::string &storage_info_file) {
+            storage_info_file_ = storage_info_file;
+            index_file_ = storage_info_file_ + ".idx";
+            journal_file_ = storage_info_file_ + ".journal";
+            compacting_file_ = journal_file_ + ".compacting";
+            compact_threshold_ = storage::Config::GetInstance()->GetJournalCompactThreshold();
+            index_ = std::make_shared<MetaIndex>();
             InitLoad();
+            compact_thread_ = std::thread(&DataManager::CompactLoop, this);
         }
-        ~DataManager(){}
-        
+        ~DataManager() {
+            Stop();
+            if (journal_fd_ != -1) {
+                close(journal_fd_);
+            }
+        }
+
+        //
+        // 启动后台校验
+        // - 在SetChangeCallback之后调用 校验删除或更新记录时回调已经就绪
+        // - after在校验完成后于校验线程中执行 用于需要遍历存储信息的启动任务 如重建分块引用
+        //
+        void StartValidation(std::function<void()> after = nullptr) {
+            validate_thread_ = std::thread([this, after]() {
+                Validate();
+                if (after && Stopping() == false) {
+                    after();
+                }
+            });
+        }
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> lock(journal_mutex_);
+                stop_ = true;
+            }
+            compact_cond_.notify_one();
+            if (validate_thread_.joinable()) {
+                validate_thread_.join();
+            }
+            if (compact_thread_.joinable()) {
+                compact_thread_.join();
+            }
+        }
+
+        bool Stopping() {
+            std::lock_guard<std::mutex> lock(journal_mutex_);
+            return stop_;
+        }
+
         //
         // 初始化文件管理器
+        // - 映射索引快照 不存在时从json格式的storage_info_file_转换
+        // - 依次重放上次压缩未完成时留下的日志、当前日志
+        // - 日志记录都是整条的插入或删除 重复重放不影响结果
+        // - 不访问存储文件 存储文件的校验在后台进行 见Validate
         //
         bool InitLoad() {
-            storage::FileUtil storage_info_util(storage_info_file_);
-            if (!storage_info_util.Exist()) { // 文件操作类绑定的文件不存在
-                return false;
+            std::shared_ptr<MetaIndex> index = std::make_shared<MetaIndex>();
+            if (!index->Open(index_file_)) {
+                if (FileUtil(storage_info_file_).Exist()) {
+                    if (!ConvertFromJson(storage_info_file_, index_file_)) {
+                        return false;
+                    }
+                    if (!index->Open(index_file_)) {
+                        return false;
+                    }
+                }
             }
-            Json::Value root;
-            std::string infoStr;
-            if (!storage_info_util.GetContent(&infoStr)) { // 获取文件内容
+            index_ = index;
+            bool has_compacting = FileUtil(compacting_file_).Exist();
+            Replay(compacting_file_);
+            journal_records_ = Replay(journal_file_);
+
+            journal_fd_ = open(journal_file_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (journal_fd_ == -1) {
                 return false;
             }
-            JSON_util::UnSerialize(infoStr, root); // 将文件内容反序列化为json对象
-            for (auto e : root) { // 遍历json对象
-                StorageInfo info;
-                info.storage_path_ = e["storage_path_"].asString();
-                info.mtime_ = e["mtime_"].asUInt64();
-                info.atime_ = e["atime_"].asUInt64();
-                info.url_ = e["url_"].asString();
-                info.fsize_ = e["fsize_"].asUInt64();
-                FileUtil file_util(info.storage_path_);
-                if (!file_util.Exist()) { // 文件不存在
-                    Store();
-                    continue;
-                }
-                Insert(info); // 将json对象中的信息插入到map中
+            if (has_compacting) {
+                return Store();
             }
             return true;
         }
 
-        // 
-        // 插入一条存储信息到map并将map的信息存到storage_info_file_中
+        //
+        // 启动校验 由StartValidation在validate_thread_中运行一次
+        // - 遍历时生成内容哈希索引 已由插入或替换记录的映射不覆盖
+        // - 每批batch_size条记录提交给线程池 排队的批数有上限 不会一次复制全部记录
+        // - 校验期间的上传、覆盖不受影响 删除和更新记录前核对记录未被修改
+        //
+        void Validate() {
+            const size_t batch_size = 1024;
+            size_t threads = Config::GetInstance()->GetValidateThreads();
+            ThreadPool pool(threads);
+            std::mutex mutex;
+            std::condition_variable cond;
+            size_t running = 0;
+            std::vector<StorageInfo> invalid;
+            std::vector<StorageInfo> batch;
+            auto submit = [&]() {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&]() { return running < threads * 2; });
+                running++;
+                lock.unlock();
+                pool.Submit([&, batch = std::move(batch)]() {
+                    std::vector<StorageInfo> bad;
+                    CheckFiles(batch, &bad);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    invalid.insert(invalid.end(), bad.begin(), bad.end());
+                    running--;
+                    cond.notify_all();
+                });
+                batch.clear();
+            };
+            ForEach([&](const StorageInfo &info) {
+                IndexHash(info, false);
+                if (Stopping()) {
+                    return;
+                }
+                batch.push_back(info);
+                if (batch.size() >= batch_size) {
+                    submit();
+                }
+            });
+            if (batch.empty() == false) {
+                submit();
+            }
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&]() { return running == 0; });
+            }
+            pool.Stop();
+            if (Stopping()) {
+                return;
+            }
+            size_t purged = Purge(invalid);
+            std::lock_guard<std::mutex> lock(validate_mutex_);
+            validate_stats_.purged_ = purged;
+            validate_stats_.done_ = true;
+        }
+
+        ValidateStats GetValidateStats() {
+            std::lock_guard<std::mutex> lock(validate_mutex_);
+            return validate_stats_;
+        }
+
+        //
+        // 插入一条存储信息并追加一条日志
+        // - 修改都是先写日志 写成功后才修改overlay 写日志失败时返回false 内存中的信息不变
+        // - 日志行在加锁前序列化 分片写锁内只做一次write 同一url的日志顺序与overlay一致
+        //   日志在压缩时切换也要持有全部分片的写锁 写入的记录不会落在已合并的日志中
+        // - insert和update在重放时没有区别 op只按加锁前是否存在标记
         //
         bool Insert(const StorageInfo &info) {
-            storage_info_map_[info.url_] = info;
-            if (Store() == false) {
+            StorageInfo old;
+            Json::Value record;
+            ToJson(info, &record);
+            record["op"] = GetOneByURL(info.url_, &old) ? "update" : "insert";
+            std::string line = JournalLine(record);
+            Shard &shard = GetShard(info.url_);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex_);
+            if (AppendJournal(line) == false) {
+                return false;
+            }
+            shard.overlay_[info.url_] = OverlayEntry{info, false, ++seq_};
+            NotifyChange(info.url_);
+            IndexHash(info);
+            return true;
+        }
+
+        //
+        // 删除一条存储信息并追加一条日志
+        //
+        bool Delete(const std::string &url) {
+            Json::Value record;
+            record["op"] = "delete";
+            record["url_"] = url;
+            std::string line = JournalLine(record);
+            Shard &shard = GetShard(url);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex_);
+            StorageInfo old;
+            if (FindInShard(shard, url, &old) == false || AppendJournal(line) == false) {
+                return false;
+            }
+            shard.overlay_[url] = OverlayEntry{StorageInfo(), true, ++seq_};
+            NotifyChange(url);
+            return true;
+        }
+
+        //
+        // 存储信息与old_info一致时替换为new_info 并追加一条日志
+        // - 用于后台任务移动文件 期间文件被重新上传时放弃替换
+        // - 记录的atime_取两者中较新的 期间被访问过时在锁内重新序列化
+        //
+        bool Replace(const StorageInfo &old_info, const StorageInfo &new_info) {
+            Json::Value record;
+            ToJson(new_info, &record);
+            record["op"] = "update";
+            std::string line = JournalLine(record);
+            Shard &shard = GetShard(old_info.url_);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex_);
+            StorageInfo cur;
+            if (FindInShard(shard, old_info.url_, &cur) == false || SameFile(cur, old_info) == false) {
                 return false;
             }
+            StorageInfo info = new_info;
+            if (cur.atime_ > info.atime_) {
+                info.atime_ = cur.atime_;
+                record["atime_"] = (Json::UInt64)info.atime_;
+                line = JournalLine(record);
+            }
+            if (AppendJournal(line) == false) {
+                return false;
+            }
+            shard.overlay_[info.url_] = OverlayEntry{info, false, ++seq_};
+            NotifyChange(info.url_);
+            IndexHash(info);
             return true;
         }
 
         //
-        // 将map的信息存到storage_info_file_中
+        // 设置存储信息变化时的回调 在开始处理请求之前调用
+        //
+        void SetChangeCallback(std::function<void(const std::string &)> callback) {
+            on_change_ = std::move(callback);
+        }
+
+        //
+        // 更新最近访问时间
+        // - 与已记录的时间相差不到atime_granularity时不做修改
+        //
+        void Touch(const std::string &url, time_t atime) {
+            Shard &shard = GetShard(url);
+            StorageInfo info;
+            {
+                std::shared_lock<std::shared_mutex> lock(shard.mutex_);
+                if (FindInShard(shard, url, &info) == false || atime - info.atime_ < atime_granularity) {
+                    return;
+                }
+            }
+            std::unique_lock<std::shared_mutex> lock(shard.mutex_);
+            if (FindInShard(shard, url, &info) == false || atime - info.atime_ < atime_granularity) {
+                return;
+            }
+            info.atime_ = atime;
+            Json::Value record;
+            ToJson(info, &record);
+            record["op"] = "update";
+            if (AppendJournal(JournalLine(record))) {
+                shard.overlay_[url] = OverlayEntry{info, false, ++seq_};
+            }
+        }
+
+        //
+        // 将快照和overlay合并成新的索引 即日志压缩
+        // - 持有全部分片的写锁拷贝overlay并把当前日志换成compacting_file_ 之后的修改写入新日志
+        //   overlay的大小受压缩阈值限制 持锁时间很短
+        // - 不持锁合并并写索引文件 再持有全部分片的写锁替换索引并删除已包含在新索引中的overlay项
+        // - 上次压缩留下的compacting_file_中的记录已在overlay中 先写索引再删除它
         //
         bool Store() {
-            std::vector<StorageInfo> infoVector;
-            if (!GetInfo(&infoVector)) { // 获取map中存储的信息
+            std::lock_guard<std::mutex> store_lock(store_mutex_);
+            std::shared_ptr<MetaIndex> index;
+            Overlay overlay;
+            uint64_t store_seq;
+            {
+                std::vector<std::unique_lock<std::shared_mutex>> locks;
+                for (auto &shard : shards_) {
+                    locks.emplace_back(shard.mutex_);
+                }
+                index = index_;
+                for (auto &shard : shards_) {
+                    overlay.insert(shard.overlay_.begin(), shard.overlay_.end());
+                }
+                store_seq = seq_;
+                std::lock_guard<std::mutex> lock(journal_mutex_);
+                if (!FileUtil(compacting_file_).Exist() && journal_fd_ != -1) {
+                    if (rename(journal_file_.c_str(), compacting_file_.c_str()) == 0) {
+                        int fd = open(journal_file_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                        if (fd == -1) {
+                            rename(compacting_file_.c_str(), journal_file_.c_str());
+                            return false;
+                        }
+                        close(journal_fd_);
+                        journal_fd_ = fd;
+                        journal_records_ = 0;
+                    }
+                }
+            }
+            MetaIndexWriter writer;
+            Merge(*index, overlay, [&writer](const StorageInfo &info) {
+                writer.Add(info.url_, info.storage_path_, info.mtime_, info.atime_, info.fsize_, info.pack_format_,
+                           info.hash_, info.offset_);
+            });
+            if (!writer.Write(index_file_)) {
                 return false;
             }
-            Json::Value root;
-            for (auto e : infoVector) { // 将map中的信息转换为json对象
-                Json::Value item;
-                item["storage_path_"] = e.storage_path_;
-                item["mtime_"] = e.mtime_;
-                item["atime_"] = e.atime_;
-                item["url_"] = e.url_;
-                item["fsize_"] = e.fsize_;
-                root.append(item);
-            }
-            std::string infoStr; // 存储json对象的字符串
-            JSON_util::Serialize(root, infoStr); // 将json对象序列化为字符串
-            FileUtil storage_info_util(storage_info_file_);
-            if (!storage_info_util.SetContent(infoStr.c_str(), infoStr.size())) { // 将字符串写入文件
+            std::shared_ptr<MetaIndex> new_index = std::make_shared<MetaIndex>();
+            if (!new_index->Open(index_file_)) {
                 return false;
             }
+            // 替换索引和删除overlay项在同一次持锁内完成 读者总能看到完整的数据
+            std::vector<std::unique_lock<std::shared_mutex>> locks;
+            for (auto &shard : shards_) {
+                locks.emplace_back(shard.mutex_);
+            }
+            index_ = std::move(new_index);
+            for (auto &shard : shards_) {
+                for (auto it = shard.overlay_.begin(); it != shard.overlay_.end();) {
+                    if (it->second.seq_ <= store_seq) {
+                        it = shard.overlay_.erase(it);
+                        continue;
+                    }
+                    ++it;
+                }
+            }
+            unlink(compacting_file_.c_str());
             return true;
         }
 
-        // 
+        //
         // 根据URL获取文件存储信息
+        // - 只持有url所在分片的读锁
         //
         bool GetOneByURL(const std::string &key, StorageInfo *info)
         {
-            // URL是key，所以直接find()找
-            if (storage_info_map_.find(key) == storage_info_map_.end()) {
+            Shard &shard = GetShard(key);
+            std::shared_lock<std::shared_mutex> lock(shard.mutex_);
+            return FindInShard(shard, key, info);
+        }
+
+        //
+        // 查找内容哈希和原文件大小都相同的存储信息
+        // - 映射到的url已被删除或覆盖为其他内容时删除该映射并返回false
+        // - 大小不同时返回false 不删除映射
+        //
+        bool FindByHash(const std::string &hash, size_t fsize, StorageInfo *info) {
+            std::string url;
+            {
+                std::lock_guard<std::mutex> lock(hash_mutex_);
+                auto it = hash_index_.find(hash);
+                if (it == hash_index_.end()) {
+                    return false;
+                }
+                url = it->second;
+            }
+            if (GetOneByURL(url, info) && info->hash_ == hash) {
+                return info->fsize_ == fsize;
+            }
+            std::lock_guard<std::mutex> lock(hash_mutex_);
+            auto it = hash_index_.find(hash);
+            if (it != hash_index_.end() && it->second == url) {
+                hash_index_.erase(it);
+            }
+            return false;
+        }
+
+        //
+        // 读取存储的全部信息
+        //
+        bool GetInfo(std::vector<StorageInfo> *arry) {
+            ForEach([arry](const StorageInfo &info) {
+                arry->emplace_back(info);
+            });
+            return true;
+        }
+
+        //
+        // 遍历全部存储信息
+        // - 持有全部分片的读锁取得一致的索引快照和overlay拷贝 遍历时不持锁
+        //
+        template <typename Func>
+        void ForEach(Func func) {
+            std::shared_ptr<MetaIndex> index;
+            Overlay overlay;
+            {
+                std::vector<std::shared_lock<std::shared_mutex>> locks;
+                for (auto &shard : shards_) {
+                    locks.emplace_back(shard.mutex_);
+                }
+                index = index_;
+                for (auto &shard : shards_) {
+                    overlay.insert(shard.overlay_.begin(), shard.overlay_.end());
+                }
+            }
+            Merge(*index, overlay, func);
+        }
+
+        //
+        // 按顺序分页读取存储信息
+        // - 索引快照按url有序 按mtime/fsize的顺序在快照上第一次使用时生成 二分定位游标后顺序读取
+        // - overlay中排在游标之后的项排序后与快照归并 overlay的大小受压缩阈值限制
+        // - cursor为nullptr表示从头开始 desc为true时按降序 排序键相同时按url排序
+        // - *more表示本页之后还有记录
+        //
+        void List(ListOrder order, bool desc, const ListCursor *cursor, size_t limit,
+                  std::vector<StorageInfo> *page, bool *more) {
+            std::shared_ptr<MetaIndex> index;
+            Overlay overlay;
+            {
+                std::vector<std::shared_lock<std::shared_mutex>> locks;
+                for (auto &shard : shards_) {
+                    locks.emplace_back(shard.mutex_);
+                }
+                index = index_;
+                for (auto &shard : shards_) {
+                    overlay.insert(shard.overlay_.begin(), shard.overlay_.end());
+                }
+            }
+            int dir = desc ? -1 : 1;
+            auto after_cursor = [&](uint64_t value, std::string_view url) {
+                return cursor == nullptr || Compare(order, value, url, cursor->value_, cursor->url_) * dir > 0;
+            };
+
+            // overlay中游标之后的项 只需要排出前limit+1项
+            std::vector<const StorageInfo *> changed;
+            for (auto &it : overlay) {
+                const StorageInfo &info = it.second.info_;
+                if (!it.second.deleted_ && after_cursor(SortValue(order, info), info.url_)) {
+                    changed.push_back(&info);
+                }
+            }
+            auto before = [order, dir](const StorageInfo *a, const StorageInfo *b) {
+                return Compare(order, SortValue(order, *a), a->url_, SortValue(order, *b), b->url_) * dir < 0;
+            };
+            size_t want = limit + 1;
+            size_t keep = std::min(want, changed.size());
+            std::partial_sort(changed.begin(), changed.begin() + keep, changed.end(), before);
+            changed.resize(keep);
+
+            // 在快照的有序序列上二分定位游标
+            const std::vector<uint32_t> *ids = nullptr;
+            if (order != LIST_BY_URL) {
+                ids = &index->SortedBy(order == LIST_BY_MTIME ? MetaIndex::ORDER_MTIME : MetaIndex::ORDER_SIZE);
+            }
+            auto at = [&](size_t i) { return index->At(ids ? (*ids)[i] : i); };
+            int64_t n = index->Size();
+            int64_t pos = desc ? n - 1 : 0;
+            if (cursor) {
+                // 升序从第一个大于游标的位置开始 降序从最后一个小于游标的位置开始
+                size_t lo = 0, hi = n;
+                while (lo < hi) {
+                    size_t mid = lo + (hi - lo) / 2;
+                    const IndexRecord *r = at(mid);
+                    int cmp = Compare(order, SortValue(order, r), index->Url(r), cursor->value_, cursor->url_);
+                    if (desc ? cmp < 0 : cmp <= 0) {
+                        lo = mid + 1;
+                    }
+                    else {
+                        hi = mid;
+                    }
+                }
+                pos = desc ? (int64_t)lo - 1 : lo;
+            }
+
+            // 归并快照和overlay 快照中已被overlay覆盖的记录跳过
+            StorageInfo snap;
+            bool has_snap = false;
+            auto next_snap = [&]() {
+                has_snap = false;
+                while (pos >= 0 && pos < n) {
+                    const IndexRecord *r = at(pos);
+                    pos += dir;
+                    if (!overlay.empty() && overlay.count(std::string(index->Url(r)))) {
+                        continue;
+                    }
+                    RecordToInfo(*index, r, &snap);
+                    has_snap = true;
+                    return;
+                }
+            };
+            next_snap();
+            size_t ci = 0;
+            while (page->size() < want && (has_snap || ci < changed.size())) {
+                if (ci < changed.size() && (has_snap == false || before(changed[ci], &snap))) {
+                    page->push_back(*changed[ci++]);
+                }
+                else {
+                    page->push_back(snap);
+                    next_snap();
+                }
+            }
+            *more = page->size() > limit;
+            if (*more) {
+                page->resize(limit);
+            }
+        }
+
+        //
+        // 按url顺序读取[from, to)区间内的存储信息 to为空表示没有上界
+        // - *more表示区间内本页之后还有记录
+        //
+        void ListRange(const std::string &from, const std::string &to, size_t limit,
+                       std::vector<StorageInfo> *page, bool *more) {
+            RangeScan scan(this, from, to);
+            StorageInfo info;
+            while (page->size() <= limit && scan.Next(&info)) {
+                page->push_back(info);
+            }
+            *more = page->size() > limit;
+            if (*more) {
+                page->resize(limit);
+            }
+        }
+
+        //
+        // 按url顺序读取以prefix开头的存储信息 从url大于start_after的记录开始
+        //
+        void ListPrefix(const std::string &prefix, const std::string &start_after, size_t limit,
+                        std::vector<StorageInfo> *page, bool *more) {
+            std::string from = start_after < prefix ? prefix : start_after + '\0';
+            ListRange(from, PrefixEnd(prefix), limit, page, more);
+        }
+
+        //
+        // url以prefix开头的存储信息条数
+        // - 快照部分是两次二分的差 只逐条检查overlay中落在前缀内的项
+        //
+        size_t Count(const std::string &prefix) {
+            RangeScan scan(this, prefix, PrefixEnd(prefix));
+            return scan.Count(prefix);
+        }
+
+        //
+        // 列出目录dir(以'/'结尾的url前缀)下的直接子项 按名字顺序 从名字大于start_after的项开始
+        // - 同一子目录下的记录合并为一项 读到子目录的第一条记录后计数并二分跳过整个子目录
+        //   代价与本页的子项数有关 与目录下各级的文件总数无关
+        // - *more表示本页之后还有子项
+        //
+        void ListDirectory(const std::string &dir, const std::string &start_after, size_t limit,
+                           std::vector<DirEntry> *entries, bool *more) {
+            RangeScan scan(this, dir, PrefixEnd(dir));
+            if (!start_after.empty()) {
+                scan.Seek(start_after.back() == '/' ? PrefixEnd(dir + start_after) : dir + start_after + '\0');
+            }
+            StorageInfo info;
+            while (entries->size() <= limit && scan.Next(&info)) {
+                DirEntry entry;
+                size_t slash = info.url_.find('/', dir.size());
+                if (slash == std::string::npos) {
+                    entry.name_ = info.url_.substr(dir.size());
+                    entry.info_ = std::move(info);
+                }
+                else {
+                    std::string sub = info.url_.substr(0, slash + 1);
+                    entry.name_ = sub.substr(dir.size());
+                    entry.dir_ = true;
+                    entry.count_ = scan.Count(sub);
+                    scan.Seek(PrefixEnd(sub));
+                }
+                entries->push_back(std::move(entry));
+            }
+            *more = entries->size() > limit;
+            if (*more) {
+                entries->resize(limit);
+            }
+        }
+
+        //
+        // 大于所有以prefix开头的串的最小串 用作前缀区间的上界
+        // - prefix为空或全为0xff时返回空串 表示没有上界
+        //
+        static std::string PrefixEnd(std::string prefix) {
+            while (!prefix.empty() && (unsigned char)prefix.back() == 0xff) {
+                prefix.pop_back();
+            }
+            if (!prefix.empty()) {
+                prefix.back() = (char)((unsigned char)prefix.back() + 1);
+            }
+            return prefix;
+        }
+
+        static uint64_t SortValue(ListOrder order, const StorageInfo &info) {
+            return order == LIST_BY_MTIME ? (uint64_t)info.mtime_ : order == LIST_BY_SIZE ? (uint64_t)info.fsize_ : 0;
+        }
+
+        //
+        // 把json格式的存储信息文件转换为二进制索引
+        //
+        static bool ConvertFromJson(const std::string &json_file, const std::string &index_file) {
+            FileUtil json_util(json_file);
+            std::string infoStr;
+            if (!json_util.GetContent(&infoStr)) { // 获取文件内容
                 return false;
             }
-            *info = storage_info_map_[key]; // 获取url对应的文件存储信息
+            Json::Value root;
+            JSON_util::UnSerialize(infoStr, root); // 将文件内容反序列化为json对象
+            MetaIndexWriter writer;
+            for (auto &e : root) { // 遍历json对象
+                StorageInfo info;
+                FromJson(e, &info);
+                writer.Add(info.url_, info.storage_path_, info.mtime_, info.atime_, info.fsize_, info.pack_format_,
+                           info.hash_, info.offset_);
+            }
+            return writer.Write(index_file);
+        }
+
+    private:
+        //
+        // 按url顺序读取[from, to)区间 to为空表示没有上界
+        // - 构造时持有全部分片的读锁 取得索引快照和各分片中落在区间内的overlay项 之后不持锁
+        // - 快照上二分定位区间 与overlay归并 快照中已被overlay覆盖的记录跳过
+        //
+        class RangeScan
+        {
+        private:
+            std::shared_ptr<MetaIndex> index_;
+            Overlay overlay_; // 区间内的overlay项
+            Overlay::const_iterator it_;
+            size_t pos_ = 0; // 快照中的当前位置
+            size_t end_ = 0; // 快照中区间的终点
+        public:
+            RangeScan(DataManager *data, const std::string &from, const std::string &to) {
+                bool empty = !to.empty() && from >= to;
+                {
+                    std::vector<std::shared_lock<std::shared_mutex>> locks;
+                    for (auto &shard : data->shards_) {
+                        locks.emplace_back(shard.mutex_);
+                    }
+                    index_ = data->index_;
+                    for (auto &shard : data->shards_) {
+                        if (!empty) {
+                            auto last = to.empty() ? shard.overlay_.end() : shard.overlay_.lower_bound(to);
+                            overlay_.insert(shard.overlay_.lower_bound(from), last);
+                        }
+                    }
+                }
+                it_ = overlay_.begin();
+                if (!empty) {
+                    pos_ = index_->LowerBound(from);
+                    end_ = to.empty() ? index_->Size() : index_->LowerBound(to, pos_);
+                }
+            }
+
+            //
+            // 读取下一条存储信息 区间内没有更多记录时返回false
+            //
+            bool Next(StorageInfo *info) {
+                while (true) {
+                    bool has_snap = pos_ < end_;
+                    std::string_view url = has_snap ? index_->Url(index_->At(pos_)) : std::string_view();
+                    if (it_ != overlay_.end() && (has_snap == false || it_->first <= url)) {
+                        if (has_snap && it_->first == url) {
+                            pos_++; // 以overlay中的为准
+                        }
+                        auto cur = it_++;
+                        if (cur->second.deleted_) {
+                            continue;
+                        }
+                        *info = cur->second.info_;
+                        return true;
+                    }
+                    if (has_snap == false) {
+                        return false;
+                    }
+                    RecordToInfo(*index_, index_->At(pos_++), info);
+                    return true;
+                }
+            }
+
+            //
+            // 向后跳到第一条url不小于url的记录
+            //
+            void Seek(const std::string &url) {
+                if (pos_ < end_) {
+                    pos_ = std::min(index_->LowerBound(url, pos_), end_);
+                }
+                if (it_ != overlay_.end() && it_->first < url) {
+                    it_ = overlay_.lower_bound(url);
+                }
+            }
+
+            //
+            // url以prefix开头的记录数 前缀须在构造的区间内
+            //
+            size_t Count(const std::string &prefix) const {
+                std::string last = PrefixEnd(prefix);
+                size_t lo = index_->LowerBound(prefix);
+                size_t hi = last.empty() ? index_->Size() : index_->LowerBound(last, lo);
+                size_t count = hi - lo;
+                auto stop = last.empty() ? overlay_.end() : overlay_.lower_bound(last);
+                for (auto it = overlay_.lower_bound(prefix); it != stop; ++it) {
+                    bool in_snap = index_->Find(it->first) != nullptr;
+                    if (it->second.deleted_ && in_snap) {
+                        count--;
+                    }
+                    else if (!it->second.deleted_ && !in_snap) {
+                        count++;
+                    }
+                }
+                return count;
+            }
+        };
+
+        //
+        // 记录内容哈希到url的映射 overwrite为false时不覆盖已有的映射
+        //
+        void IndexHash(const StorageInfo &info, bool overwrite = true) {
+            if (info.hash_.empty()) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(hash_mutex_);
+            if (overwrite) {
+                hash_index_[info.hash_] = info.url_;
+            }
+            else {
+                hash_index_.emplace(info.hash_, info.url_);
+            }
+        }
+
+        //
+        // 两条存储信息指向同一个存储文件的同一份数据
+        //
+        static bool SameFile(const StorageInfo &a, const StorageInfo &b) {
+            return a.storage_path_ == b.storage_path_ && a.mtime_ == b.mtime_ && a.fsize_ == b.fsize_ && a.offset_ == b.offset_;
+        }
+
+        //
+        // 校验一批记录的存储文件 在线程池中执行
+        // - 存储文件不存在、段文件短于记录的区间 放入invalid
+        // - 未压缩文件的大小与记录不同时按文件更新记录的大小和修改时间
+        // - 段文件中的小文件共用存储路径 同一批中只stat一次
+        //
+        void CheckFiles(const std::vector<StorageInfo> &batch, std::vector<StorageInfo> *invalid) {
+            std::unordered_map<std::string, struct stat> stats;
+            size_t refreshed = 0;
+            for (auto &info : batch) {
+                auto it = stats.find(info.storage_path_);
+                if (it == stats.end()) {
+                    struct stat st;
+                    if (stat(info.storage_path_.c_str(), &st) != 0) {
+                        if (errno == ENOENT || errno == ENOTDIR) {
+                            invalid->push_back(info);
+                        }
+                        continue;
+                    }
+                    it = stats.emplace(info.storage_path_, st).first;
+                }
+                uint64_t size = it->second.st_size;
+                if (info.pack_format_ == segment_needle_format && size < info.offset_ + info.fsize_) {
+                    invalid->push_back(info);
+                }
+                else if (info.pack_format_ < 0 && size != info.fsize_) {
+                    StorageInfo new_info = info;
+                    new_info.fsize_ = size;
+                    new_info.mtime_ = it->second.st_mtime;
+                    refreshed += Replace(info, new_info) ? 1 : 0;
+                }
+            }
+            std::lock_guard<std::mutex> lock(validate_mutex_);
+            validate_stats_.checked_ += batch.size();
+            validate_stats_.refreshed_ += refreshed;
+        }
+
+        //
+        // 一次性删除校验时发现无效的记录 记录期间已被修改的不删除
+        // - 在overlay中标记删除后压缩一次索引 不逐条写日志
+        // - 返回删除的记录数
+        //
+        size_t Purge(const std::vector<StorageInfo> &infos) {
+            size_t purged = 0;
+            for (auto &info : infos) {
+                Shard &shard = GetShard(info.url_);
+                std::unique_lock<std::shared_mutex> lock(shard.mutex_);
+                StorageInfo cur;
+                if (FindInShard(shard, info.url_, &cur) == false || SameFile(cur, info) == false) {
+                    continue;
+                }
+                shard.overlay_[info.url_] = OverlayEntry{StorageInfo(), true, ++seq_};
+                NotifyChange(info.url_);
+                purged++;
+            }
+            if (purged > 0) {
+                Store();
+            }
+            return purged;
+        }
+
+        void NotifyChange(const std::string &url) {
+            if (on_change_) {
+                on_change_(url);
+            }
+        }
+
+        //
+        // StorageInfo与json对象互相转换
+        //
+        static void ToJson(const StorageInfo &info, Json::Value *item) {
+            (*item)["storage_path_"] = info.storage_path_;
+            (*item)["mtime_"] = (Json::UInt64)info.mtime_;
+            (*item)["atime_"] = (Json::UInt64)info.atime_;
+            (*item)["url_"] = info.url_;
+            (*item)["fsize_"] = (Json::UInt64)info.fsize_;
+            (*item)["pack_format_"] = info.pack_format_;
+            if (info.hash_.empty() == false) {
+                (*item)["hash_"] = Sha256::Hex(info.hash_);
+            }
+            if (info.offset_ != 0) {
+                (*item)["offset_"] = (Json::UInt64)info.offset_;
+            }
+        }
+
+        static void FromJson(const Json::Value &item, StorageInfo *info) {
+            info->storage_path_ = item["storage_path_"].asString();
+            info->mtime_ = item["mtime_"].asUInt64();
+            info->atime_ = item["atime_"].asUInt64();
+            info->url_ = item["url_"].asString();
+            info->fsize_ = item["fsize_"].asUInt64();
+            info->pack_format_ = item.isMember("pack_format_") ? item["pack_format_"].asInt() : -1;
+            info->hash_.clear();
+            if (item.isMember("hash_")) {
+                Sha256::FromHex(item["hash_"].asString(), &info->hash_);
+            }
+            info->offset_ = item["offset_"].asUInt64();
+        }
+
+        static void RecordToInfo(const MetaIndex &index, const IndexRecord *r, StorageInfo *info) {
+            info->url_ = std::string(index.Url(r));
+            info->storage_path_ = std::string(index.Path(r));
+            info->mtime_ = r->mtime_;
+            info->atime_ = r->atime_;
+            info->fsize_ = r->fsize_;
+            info->pack_format_ = index.PackFormat(r);
+            info->hash_ = std::string(index.Hash(r));
+            info->offset_ = index.Offset(r);
+        }
+
+        static uint64_t SortValue(ListOrder order, const IndexRecord *r) {
+            return order == LIST_BY_MTIME ? (uint64_t)r->mtime_ : order == LIST_BY_SIZE ? r->fsize_ : 0;
+        }
+
+        //
+        // 先比较排序键 相同时比较url 返回负数、0、正数
+        //
+        static int Compare(ListOrder order, uint64_t va, std::string_view ua, uint64_t vb, std::string_view ub) {
+            if (order != LIST_BY_URL && va != vb) {
+                return va < vb ? -1 : 1;
+            }
+            int cmp = ua.compare(ub);
+            return cmp < 0 ? -1 : cmp > 0 ? 1 : 0;
+        }
+
+        Shard &GetShard(const std::string &url) {
+            return shards_[std::hash<std::string>()(url) % shard_count];
+        }
+
+        //
+        // 按url查找 overlay优先于索引快照 调用者需持有shard的锁
+        // - 持锁期间索引不会被替换 直接使用index_指向的快照 不增减引用计数
+        //
+        bool FindInShard(Shard &shard, const std::string &url, StorageInfo *info) {
+            auto it = shard.overlay_.find(url);
+            if (it != shard.overlay_.end()) {
+                if (it->second.deleted_) {
+                    return false;
+                }
+                *info = it->second.info_;
+                return true;
+            }
+            const MetaIndex *index = index_.get();
+            const IndexRecord *r = index->Find(url);
+            if (r == nullptr) {
+                return false;
+            }
+            RecordToInfo(*index, r, info);
             return true;
         }
 
-        // 
-        // 读取map中存储的信息
         //
-        bool GetInfo(std::vector<StorageInfo> *arry) {
-            for (auto e : storage_info_map_) {
-                arry->emplace_back(e.second);
+        // 合并索引快照和overlay 对每条有效的存储信息调用func
+        //
+        template <typename Func>
+        static void Merge(const MetaIndex &index, const Overlay &overlay, Func func) {
+            StorageInfo info;
+            for (size_t i = 0; i < index.Size(); i++) {
+                const IndexRecord *r = index.At(i);
+                if (!overlay.empty() && overlay.count(std::string(index.Url(r)))) {
+                    continue; // 以overlay中的为准
+                }
+                RecordToInfo(index, r, &info);
+                func(info);
+            }
+            for (auto &it : overlay) {
+                if (!it.second.deleted_) {
+                    func(it.second.info_);
+                }
+            }
+        }
+
+        //
+        // 把一条日志记录序列化为一行紧凑的json
+        //
+        static std::string JournalLine(const Json::Value &record) {
+            std::string line;
+            JSON_util::Serialize(record, line, "");
+            line += "\n";
+            return line;
+        }
+
+        //
+        // 追加一条日志
+        // - 每条记录一次write写入
+        // - 写入失败时截掉已写入的半行 返回false时日志中没有这条记录
+        //
+        bool AppendJournal(const std::string &line) {
+            std::lock_guard<std::mutex> lock(journal_mutex_);
+            if (journal_fd_ == -1) {
+                return false;
+            }
+            off_t end = lseek(journal_fd_, 0, SEEK_END);
+            const char *p = line.c_str();
+            size_t left = line.size();
+            while (left > 0) {
+                ssize_t n = write(journal_fd_, p, left);
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    if (end != -1 && left != line.size() && ftruncate(journal_fd_, end) != 0) {}
+                    return false;
+                }
+                p += n;
+                left -= n;
+            }
+            if (++journal_records_ >= compact_threshold_) {
+                compact_cond_.notify_one();
             }
             return true;
         }
+
+        //
+        // 重放日志文件 返回重放的记录数
+        // - 只在InitLoad中调用 此时还没有其他线程访问
+        // - 最后一行可能因崩溃只写了一半 解析失败的行直接跳过
+        //
+        size_t Replay(const std::string &journal) {
+            std::ifstream ifs(journal, std::ios::binary);
+            if (ifs.is_open() == false) {
+                return 0;
+            }
+            size_t count = 0;
+            std::string line;
+            while (std::getline(ifs, line)) {
+                Json::Value record;
+                if (line.empty() || JSON_util::UnSerialize(line, record) == false) {
+                    continue;
+                }
+                std::string op = record["op"].asString();
+                if (op == "delete") {
+                    std::string url = record["url_"].asString();
+                    GetShard(url).overlay_[url] = OverlayEntry{StorageInfo(), true, ++seq_};
+                }
+                else {
+                    StorageInfo info;
+                    FromJson(record, &info);
+                    GetShard(info.url_).overlay_[info.url_] = OverlayEntry{info, false, ++seq_};
+                }
+                count++;
+            }
+            return count;
+        }
+
+        //
+        // 后台压缩线程
+        // - 日志记录数达到阈值时压缩
+        //
+        void CompactLoop() {
+            std::unique_lock<std::mutex> lock(journal_mutex_);
+            while (!stop_) {
+                compact_cond_.wait(lock, [this]() {
+                    return stop_ || journal_records_ >= compact_threshold_;
+                });
+                if (stop_) {
+                    break;
+                }
+                lock.unlock();
+                bool ok = Store();
+                lock.lock();
+                if (!ok) { // 写快照失败时稍后重试 避免空转
+                    compact_cond_.wait_for(lock, std::chrono::seconds(1), [this]() { return stop_; });
+                }
+            }
+        }
     };
-}
\ No newline at end of file
+}
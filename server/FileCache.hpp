@@ -0,0 +1,105 @@
+#pragma once
+#include "DataManager.hpp"
+#include "BlockContainer.hpp"
+#include <event2/buffer.h>
+#include <list>
+
+namespace storage
+{
+    //
+    // 已打开的下载文件
+    // - 普通文件保存为evbuffer_file_segment 各个响应通过evbuffer_add_file_segment共享同一个fd
+    // - 块容器保存已读取footer和块索引的BlockReader
+    // - 内存缓存中的小文件保存整个内容(块容器为解压后的内容) 不占用fd
+    // - 字段在放入缓存后不再修改 可以被多个工作线程同时使用
+    //
+    struct CachedFile
+    {
+        StorageInfo info_;
+        std::shared_ptr<struct evbuffer_file_segment> seg_; // 普通文件 大小为0时为空
+        std::shared_ptr<BlockReader> reader_;                // 块容器
+        std::shared_ptr<const std::string> content_;         // 内存缓存的文件内容
+        int64_t fsize_ = 0;                                  // 原文件大小
+    };
+
+    //
+    // 下载文件的LRU缓存 key为url
+    // - 热点文件的重复下载不需要查元数据 也不需要open/stat
+    // - 每项占用一个fd 最多缓存capacity项 淘汰后fd在最后一个引用它的响应发送完后关闭
+    // - 按url的哈希分为shard_count个分片 各自加锁和淘汰 每个分片最多缓存capacity/shard_count项(向上取整)
+    // - DataManager修改某个url时调用Invalidate 之后的下载重新打开文件
+    // - 打开文件前取Generation(url) 放入时若期间同一分片发生过失效则放弃 避免把旧文件放回缓存
+    //   其他分片的失效不影响放入
+    //
+    class FileCache
+    {
+    private:
+        typedef std::pair<std::string, std::shared_ptr<const CachedFile>> Entry;
+        struct Shard
+        {
+            std::mutex mutex_;
+            std::list<Entry> lru_; // 最近使用的在前
+            std::unordered_map<std::string, std::list<Entry>::iterator> map_;
+            uint64_t generation_ = 0;
+        };
+        static const size_t shard_count = 16;
+        Shard shards_[shard_count];
+        size_t capacity_; // 每个分片的容量
+    public:
+        explicit FileCache(size_t capacity) : capacity_((capacity + shard_count - 1) / shard_count) {}
+
+        bool Get(const std::string &url, std::shared_ptr<const CachedFile> *file) {
+            Shard &shard = GetShard(url);
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            auto it = shard.map_.find(url);
+            if (it == shard.map_.end()) {
+                return false;
+            }
+            shard.lru_.splice(shard.lru_.begin(), shard.lru_, it->second);
+            *file = it->second->second;
+            return true;
+        }
+
+        uint64_t Generation(const std::string &url) {
+            Shard &shard = GetShard(url);
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            return shard.generation_;
+        }
+
+        void Put(const std::string &url, std::shared_ptr<const CachedFile> file, uint64_t generation) {
+            Shard &shard = GetShard(url);
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            if (capacity_ == 0 || generation != shard.generation_) {
+                return;
+            }
+            auto it = shard.map_.find(url);
+            if (it != shard.map_.end()) {
+                it->second->second = std::move(file);
+                shard.lru_.splice(shard.lru_.begin(), shard.lru_, it->second);
+                return;
+            }
+            shard.lru_.emplace_front(url, std::move(file));
+            shard.map_[url] = shard.lru_.begin();
+            while (shard.lru_.size() > capacity_) {
+                shard.map_.erase(shard.lru_.back().first);
+                shard.lru_.pop_back();
+            }
+        }
+
+        void Invalidate(const std::string &url) {
+            Shard &shard = GetShard(url);
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            shard.generation_++;
+            auto it = shard.map_.find(url);
+            if (it != shard.map_.end()) {
+                shard.lru_.erase(it->second);
+                shard.map_.erase(it);
+            }
+        }
+
+    private:
+        Shard &GetShard(const std::string &url) {
+            return shards_[std::hash<std::string>()(url) % shard_count];
+        }
+    };
+}
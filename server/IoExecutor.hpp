@@ -0,0 +1,114 @@
+#pragma once
+#include "ThreadPool.hpp"
+#include <event2/event.h>
+
+namespace storage
+{
+    //
+    // 异步IO执行器
+    // 阻塞的文件操作在线程池中执行 完成后通过event_active把回调交回发起请求的事件循环线程
+    // - IoExecutor(size_t threads, std::function<void()> on_start) on_start在每个IO线程启动时调用一次
+    // - void Attach(struct event_base *base) 在事件循环线程中调用 注册完成通知事件
+    // - void Post(std::function<void()> work, std::function<void()> done)
+    //   在线程池中执行work 完成后在调用Post的线程的事件循环中执行done
+    //   调用线程没有Attach时work和done都在调用线程直接执行
+    // - void Run(std::function<void()> work) 在线程池中执行work 不需要回到事件循环
+    // - Resumer() 返回一个可以在任意线程调用的函数 把回调交回调用Resumer的线程的事件循环执行
+    //   用于结果由其他任务产生的场景 例如合并到同一次执行的多个请求
+    // - void Stop() 等待执行中的任务结束 释放通知事件 在释放event_base之前调用
+    //
+    class IoExecutor
+    {
+    private:
+        struct Loop
+        {
+            struct event *notify_ = nullptr;
+            std::mutex mutex_;
+            std::vector<std::function<void()>> done_; // 等待在事件循环中执行的回调
+        };
+        ThreadPool pool_;
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<Loop>> loops_;
+        inline static thread_local Loop *current_ = nullptr;
+    public:
+        explicit IoExecutor(size_t threads, std::function<void()> on_start = nullptr) : pool_(threads, on_start) {}
+        ~IoExecutor() {
+            Stop();
+        }
+
+        bool Attach(struct event_base *base) {
+            std::unique_ptr<Loop> loop(new Loop());
+            loop->notify_ = event_new(base, -1, 0, OnNotify, loop.get());
+            if (loop->notify_ == nullptr) {
+                return false;
+            }
+            current_ = loop.get();
+            std::lock_guard<std::mutex> lock(mutex_);
+            loops_.push_back(std::move(loop));
+            return true;
+        }
+
+        void Post(std::function<void()> work, std::function<void()> done) {
+            Loop *loop = current_;
+            if (loop == nullptr) {
+                work();
+                done();
+                return;
+            }
+            pool_.Submit([loop, work, done]() {
+                work();
+                Resume(loop, done);
+            });
+        }
+
+        void Run(std::function<void()> work) {
+            if (current_ == nullptr) {
+                work();
+                return;
+            }
+            pool_.Submit(work);
+        }
+
+        std::function<void(std::function<void()>)> Resumer() {
+            Loop *loop = current_;
+            return [loop](std::function<void()> done) {
+                if (loop == nullptr) {
+                    done();
+                    return;
+                }
+                Resume(loop, done);
+            };
+        }
+
+        void Stop() {
+            pool_.Stop();
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto &loop : loops_) {
+                event_free(loop->notify_);
+            }
+            loops_.clear();
+        }
+
+    private:
+        static void Resume(Loop *loop, std::function<void()> done) {
+            std::lock_guard<std::mutex> lock(loop->mutex_);
+            loop->done_.push_back(std::move(done));
+            event_active(loop->notify_, EV_READ, 0); // 已经激活时重复调用没有影响
+        }
+
+        //
+        // 事件循环线程中执行已完成任务的回调
+        //
+        static void OnNotify(evutil_socket_t fd, short what, void *arg) {
+            Loop *loop = (Loop *)arg;
+            std::vector<std::function<void()>> done;
+            {
+                std::lock_guard<std::mutex> lock(loop->mutex_);
+                done.swap(loop->done_);
+            }
+            for (auto &callback : done) {
+                callback();
+            }
+        }
+    };
+}
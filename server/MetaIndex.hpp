@@ -0,0 +1,338 @@
+#pragma once
+#include "Util.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <mutex>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace storage
+{
+    //
+    // 二进制元数据索引文件格式 (版本4 本机字节序)
+    // +--------------------+
+    // | IndexHeader        | 64字节
+    // +--------------------+
+    // | IndexRecord * N    | 定长记录 按url字节序升序排列 可直接二分查找
+    //                      | 记录长度以header中的record_size_为准 版本1的记录没有pack_format_ 版本2的记录没有内容哈希 版本3的记录没有偏移
+    // +--------------------+
+    // | 字符串表            | 所有url、storage_path和内容哈希拼接在一起 记录中保存偏移和长度
+    // +--------------------+
+    //
+    const char index_magic[8] = {'N', 'A', 'S', 'I', 'D', 'X', '\0', '\0'};
+    const uint32_t index_version = 4;
+    const uint32_t index_record_size_v1 = 48;
+    const uint32_t index_record_size_v2 = 56;
+    const uint32_t index_record_size_v3 = 64;
+
+    struct IndexHeader
+    {
+        char magic_[8];
+        uint32_t version_;
+        uint32_t record_size_;    // sizeof(IndexRecord) 用于检查格式是否一致
+        uint64_t count_;          // 记录数
+        uint64_t records_offset_; // 记录区在文件中的偏移
+        uint64_t strings_offset_; // 字符串表在文件中的偏移
+        uint64_t strings_size_;   // 字符串表长度
+        uint64_t reserved_[2];
+    };
+    static_assert(sizeof(IndexHeader) == 64, "IndexHeader must be 64 bytes");
+
+    struct IndexRecord
+    {
+        uint64_t url_offset_;  // url在字符串表中的偏移
+        uint64_t path_offset_; // storage_path在字符串表中的偏移
+        uint32_t url_len_;
+        uint32_t path_len_;
+        int64_t mtime_;
+        int64_t atime_;
+        uint64_t fsize_;
+        int32_t pack_format_; // 压缩格式 -1表示未压缩 (版本2新增)
+        uint32_t hash_len_;   // 内容哈希的长度 0表示未知 (版本3新增)
+        uint64_t hash_offset_; // 内容哈希在字符串表中的偏移 (版本3新增)
+        uint64_t offset_;      // 数据在存储文件中的偏移 段文件中的小文件使用 (版本4新增)
+    };
+    static_assert(sizeof(IndexRecord) == 72, "IndexRecord must be 72 bytes");
+
+    //
+    // 只读的元数据索引
+    // 把索引文件mmap到内存中 不做反序列化 查找时直接在映射的记录区上二分
+    // - bool Open(const std::string &path) 打开并校验索引文件
+    // - const IndexRecord *Find(std::string_view url) 按url查找记录
+    // - size_t LowerBound(std::string_view url, size_t lo) 第一条url不小于url的记录下标 用于前缀和区间查询
+    // - size_t Size() 记录数
+    // - const IndexRecord *At(size_t i) 第i条记录
+    // - std::string_view Url(const IndexRecord *r) / Path(const IndexRecord *r) / Hash(const IndexRecord *r) 读取记录中的字符串
+    // - const std::vector<uint32_t> &SortedBy(Order order) 按mtime或fsize排序的记录下标 第一次使用时生成
+    //
+    class MetaIndex
+    {
+    public:
+        enum Order { ORDER_MTIME, ORDER_SIZE };
+    private:
+        void *addr_ = nullptr;
+        size_t length_ = 0;
+        const char *records_ = nullptr;
+        uint32_t record_size_ = 0;
+        const char *strings_ = nullptr;
+        uint64_t count_ = 0;
+        uint64_t strings_size_ = 0;
+        mutable std::mutex order_mutex_;
+        mutable std::vector<uint32_t> orders_[2]; // 按ORDER_MTIME/ORDER_SIZE排列的记录下标
+        mutable bool order_built_[2] = {false, false};
+    public:
+        MetaIndex() {}
+        MetaIndex(const MetaIndex &) = delete;
+        MetaIndex &operator=(const MetaIndex &) = delete;
+        ~MetaIndex() {
+            Close();
+        }
+
+        //
+        // 打开索引文件并映射到内存
+        // - 文件不存在或格式不正确返回false
+        //
+        bool Open(const std::string &path) {
+            Close();
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(IndexHeader)) {
+                close(fd);
+                return false;
+            }
+            void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd); // 映射建立后fd可以关闭
+            if (addr == MAP_FAILED) {
+                return false;
+            }
+            const IndexHeader *header = (const IndexHeader *)addr;
+            size_t length = st.st_size;
+            if (memcmp(header->magic_, index_magic, sizeof(index_magic)) != 0 ||
+                header->version_ < 1 || header->version_ > index_version ||
+                header->record_size_ < index_record_size_v1 ||
+                header->records_offset_ > length ||
+                header->count_ > (length - header->records_offset_) / header->record_size_ ||
+                header->strings_offset_ > length ||
+                header->strings_size_ > length - header->strings_offset_) {
+                munmap(addr, length);
+                return false;
+            }
+            addr_ = addr;
+            length_ = length;
+            count_ = header->count_;
+            records_ = (const char *)addr + header->records_offset_;
+            record_size_ = header->record_size_;
+            strings_ = (const char *)addr + header->strings_offset_;
+            strings_size_ = header->strings_size_;
+            madvise(addr_, length_, MADV_RANDOM); // 查找是随机访问 不需要预读
+            return true;
+        }
+
+        //
+        // 解除映射
+        //
+        void Close() {
+            if (addr_) {
+                munmap(addr_, length_);
+            }
+            addr_ = nullptr;
+            length_ = 0;
+            records_ = nullptr;
+            record_size_ = 0;
+            strings_ = nullptr;
+            count_ = 0;
+            strings_size_ = 0;
+            std::lock_guard<std::mutex> lock(order_mutex_);
+            for (int i = 0; i < 2; i++) {
+                orders_[i].clear();
+                order_built_[i] = false;
+            }
+        }
+
+        size_t Size() const {
+            return count_;
+        }
+
+        const IndexRecord *At(size_t i) const {
+            return (const IndexRecord *)(records_ + i * record_size_);
+        }
+
+        //
+        // 读取记录的压缩格式 版本1的记录没有该字段 视为未压缩
+        //
+        int32_t PackFormat(const IndexRecord *r) const {
+            if (record_size_ < index_record_size_v2) {
+                return -1;
+            }
+            return r->pack_format_;
+        }
+
+        //
+        // 读取记录的内容哈希 版本3之前的记录没有该字段 返回空串
+        //
+        std::string_view Hash(const IndexRecord *r) const {
+            if (record_size_ < index_record_size_v3) {
+                return std::string_view();
+            }
+            return String(r->hash_offset_, r->hash_len_);
+        }
+
+        //
+        // 读取记录的数据偏移 版本4之前的记录没有该字段 视为0
+        //
+        uint64_t Offset(const IndexRecord *r) const {
+            if (record_size_ < sizeof(IndexRecord)) {
+                return 0;
+            }
+            return r->offset_;
+        }
+
+        //
+        // 读取记录中的url和storage_path 越界时返回空串
+        //
+        std::string_view Url(const IndexRecord *r) const {
+            return String(r->url_offset_, r->url_len_);
+        }
+
+        std::string_view Path(const IndexRecord *r) const {
+            return String(r->path_offset_, r->path_len_);
+        }
+
+        //
+        // 按url二分查找
+        // - 找到返回记录指针 否则返回nullptr
+        //
+        const IndexRecord *Find(std::string_view url) const {
+            size_t i = LowerBound(url);
+            if (i < count_ && Url(At(i)) == url) {
+                return At(i);
+            }
+            return nullptr;
+        }
+
+        //
+        // 第一条url不小于url的记录下标 都小于时返回Size()
+        // - 在[lo, Size())中查找 用于从已知位置向后定位
+        //
+        size_t LowerBound(std::string_view url, size_t lo = 0) const {
+            size_t hi = count_;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (Url(At(mid)) < url) {
+                    lo = mid + 1;
+                }
+                else {
+                    hi = mid;
+                }
+            }
+            return lo;
+        }
+
+        //
+        // 按排序键升序、键相同时按url升序排列的记录下标
+        // - 快照不可变 生成后一直有效 每条记录占4字节
+        //
+        const std::vector<uint32_t> &SortedBy(Order order) const {
+            std::lock_guard<std::mutex> lock(order_mutex_);
+            std::vector<uint32_t> &ids = orders_[order];
+            if (order_built_[order] == false) {
+                ids.resize(count_);
+                for (uint32_t i = 0; i < count_; i++) {
+                    ids[i] = i;
+                }
+                std::sort(ids.begin(), ids.end(), [this, order](uint32_t a, uint32_t b) {
+                    const IndexRecord *ra = At(a), *rb = At(b);
+                    uint64_t ka = order == ORDER_MTIME ? (uint64_t)ra->mtime_ : ra->fsize_;
+                    uint64_t kb = order == ORDER_MTIME ? (uint64_t)rb->mtime_ : rb->fsize_;
+                    return ka != kb ? ka < kb : a < b; // 记录本身按url有序 下标的顺序就是url的顺序
+                });
+                order_built_[order] = true;
+            }
+            return ids;
+        }
+
+    private:
+        std::string_view String(uint64_t offset, uint32_t len) const {
+            if (offset > strings_size_ || len > strings_size_ - offset) {
+                return std::string_view();
+            }
+            return std::string_view(strings_ + offset, len);
+        }
+    };
+
+    //
+    // 索引文件生成器
+    // - void Add(...) 添加一条记录 url不能重复
+    // - bool Write(const std::string &path) 排序后写入临时文件 再rename为path
+    //
+    class MetaIndexWriter
+    {
+    private:
+        std::vector<IndexRecord> records_;
+        std::string strings_;
+    public:
+        void Add(std::string_view url, std::string_view path, int64_t mtime, int64_t atime, uint64_t fsize,
+                 int32_t pack_format, std::string_view hash, uint64_t offset) {
+            IndexRecord r;
+            memset(&r, 0, sizeof(r));
+            r.url_offset_ = strings_.size();
+            r.url_len_ = url.size();
+            strings_.append(url.data(), url.size());
+            r.path_offset_ = strings_.size();
+            r.path_len_ = path.size();
+            strings_.append(path.data(), path.size());
+            r.mtime_ = mtime;
+            r.atime_ = atime;
+            r.fsize_ = fsize;
+            r.pack_format_ = pack_format;
+            r.hash_offset_ = strings_.size();
+            r.hash_len_ = hash.size();
+            strings_.append(hash.data(), hash.size());
+            r.offset_ = offset;
+            records_.push_back(r);
+        }
+
+        bool Write(const std::string &path) {
+            const std::string &strings = strings_;
+            std::sort(records_.begin(), records_.end(), [&strings](const IndexRecord &a, const IndexRecord &b) {
+                return std::string_view(strings.data() + a.url_offset_, a.url_len_) <
+                       std::string_view(strings.data() + b.url_offset_, b.url_len_);
+            });
+            IndexHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic_, index_magic, sizeof(index_magic));
+            header.version_ = index_version;
+            header.record_size_ = sizeof(IndexRecord);
+            header.count_ = records_.size();
+            header.records_offset_ = sizeof(IndexHeader);
+            header.strings_offset_ = header.records_offset_ + records_.size() * sizeof(IndexRecord);
+            header.strings_size_ = strings_.size();
+
+            std::string tmp_path = path + ".tmp";
+            std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+            if (ofs.is_open() == false) {
+                return false;
+            }
+            ofs.write((const char *)&header, sizeof(header));
+            ofs.write((const char *)records_.data(), records_.size() * sizeof(IndexRecord));
+            ofs.write(strings_.data(), strings_.size());
+            ofs.close();
+            if (ofs.fail()) {
+                unlink(tmp_path.c_str());
+                return false;
+            }
+            if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+                unlink(tmp_path.c_str());
+                return false;
+            }
+            return true;
+        }
+    };
+}
@@ -0,0 +1,166 @@
+#pragma once
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Util.hpp"
+#include "IoExecutor.hpp"
+
+namespace storage
+{
+    //
+    // 预编译的页面模板
+    // - 加载时按占位符把模板切分为静态片段 渲染时依次写入evbuffer 占位符处由调用方填充 不需要正则替换
+    // - 通过inotify监视模板所在的目录 模板被修改或替换后在IO线程中重新加载 加载失败时继续使用旧模板
+    // - 编译结果不可变 通过shared_ptr原子替换 渲染可以在任意线程进行
+    // - bool Watch(struct event_base *base, IoExecutor *io) 在事件循环线程中调用 注册inotify事件 重新加载交给io执行
+    // - void Unwatch() 在释放event_base之前调用
+    // - uint64_t Version() 每次加载成功加1 用于生成ETag
+    // - bool Uses(int placeholder) 当前模板是否包含第placeholder个占位符
+    // - void Render(struct evbuffer *buf, Fill fill) 渲染到buf fill(buf, i)填充第i个占位符
+    //
+    class PageTemplate
+    {
+    private:
+        struct Segment
+        {
+            std::string text_;
+            int placeholder_; // 片段之后的占位符下标 -1表示没有
+        };
+        typedef std::vector<Segment> Compiled;
+        std::string path_;
+        std::vector<std::string> placeholders_;
+        std::shared_ptr<const Compiled> compiled_; // 只通过std::atomic_load/atomic_store访问
+        std::atomic<uint64_t> version_{0};
+        std::mutex load_mutex_; // 串行化加载 后开始的加载读到的内容总是最后生效
+        IoExecutor *io_ = nullptr;
+        int inotify_fd_ = -1;
+        struct event *watch_ = nullptr;
+    public:
+        PageTemplate(const std::string &path, const std::vector<std::string> &placeholders)
+            : path_(path), placeholders_(placeholders) {
+            std::atomic_store(&compiled_, std::make_shared<const Compiled>());
+            Load();
+        }
+        ~PageTemplate() {
+            Unwatch();
+        }
+
+        bool Load() {
+            std::lock_guard<std::mutex> lock(load_mutex_);
+            std::string content;
+            if (FileUtil(path_).GetContent(&content) == false) {
+                return false;
+            }
+            auto compiled = std::make_shared<Compiled>();
+            size_t pos = 0;
+            while (true) {
+                // 找到最靠前的占位符
+                size_t found = std::string::npos;
+                int index = -1;
+                for (size_t i = 0; i < placeholders_.size(); i++) {
+                    size_t p = content.find(placeholders_[i], pos);
+                    if (p < found) {
+                        found = p;
+                        index = i;
+                    }
+                }
+                if (index == -1) {
+                    compiled->push_back(Segment{content.substr(pos), -1});
+                    break;
+                }
+                compiled->push_back(Segment{content.substr(pos, found - pos), index});
+                pos = found + placeholders_[index].size();
+            }
+            std::atomic_store(&compiled_, std::shared_ptr<const Compiled>(std::move(compiled)));
+            version_++;
+            return true;
+        }
+
+        bool Watch(struct event_base *base, IoExecutor *io) {
+            io_ = io;
+            size_t slash = path_.find_last_of('/');
+            std::string dir = slash == std::string::npos ? "." : path_.substr(0, slash + 1);
+            inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotify_fd_ == -1) {
+                return false;
+            }
+            // 编辑器通常写新文件再rename覆盖 所以监视目录而不是文件本身
+            if (inotify_add_watch(inotify_fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+                Unwatch();
+                return false;
+            }
+            watch_ = event_new(base, inotify_fd_, EV_READ | EV_PERSIST, OnChange, this);
+            if (watch_ == nullptr || event_add(watch_, NULL) != 0) {
+                Unwatch();
+                return false;
+            }
+            return true;
+        }
+
+        void Unwatch() {
+            if (watch_) {
+                event_free(watch_);
+                watch_ = nullptr;
+            }
+            if (inotify_fd_ != -1) {
+                close(inotify_fd_);
+                inotify_fd_ = -1;
+            }
+        }
+
+        uint64_t Version() const {
+            return version_;
+        }
+
+        bool Uses(int placeholder) const {
+            std::shared_ptr<const Compiled> compiled = std::atomic_load(&compiled_);
+            for (const Segment &segment : *compiled) {
+                if (segment.placeholder_ == placeholder) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        template <typename Fill>
+        void Render(struct evbuffer *buf, Fill fill) const {
+            std::shared_ptr<const Compiled> compiled = std::atomic_load(&compiled_);
+            for (const Segment &segment : *compiled) {
+                evbuffer_add(buf, segment.text_.data(), segment.text_.size());
+                if (segment.placeholder_ >= 0) {
+                    fill(buf, segment.placeholder_);
+                }
+            }
+        }
+
+    private:
+        //
+        // 模板目录有文件写入或移入 是模板文件时在IO线程中重新加载 不在事件循环线程读文件
+        //
+        static void OnChange(evutil_socket_t fd, short what, void *arg) {
+            PageTemplate *page = (PageTemplate *)arg;
+            std::string name = FileUtil(page->path_).GetFileName();
+            char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            bool changed = false;
+            ssize_t n;
+            while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + n;) {
+                    struct inotify_event *ev = (struct inotify_event *)p;
+                    if (ev->len > 0 && name == ev->name) {
+                        changed = true;
+                    }
+                    p += sizeof(struct inotify_event) + ev->len;
+                }
+            }
+            if (changed) {
+                page->io_->Run([page]() { page->Load(); });
+            }
+        }
+    };
+}
@@ -0,0 +1,369 @@
+#pragma once
+#include "DataManager.hpp"
+#include "StorageIo.hpp"
+#include "Tiering.hpp"
+#include <dirent.h>
+#include <unordered_map>
+
+namespace storage
+{
+    //
+    // 小文件的段存储
+    // 不超过segment_max_file的上传文件追加到大的段文件中 存储信息记录段文件路径、偏移和长度
+    // 百万级的小文件只占用少量inode和目录项 下载时按偏移发送段文件中的区间
+    // - 段文件只追加 写到segment_size后换新段 启动后的第一次追加总是新开一个段
+    // - 段中只有文件数据 元数据都在DataManager中 没有存储信息引用的区间就是已删除的数据
+    // - 后台线程定期统计各段被引用的字节数 删除没有引用的段
+    //   已删除数据的比例达到segment_compact_garbage的段 把有效数据复制到当前段 替换存储信息后删除旧段
+    // - 追加后、记录存储信息之前段不会被压缩 调用方记录后调用Done
+    // - 在锁内预留偏移 在锁外写入 并发的小文件上传不在磁盘IO上排队
+    //   写入后组提交fdatasync 一次同步覆盖期间所有已写完的追加 Append返回时数据已持久化
+    // #### 接口
+    // - size_t MaxFile() 追加到段文件的最大文件大小 0表示不使用段存储
+    // - bool Append(const void *data, size_t len, std::string *path, uint64_t *offset) 追加一个文件的数据
+    // - void Done(const std::string &path) Append的数据已记录存储信息或已放弃
+    // - static bool Read(const StorageInfo &info, std::string *data) 读出段文件中一个文件的数据
+    // - void Start() / Stop() 启动、停止压缩线程
+    // - void Compact() 扫描并压缩一次
+    // - Stats GetStats() 段数、段占用的字节数、追加的文件数、压缩的段数和回收的字节数
+    //
+    class SegmentStore
+    {
+    private:
+        //
+        // 一个段文件 换段后仍在写入的追加持有旧段直到写完
+        //
+        struct Segment
+        {
+            int fd_ = -1;
+            std::atomic<uint64_t> written_{0}; // 已写完的追加数
+            std::mutex sync_mutex_;            // 同一时间只有一个fdatasync
+            uint64_t synced_ = 0;              // fdatasync覆盖的追加数 持有sync_mutex_时访问
+
+            ~Segment() {
+                if (fd_ != -1) {
+                    close(fd_);
+                }
+            }
+
+            //
+            // 让前ticket个写完的追加持久化 已被其他线程的同步覆盖时直接返回
+            //
+            bool Sync(uint64_t ticket) {
+                std::lock_guard<std::mutex> lock(sync_mutex_);
+                if (synced_ >= ticket) {
+                    return true;
+                }
+                uint64_t target = written_; // 同步开始前已写完的追加都会被这次同步覆盖
+                if (fdatasync(fd_) != 0) {
+                    return false;
+                }
+                synced_ = target;
+                return true;
+            }
+        };
+    public:
+        struct Stats
+        {
+            uint64_t segments_ = 0;
+            uint64_t bytes_ = 0;
+            uint64_t appended_ = 0;
+            uint64_t compacted_ = 0;
+            uint64_t reclaimed_bytes_ = 0;
+        };
+    private:
+        DataManager *data_;
+        std::string dir_;
+        size_t max_file_;
+        uint64_t segment_size_;
+        double garbage_;
+        int interval_;
+        RateLimiter limiter_; // 压缩时读写磁盘的速率 与分层共用tiering_rate_limit
+        std::mutex mutex_;    // 保护当前段、inflight_、stats_和stop_
+        std::shared_ptr<Segment> current_; // 当前段
+        std::string path_;
+        uint64_t size_ = 0;   // 当前段已预留的大小
+        uint64_t seq_ = 0;    // 已使用的最大段号
+        std::unordered_map<std::string, int> inflight_; // 已追加但还没有记录存储信息的文件数 key为段文件路径
+        Stats stats_;
+        std::thread compactor_;
+        std::condition_variable cond_;
+        bool stop_ = false;
+    public:
+        explicit SegmentStore(DataManager *data)
+            : data_(data),
+              dir_(Config::GetInstance()->GetSegmentStorageDir()),
+              max_file_(Config::GetInstance()->GetSegmentMaxFile()),
+              segment_size_(Config::GetInstance()->GetSegmentSize()),
+              garbage_(Config::GetInstance()->GetSegmentCompactGarbage()),
+              interval_(Config::GetInstance()->GetSegmentCompactInterval()),
+              limiter_(Config::GetInstance()->GetTieringRateLimit()) {
+            for (auto &segment : ListSegments()) {
+                seq_ = std::max(seq_, segment.first);
+                stats_.segments_++;
+                stats_.bytes_ += FileUtil(SegmentPath(segment.first)).FileSize();
+            }
+        }
+        ~SegmentStore() {
+            Stop();
+        }
+
+        size_t MaxFile() const {
+            return max_file_;
+        }
+
+        //
+        // 追加一个文件的数据到当前段
+        // - 当前段放不下时换新段
+        // - 锁内只预留偏移 写入和同步在锁外进行 返回true时数据已持久化 可以记录存储信息
+        // - 失败时预留的区间成为段中的垃圾 由压缩回收
+        //
+        bool Append(const void *data, size_t len, std::string *path, uint64_t *offset) {
+            std::shared_ptr<Segment> segment;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!current_ || size_ + len > segment_size_) {
+                    if (OpenNext() == false) {
+                        return false;
+                    }
+                }
+                segment = current_;
+                *path = path_;
+                *offset = size_;
+                size_ += len;
+                inflight_[path_]++;
+                stats_.bytes_ += len;
+                stats_.appended_++;
+            }
+            if (StorageIo::Local()->WriteAt(segment->fd_, data, len, *offset) == false ||
+                segment->Sync(++segment->written_) == false) {
+                Done(*path);
+                return false;
+            }
+            return true;
+        }
+
+        void Done(const std::string &path) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = inflight_.find(path);
+            if (it != inflight_.end() && --it->second == 0) {
+                inflight_.erase(it);
+            }
+        }
+
+        static bool Read(const StorageInfo &info, std::string *data) {
+            int fd = open(info.storage_path_.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                return false;
+            }
+            data->resize(info.fsize_);
+            bool ret = StorageIo::Local()->ReadAt(fd, &(*data)[0], data->size(), info.offset_);
+            close(fd);
+            return ret;
+        }
+
+        void Start() {
+            if (max_file_ == 0 && stats_.segments_ == 0) {
+                return; // 未开启段存储
+            }
+            compactor_ = std::thread([this]() {
+                TieringService::LowerPriority();
+                std::unique_lock<std::mutex> lock(mutex_);
+                while (!stop_) {
+                    lock.unlock();
+                    Compact();
+                    lock.lock();
+                    cond_.wait_for(lock, std::chrono::seconds(interval_), [this]() { return stop_; });
+                }
+            });
+        }
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cond_.notify_all();
+            if (compactor_.joinable()) {
+                compactor_.join();
+            }
+        }
+
+        //
+        // 扫描一次
+        // - 只处理已换下且没有未记录写入的段 它们不会再被新的存储信息引用 统计出的有效字节数是准确的
+        // - 有效数据按偏移顺序复制到当前段 存储信息期间被覆盖时Replace失败 复制的数据成为当前段的垃圾
+        // - 全部复制完才删除旧段 中途失败或停止时保留旧段 下次扫描重新压缩
+        //
+        void Compact() {
+            std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> usage; // 段文件路径 -> (大小, 有效字节数)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto &segment : ListSegments()) {
+                    std::string path = SegmentPath(segment.first);
+                    if (path != path_ && inflight_.count(path) == 0) {
+                        usage[path] = std::make_pair(FileUtil(path).FileSize(), 0);
+                    }
+                }
+            }
+            if (usage.empty()) {
+                return;
+            }
+            data_->ForEach([&usage](const StorageInfo &info) {
+                if (info.pack_format_ != segment_needle_format) {
+                    return;
+                }
+                auto it = usage.find(info.storage_path_);
+                if (it != usage.end()) {
+                    it->second.second += info.fsize_;
+                }
+            });
+            std::unordered_map<std::string, std::vector<StorageInfo>> needles; // 需要复制有效数据的段
+            for (auto &segment : usage) {
+                uint64_t size = segment.second.first, live = std::min(segment.second.first, segment.second.second);
+                if (live == 0) {
+                    Remove(segment.first, size);
+                }
+                else if (size - live >= garbage_ * size) {
+                    needles[segment.first];
+                }
+            }
+            if (needles.empty()) {
+                return;
+            }
+            data_->ForEach([&needles](const StorageInfo &info) {
+                if (info.pack_format_ != segment_needle_format) {
+                    return;
+                }
+                auto it = needles.find(info.storage_path_);
+                if (it != needles.end()) {
+                    it->second.push_back(info);
+                }
+            });
+            for (auto &segment : needles) {
+                if (Stopping() || CopyLive(segment.first, &segment.second) == false) {
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                stats_.compacted_++;
+            }
+        }
+
+        Stats GetStats() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return stats_;
+        }
+
+    private:
+        bool Stopping() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return stop_;
+        }
+
+        std::string SegmentPath(uint64_t seq) const {
+            char name[32];
+            snprintf(name, sizeof(name), "%010llu.seg", (unsigned long long)seq);
+            return dir_ + name;
+        }
+
+        //
+        // 目录中的段文件 (段号, 文件名)
+        //
+        std::vector<std::pair<uint64_t, std::string>> ListSegments() const {
+            std::vector<std::pair<uint64_t, std::string>> segments;
+            DIR *d = opendir(dir_.c_str());
+            if (d == nullptr) {
+                return segments;
+            }
+            struct dirent *entry;
+            while ((entry = readdir(d)) != nullptr) {
+                std::string name = entry->d_name;
+                const std::string suffix = ".seg";
+                if (name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0 ||
+                    name.find_first_not_of("0123456789") != name.size() - suffix.size()) {
+                    continue;
+                }
+                segments.emplace_back(std::stoull(name.substr(0, name.size() - suffix.size())), name);
+            }
+            closedir(d);
+            return segments;
+        }
+
+        //
+        // 换一个新段 持有mutex_时调用
+        // - 旧段由还在写入的追加持有 最后一个写完时关闭
+        // - 新段的目录项fsync后才使用 之后追加的数据同步后段文件一定存在
+        //
+        bool OpenNext() {
+            current_.reset();
+            path_.clear();
+            std::string path = SegmentPath(seq_ + 1);
+            if (FileUtil(path).CreateParentDirectory() == false) {
+                return false;
+            }
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                return false;
+            }
+            seq_++;
+            auto segment = std::make_shared<Segment>();
+            segment->fd_ = fd;
+            if (FileUtil(path).SyncParentDirectory() == false) {
+                unlink(path.c_str());
+                return false;
+            }
+            current_ = std::move(segment);
+            path_ = path;
+            size_ = 0;
+            stats_.segments_++;
+            return true;
+        }
+
+        void Remove(const std::string &path, uint64_t size) {
+            if (unlink(path.c_str()) != 0) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_.segments_--;
+            stats_.bytes_ -= std::min(stats_.bytes_, size);
+            stats_.reclaimed_bytes_ += size;
+        }
+
+        //
+        // 把段中仍被引用的数据复制到当前段 替换存储信息后删除旧段
+        //
+        bool CopyLive(const std::string &path, std::vector<StorageInfo> *needles) {
+            uint64_t size = FileUtil(path).FileSize();
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                return false;
+            }
+            std::sort(needles->begin(), needles->end(), [](const StorageInfo &a, const StorageInfo &b) {
+                return a.offset_ < b.offset_;
+            });
+            std::string data;
+            bool ret = true;
+            for (auto &info : *needles) {
+                if (Stopping()) {
+                    ret = false;
+                    break;
+                }
+                limiter_.Acquire(info.fsize_ * 2);
+                data.resize(info.fsize_);
+                StorageInfo new_info = info;
+                if (StorageIo::Local()->ReadAt(fd, &data[0], data.size(), info.offset_) == false ||
+                    Append(data.data(), data.size(), &new_info.storage_path_, &new_info.offset_) == false) {
+                    ret = false;
+                    break;
+                }
+                data_->Replace(info, new_info);
+                Done(new_info.storage_path_);
+            }
+            close(fd);
+            if (ret) {
+                Remove(path, size);
+            }
+            return ret;
+        }
+    };
+}
@@ -1,20 +1,145 @@
 #pragma once
 #include "DataManager.hpp"
+#include "Tiering.hpp"
+#include "IoExecutor.hpp"
+#include "StorageIo.hpp"
+#include "UploadSession.hpp"
+#include "ContentCache.hpp"
+#include "SingleFlight.hpp"
+#include "BlockCache.hpp"
+#include "PageTemplate.hpp"
+#include "ChunkStore.hpp"
+#include "SegmentStore.hpp"
 #include <dirent.h>
 #include <cctype>
 // libevent
 #include <signal.h>
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <event2/http.h>
+#include <event2/listener.h>
+#include <event2/thread.h>
 #include <evhttp.h>
-#include <regex>
+#include <thread>
+#include <deque>
+#include <random>
 #include "base64.h" // 来自 cpp-base64 库
 #include <sys/queue.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
 namespace storage
 {
     DataManager data_;
+    // 阻塞的文件操作在IO线程中执行 不占用事件循环 只有IO线程创建io_uring
+    IoExecutor io_(Config::GetInstance()->GetIoThreads(), StorageIo::InitThread);
+    // 分块上传会话 所有工作线程共享
+    UploadSessionManager upload_sessions_;
+
+    //
+    // 上传上下文
+    // - 请求体边接收边写入存储目录下的临时文件，接收完成后再rename为最终文件
+    // - 内存中最多缓存upload_buffer_size字节
+    // - 写盘的同时计算内容哈希 客户端带了Upload-Hash时用于校验 没有请求体时按它秒传
+    //
+    struct UploadContext
+    {
+        int fd_ = -1;
+        std::string tmp_path_;               // 临时文件路径
+        std::string storage_path_;           // 最终存储路径
+        struct evbuffer *pending_ = nullptr; // 尚未写入磁盘的数据
+        size_t received_ = 0;                // 已接收的请求体字节数
+        uint64_t written_ = 0;               // 已写入临时文件的字节数
+        bool failed_ = false;                // 写盘失败后丢弃剩余数据
+        std::shared_ptr<ChunkWriter> chunks_; // 分块去重时数据存入分块存储 临时文件是清单
+        Sha256 sha_;                         // 不分块时写盘数据的摘要
+        std::string hash_;                   // 上传完成后内容的SHA-256
+        std::string expect_hash_;            // 客户端给出的内容哈希 空表示没有给出
+        uint64_t expect_size_ = 0;           // 客户端给出的文件大小
+    };
+    // 每个工作线程正在进行的上传 key为连接 服务端的一个连接同一时刻只处理一个请求
+    thread_local std::unordered_map<struct evhttp_connection *, UploadContext> upload_contexts_;
+#if LIBEVENT_VERSION_NUMBER < 0x02020000
+    //
+    // libevent 2.1下一个连接收到的请求流 上传请求的请求体在evhttp读取之前取出 见UploadInputCallback
+    // - 上传请求的请求头先扣留 请求体接收完后改写为Content-Length: 0并带上序号交给evhttp
+    // - Upload按Upload-Spool头中的序号取走对应的上传
+    //
+    struct UploadInput
+    {
+        enum Stage { HEAD, BODY, PASS, RAW };
+        Stage stage_ = HEAD;    // HEAD接收请求头 BODY接收上传的请求体 PASS请求体交给evhttp RAW之后的数据全部交给evhttp
+        std::string head_;      // 还不完整的请求头 BODY时为改写后的请求头
+        uint64_t left_ = 0;     // 当前请求剩余的请求体字节数
+        UploadContext ctx_;     // BODY时正在接收的上传
+        uint64_t seq_ = 0;      // 最近一个取出请求体的上传的序号
+        std::deque<std::pair<uint64_t, UploadContext>> ready_; // 请求体已经接收完 等待Upload取走的上传
+    };
+    // 每个工作线程的连接的请求流 key为连接 连接关闭时清理
+    thread_local std::unordered_map<struct evhttp_connection *, UploadInput> upload_inputs_;
+#endif
+
+    //
+    // 流式下载上下文
+    // - 块容器每次只解压一块放入输出缓冲区 这一块发送完后在回调中解压下一块
+    // - 每个下载同一时间只持有一块 首字节的延迟与文件大小无关 解压的块放入共享的块缓存 见LoadBlock
+    // - 多区间请求依次发送各区间 boundary_不为空时每个区间前发送multipart分段头 最后发送结束分隔符
+    //
+    struct StreamContext
+    {
+        struct evhttp_request *req_ = nullptr;
+        std::shared_ptr<BlockReader> reader_; // IO线程解压时也持有 连接关闭后仍然有效
+        uint64_t id_ = 0;   // 连接释放后地址可能被新连接复用 用id确认解压完成时还是同一次下载
+        uint64_t next_ = 0; // 下一个要发送的字节在原文件中的偏移
+        uint64_t end_ = 0;  // 发送到该偏移为止(不含)
+        std::vector<std::pair<uint64_t, uint64_t>> parts_; // 要发送的区间[start, end)
+        size_t part_ = 0;      // 下一个要开始的区间
+        std::string boundary_; // multipart/byteranges的分隔符 单区间和整个文件为空
+    };
+    // 每个工作线程正在进行的流式下载 key为连接
+    thread_local std::unordered_map<struct evhttp_connection *, StreamContext> stream_contexts_;
+    thread_local uint64_t stream_seq_ = 0;
+
+    // 热点下载文件的fd和块索引缓存 所有工作线程共享
+    FileCache file_cache_(Config::GetInstance()->GetFdCacheSize());
+    // 小文件的内存缓存 所有工作线程共享
+    ContentCache content_cache_(Config::GetInstance()->GetMemoryCacheSize(), Config::GetInstance()->GetMemoryCacheMaxFile());
+    // 内容寻址的分块存储 chunk_dedup开启时上传的文件分块去重后保存在这里
+    ChunkStore chunk_store_;
+    // 串行化上传文件的发布 同一url的旧清单只释放一次
+    std::mutex publish_mutex_;
+    // 分块引用计数是否已经由后台重建完成 publish_mutex_保护
+    bool chunk_refs_loaded_ = false;
+    // 重建期间已经计入引用计数的清单 key为url value为清单路径 publish_mutex_保护 重建完成后清空
+    std::unordered_map<std::string, std::string> counted_manifests_;
+    // 小文件的段存储 不超过segment_max_file的上传文件追加到段文件中
+    SegmentStore segment_store_(&data_);
+
+    //
+    // 下载请求在IO线程中打开的文件
+    // - code_不是HTTP_OK时回复该状态码
+    //
+    struct DownloadSource
+    {
+        int code_ = HTTP_OK;
+        std::shared_ptr<const CachedFile> file_;
+    };
+    // 同一个存储文件的并发下载只打开/解压一次 key为storage_path_ 段文件中的小文件再加上偏移
+    SingleFlight<std::shared_ptr<const DownloadSource>> download_flights_;
+    // 实际调用OpenSource的次数
+    std::atomic<uint64_t> download_opens_{0};
+    // 流式下载解压出的块 同一个块容器的并发下载共用 见LoadBlock
+    BlockCache block_cache_(Config::GetInstance()->GetBlockCacheSize());
+    // 同一块的并发解压只执行一次 key同block_cache_ 失败时结果为nullptr
+    SingleFlight<std::shared_ptr<const std::string>> block_flights_;
+    // 文件列表的版本 存储信息每次插入、删除、替换时加1 与启动时间一起组成列表页的ETag
+    std::atomic<uint64_t> list_version_{0};
+    const time_t start_time_ = time(nullptr);
+    // 文件列表页的模板 修改后自动重新加载
+    enum { LIST_FILE_LIST, LIST_BACKEND_URL };
+    PageTemplate list_template_("index.html", {"{{FILE_LIST}}", "{{BACKEND_URL}}"});
+
     //
     // 服务器端
     //
@@ -24,19 +149,74 @@ namespace storage
         int server_port_;
         std::string server_ip_;
         std::string download_prefix_;
+        int server_threads_;
+        std::vector<struct event_base *> bases_;   // 每个工作线程的事件库
+        std::vector<struct evhttp *> http_servers_; // 每个工作线程的http服务器
     public:
         Service() {
             server_port_ = Config::GetInstance()->GetServerPort();
+            server_threads_ = Config::GetInstance()->GetServerThreads();
             server_ip_ = Config::GetInstance()->GetServerIp();
             download_prefix_ = Config::GetInstance()->GetDownloadPrefix();
+            data_.SetChangeCallback([](const std::string &url) {
+                file_cache_.Invalidate(url);
+                content_cache_.Invalidate(url);
+                list_version_++;
+            });
+            data_.StartValidation(LoadChunkRefs);
+        }
+
+        //
+        // 由存储信息中的清单重建分块的引用计数 删除没有引用的分块
+        // - 在校验线程中于校验完成后执行 不阻塞启动
+        // - 清单在锁外读取 在publish_mutex_内确认url仍是这份清单且没有计入过才增加引用
+        //   重建期间发布的新清单由Put计入 记录在counted_manifests_中 被覆盖的旧清单只有计入过才释放 见DropStored
+        // - 完成之前ChunkStore不删除引用计数为0的分块
+        //
+        static void LoadChunkRefs() {
+            std::vector<StorageInfo> manifests;
+            data_.ForEach([&manifests](const StorageInfo &info) {
+                if (info.pack_format_ == chunk_manifest_format) {
+                    manifests.push_back(info);
+                }
+            });
+            for (auto &info : manifests) {
+                if (data_.Stopping()) {
+                    return;
+                }
+                BlockReader reader;
+                std::vector<std::pair<std::string, uint32_t>> chunks;
+                if (reader.Open(info.storage_path_) == false || reader.Chunks(&chunks) == false) {
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(publish_mutex_);
+                StorageInfo now;
+                if (data_.GetOneByURL(info.url_, &now) == false || now.pack_format_ != chunk_manifest_format ||
+                    now.storage_path_ != info.storage_path_ || counted_manifests_.count(info.url_)) {
+                    continue;
+                }
+                for (auto &chunk : chunks) {
+                    chunk_store_.AddRef(chunk.first, chunk.second);
+                }
+                counted_manifests_[info.url_] = info.storage_path_;
+            }
+            chunk_store_.Sweep();
+            {
+                std::lock_guard<std::mutex> lock(publish_mutex_);
+                chunk_refs_loaded_ = true;
+                counted_manifests_.clear();
+            }
+            chunk_store_.SetLoaded();
         }
 
         static void
         signal_cb(evutil_socket_t fd, short event, void *arg)
         {
             printf("%s signal received\n", strsignal(fd));
-            struct event_base *event_base = (struct event_base *)arg;
-            event_base_loopbreak(event_base); // 退出事件循环
+            Service *service = (Service *)arg;
+            for (auto base : service->bases_) {
+                event_base_loopbreak(base); // 退出所有工作线程的事件循环
+            }
             // 如果不调用event_base_loopbreak，则会导致程序一直处于阻塞状态，无法退出
             // 这里的意思是，接收到信号后，退出事件循环
             // 也就是退出event_base_dispatch函数
@@ -45,59 +225,144 @@ namespace storage
         // 
         // 远程能够通过浏览器访问的接口
         // - 基于事件驱动的http服务器
+        // - 每个工作线程独占一个event_base和evhttp
+        // - 各线程的监听socket通过SO_REUSEPORT共享同一端口，由内核分发连接
         // 
         bool StartServer()
         {
-            // 创建事件库
-            // 创建基于该事件库的信号
-            // 创建基于该事件库的http服务器
-            //     http服务器绑定端口
+            // 开启libevent的线程支持 使event_base_loopbreak可以跨线程调用
+            // 按配置创建工作线程的事件库
+            //     创建基于该事件库的http服务器
+            //     创建SO_REUSEPORT监听socket并交给http服务器
             //     设置http服务器的回调函数
-            //     设置信号的回调函数
-            // 事件循环
+            // 在主线程的事件库上创建信号
+            // 启动其余工作线程的事件循环 主线程运行第0个事件循环 各线程在IO执行器上注册完成通知
             // 释放资源
+            //     等待工作线程退出
             //     释放http服务器
             //     释放事件库
             //     释放信号
 
-            struct event_base* base = event_base_new();
-            if (base == nullptr)
-            {
+            if (evthread_use_pthreads() != 0) {
                 return false;
             }
 
-            // 创建http服务器
-            struct evhttp* http_server = evhttp_new(base);
-            if (http_server == nullptr) {
-                return false;
+            int thread_num = server_threads_;
+            if (thread_num <= 0) {
+                thread_num = std::thread::hardware_concurrency();
+            }
+            if (thread_num <= 0) {
+                thread_num = 1;
             }
 
-            // 绑定信号
-            struct event *sig_int = evsignal_new(base, SIGINT, signal_cb, base);
-            if (sig_int == nullptr) {
+            // 解析监听地址
+            struct sockaddr_storage addr;
+            int addr_len = sizeof(addr);
+            std::string listen_addr = server_ip_;
+            if (listen_addr.find(':') != std::string::npos) {
+                listen_addr = "[" + listen_addr + "]"; // IPv6
+            }
+            listen_addr += ":" + std::to_string(server_port_);
+            if (evutil_parse_sockaddr_port(listen_addr.c_str(), (struct sockaddr *)&addr, &addr_len) != 0) {
                 return false;
             }
-            event_add(sig_int, NULL);
 
-            // 绑定端口 如果返回-1则表示绑定失败
-            if (evhttp_bind_socket(http_server, server_ip_.c_str(), server_port_) != 0) {
-                return false;
+            bool ret = true;
+            for (int i = 0; i < thread_num; i++) {
+                struct event_base *base = event_base_new();
+                if (base == nullptr) {
+                    ret = false;
+                    break;
+                }
+                bases_.push_back(base);
+
+                // 创建http服务器
+                struct evhttp *http_server = evhttp_new(base);
+                if (http_server == nullptr) {
+                    ret = false;
+                    break;
+                }
+                http_servers_.push_back(http_server);
+
+                // 绑定端口 每个线程一个监听socket 端口通过SO_REUSEPORT复用
+                struct evconnlistener *listener = evconnlistener_new_bind(base, NULL, NULL,
+                    LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC | LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT,
+                    -1, (struct sockaddr *)&addr, addr_len);
+                if (listener == nullptr) {
+                    ret = false;
+                    break;
+                }
+                if (evhttp_bind_listener(http_server, listener) == nullptr) {
+                    evconnlistener_free(listener);
+                    ret = false;
+                    break;
+                }
+
+                // 设置回调函数
+                evhttp_set_gencb(http_server, HttpCallback, NULL);
+#if LIBEVENT_VERSION_NUMBER >= 0x02020000
+                evhttp_set_newreqcb(http_server, NewRequestCallback, NULL); // 在读取请求体之前介入上传请求
+#else
+                // 上传请求的请求体在evhttp读取之前从连接的输入缓冲区取出 见UploadInputCallback
+                evhttp_set_bevcb(http_server, UploadBevCallback, NULL);
+                // 其余请求体由evhttp整体缓存 限制大小 超过时evhttp回复413
+                evhttp_set_max_body_size(http_server, Config::GetInstance()->GetUploadMaxBodySize());
+#endif
+            }
+
+            // 绑定信号
+            struct event *sig_int = nullptr;
+            if (ret) {
+                sig_int = evsignal_new(bases_[0], SIGINT, signal_cb, this);
+                if (sig_int == nullptr) {
+                    ret = false;
+                }
+                else {
+                    event_add(sig_int, NULL);
+                }
             }
 
-            // 设置回调函数
-            evhttp_set_gencb(http_server, HttpCallback, NULL);
+            // 启动冷热分层服务和段压缩
+            TieringService tiering(&data_);
+            tiering.Start();
+            segment_store_.Start();
 
             // 设置事件循环
-            if (base) {
-                if (-1 == event_base_dispatch(base)) {}
+            if (ret) {
+                std::vector<std::thread> workers;
+                for (size_t i = 1; i < bases_.size(); i++) {
+                    workers.emplace_back([base = bases_[i]]() {
+                        io_.Attach(base);
+                        event_base_dispatch(base);
+                    });
+                }
+                io_.Attach(bases_[0]);
+                list_template_.Watch(bases_[0], &io_);
+                if (-1 == event_base_dispatch(bases_[0])) {}
+                for (auto base : bases_) {
+                    event_base_loopbreak(base);
+                }
+                for (auto &worker : workers) {
+                    worker.join();
+                }
             }
-            if (base) {
-                event_base_free(base);
+
+            segment_store_.Stop();
+            data_.Stop(); // 后台的LoadChunkRefs使用chunk_store_ 在它析构前结束
+            io_.Stop(); // 释放各事件库上的通知事件
+            list_template_.Unwatch();
+            if (sig_int) {
+                event_free(sig_int);
             }
-            if (http_server) {
+            for (auto http_server : http_servers_) {
                 evhttp_free(http_server);
             }
-            return true;
+            http_servers_.clear();
+            for (auto base : bases_) {
+                event_base_free(base);
+            }
+            bases_.clear();
+            return ret;
         }
 
     private:
@@ -139,11 +404,9 @@ namespace storage
         }
 
         //
-        // 格式化文件大小
-        // - bytes: 文件大小
-        // - 返回值: 格式化后的字符串
-        // 
-        static std::string formatSize(uint64_t bytes) {
+        // 格式化文件大小并写入buf 例如 1.50 MB
+        //
+        static void AddSize(struct evbuffer *buf, uint64_t bytes) {
             const char *units[] = {"B", "KB", "MB", "GB"};
             int unit_index = 0;
             double size = bytes;
@@ -152,56 +415,49 @@ namespace storage
                 size /= 1024;
                 unit_index++;
             }
-
-            std::stringstream ss;
-            ss << std::fixed << std::setprecision(2) << size << " " << units[unit_index];
-            return ss.str();
+            evbuffer_add_printf(buf, "%.2f %s", size, units[unit_index]);
         }
 
         //
-        // 格式化时间
-        // - t: 时间戳
-        // - 返回值: 格式化后的字符串
+        // 格式化时间并写入buf 格式与ctime相同
         //
-        static std::string TimetoStr(time_t t) {
-            std::string tmp = std::ctime(&t);
-            return tmp;
+        static void AddTime(struct evbuffer *buf, time_t t) {
+            struct tm tm;
+            char str[32];
+            localtime_r(&t, &tm); // 多线程下不能使用返回静态缓冲区的localtime
+            size_t len = strftime(str, sizeof(str), "%a %b %e %H:%M:%S %Y\n", &tm);
+            evbuffer_add(buf, str, len);
         }
 
         //
-        // 文件列表格式化为HTML
-        // - files: 文件列表
-        // - 返回值: 处理后的字符串
+        // 文件列表格式化为HTML 直接写入buf
         //
-        static std::string generateModernFileList(const std::vector<StorageInfo> &files)
+        static void AddFileList(struct evbuffer *buf)
         {
-            std::stringstream ss;
-            ss << "<div class='file-list'><h3>已上传文件</h3>";
+            static const char head[] = "<div class='file-list'><h3>已上传文件</h3>";
+            evbuffer_add(buf, head, sizeof(head) - 1);
 
-            for (const auto &file : files) {
-                std::string filename = FileUtil(file.storage_path_).GetFileName();
+            data_.ForEach([buf](const StorageInfo &file) {
+                const std::string &path = file.storage_path_;
+                const std::string &url = file.url_; // 段文件中的小文件和分层后的文件 存储路径中不是原文件名
+                size_t slash = url.find_last_of('/');
+                size_t name_pos = slash == std::string::npos ? 0 : slash + 1;
 
                 // 从路径中解析存储类型（示例逻辑，需根据实际路径规则调整）
-                std::string storage_type = "low";
-                if (file.storage_path_.find("/deep/") != std::string::npos) {
-                    storage_type = "deep";
-                }
+                bool deep = path.find("/deep/") != std::string::npos;
 
-                ss << "<div class='file-item'>"
-                   << "<div class='file-info'>"
-                   << "<span>📄" << filename << "</span>"
-                   << "<span class='file-type'>"
-                   << (storage_type == "deep" ? "深度存储" : "普通存储")
-                   << "</span>"
-                   << "<span>" << formatSize(file.fsize_) << "</span>"
-                   << "<span>" << TimetoStr(file.mtime_) << "</span>"
-                   << "</div>"
-                   << "<button onclick=\"window.location='" << file.url_ << "'\">⬇️ 下载</button>"
-                   << "</div>";
-            }
+                evbuffer_add_printf(buf, "<div class='file-item'><div class='file-info'><span>📄%.*s</span>"
+                                         "<span class='file-type'>%s</span><span>",
+                                    (int)(url.size() - name_pos), url.data() + name_pos,
+                                    deep ? "深度存储" : "普通存储");
+                AddSize(buf, file.fsize_);
+                evbuffer_add(buf, "</span><span>", 13);
+                AddTime(buf, file.mtime_);
+                evbuffer_add_printf(buf, "</span></div><button onclick=\"window.location='%s'\">⬇️ 下载</button></div>",
+                                    file.url_.c_str());
+            });
 
-            ss << "</div>";
-            return ss.str();
+            evbuffer_add(buf, "</div>", 6);
         }
 
         //
@@ -211,6 +467,10 @@ namespace storage
         //   show
         //   download
         //   upload
+        //   upload/session
+        //   api/files
+        //   api/dir
+        //   stats
         //   notfound
         //
         static void HttpCallback(struct evhttp_request* req, void* arg) {
@@ -219,9 +479,21 @@ namespace storage
             if (path.find("/download/") != std::string::npos) {
                 Download(req, arg);
             }
+            else if (path == "/upload/session" || path.compare(0, 16, "/upload/session/") == 0) {
+                UploadSessionRoute(req, path);
+            }
             else if (path == "/upload") {
                 Upload(req, arg);
             }
+            else if (path == "/api/files") {
+                FileListApi(req);
+            }
+            else if (path == "/api/dir") {
+                DirectoryApi(req);
+            }
+            else if (path == "/stats") {
+                Stats(req);
+            }
             else if (path == "/") {
                 ListShow(req, arg);
             }
@@ -232,142 +504,2260 @@ namespace storage
 
         //
         // 获取文件的etag
-        // - 自定义etag :  filename-fsize-mtime
+        // - 自定义etag :  "filename-fsize-mtime" 按RFC 7232加引号 是强验证器
+        // - 段文件中的小文件共用段文件名 再加上偏移
         //
         static std::string GetETag(const StorageInfo &info) {
             
             FileUtil fu(info.storage_path_);
-            std::string etag = fu.GetFileName();
+            std::string etag = "\"" + fu.GetFileName();
             etag += "-";
             etag += std::to_string(info.fsize_);
             etag += "-";
             etag += std::to_string(info.mtime_);
+            if (info.pack_format_ == segment_needle_format) {
+                etag += "-";
+                etag += std::to_string(info.offset_);
+            }
+            etag += "\"";
             return etag;
         }
 
+        //
+        // 格式化为HTTP日期 例如 Sun, 06 Nov 1994 08:49:37 GMT
+        //
+        static std::string HttpDate(time_t t) {
+            struct tm tm;
+            gmtime_r(&t, &tm);
+            char buf[64];
+            strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            return buf;
+        }
+
+        //
+        // 解析HTTP日期 只支持RFC 7231推荐的IMF-fixdate格式
+        //
+        static bool ParseHttpDate(const char *str, time_t *t) {
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            const char *end = strptime(str, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            if (end == NULL || *end != '\0') {
+                return false;
+            }
+            *t = timegm(&tm);
+            return true;
+        }
+
+        //
+        // If-Match/If-None-Match/If-Range中的ETag列表是否包含etag
+        // - weak为true时使用弱比较 忽略W/前缀 否则带W/的ETag不匹配
+        //
+        static bool MatchETag(const std::string &header, const std::string &etag, bool weak) {
+            size_t pos = 0;
+            while (pos < header.size()) {
+                size_t comma = header.find(',', pos);
+                if (comma == std::string::npos) {
+                    comma = header.size();
+                }
+                std::string tag = header.substr(pos, comma - pos);
+                pos = comma + 1;
+                size_t first = tag.find_first_not_of(" \t");
+                if (first == std::string::npos) {
+                    continue;
+                }
+                tag = tag.substr(first, tag.find_last_not_of(" \t") - first + 1);
+                if (tag == "*") {
+                    return true;
+                }
+                if (tag.compare(0, 2, "W/") == 0) {
+                    if (weak == false) {
+                        continue;
+                    }
+                    tag = tag.substr(2);
+                }
+                if (tag == etag) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        //
+        // 按RFC 7232第6节的顺序检查条件请求
+        // - 返回HTTP_OK表示继续处理 304表示未修改 412表示前提条件不满足
+        // - mtime为0时不检查基于日期的条件
+        //
+        static int CheckPreconditions(struct evhttp_request *req, const std::string &etag, time_t mtime) {
+            const char *if_match = evhttp_find_header(req->input_headers, "If-Match");
+            const char *if_unmodified = evhttp_find_header(req->input_headers, "If-Unmodified-Since");
+            const char *if_none_match = evhttp_find_header(req->input_headers, "If-None-Match");
+            const char *if_modified = evhttp_find_header(req->input_headers, "If-Modified-Since");
+            bool get = evhttp_request_get_command(req) == EVHTTP_REQ_GET || evhttp_request_get_command(req) == EVHTTP_REQ_HEAD;
+            time_t date;
+            if (if_match != NULL) {
+                if (MatchETag(if_match, etag, false) == false) {
+                    return 412;
+                }
+            }
+            else if (if_unmodified != NULL && mtime != 0 && ParseHttpDate(if_unmodified, &date) && mtime > date) {
+                return 412;
+            }
+            if (if_none_match != NULL) {
+                if (MatchETag(if_none_match, etag, true)) {
+                    return get ? 304 : 412;
+                }
+            }
+            else if (if_modified != NULL && get && mtime != 0 && ParseHttpDate(if_modified, &date) && mtime <= date) {
+                return 304;
+            }
+            return HTTP_OK;
+        }
+
+        //
+        // 添加缓存验证相关的响应头 304响应也要带上
+        //
+        static void AddValidators(struct evhttp_request *req, const std::string &etag, time_t mtime,
+                                  const std::string &cache_control) {
+            evhttp_add_header(req->output_headers, "ETag", etag.c_str());
+            if (mtime != 0) {
+                evhttp_add_header(req->output_headers, "Last-Modified", HttpDate(mtime).c_str());
+            }
+            evhttp_add_header(req->output_headers, "Cache-Control", cache_control.c_str());
+        }
+
+        //
+        // 下载响应的Cache-Control 文件可能在同一个url下被重新上传 默认每次使用缓存前都要验证
+        //
+        static std::string DownloadCacheControl() {
+            int64_t max_age = Config::GetInstance()->GetCacheMaxAge();
+            if (max_age == 0) {
+                return "no-cache";
+            }
+            return "public, max-age=" + std::to_string(max_age);
+        }
+
+        //
+        // 解析Range请求头 只支持bytes单位
+        // - header: Range请求头的值 例如 bytes=0-499,1000-,-500
+        // - fsize: 文件大小
+        // - ranges: 可满足的区间 [start, end] 均为闭区间
+        // - 返回值为false表示请求头格式不合法 应忽略Range返回整个文件
+        // - 返回true且ranges为空表示所有区间都无法满足 应返回416
+        //
+        static bool ParseRange(const std::string &header, int64_t fsize,
+                               std::vector<std::pair<int64_t, int64_t>> *ranges) {
+            const std::string unit = "bytes=";
+            if (header.compare(0, unit.size(), unit) != 0) {
+                return false;
+            }
+            const size_t max_ranges = 64; // 防止大量小区间的请求拖垮服务器
+            size_t count = 0;
+            size_t pos = unit.size();
+            while (pos <= header.size()) {
+                size_t comma = header.find(',', pos);
+                if (comma == std::string::npos) {
+                    comma = header.size();
+                }
+                std::string spec = header.substr(pos, comma - pos);
+                pos = comma + 1;
+                // 去掉首尾空白
+                size_t first = spec.find_first_not_of(" \t");
+                if (first == std::string::npos) {
+                    continue;
+                }
+                spec = spec.substr(first, spec.find_last_not_of(" \t") - first + 1);
+                if (++count > max_ranges) {
+                    return false;
+                }
+
+                size_t dash = spec.find('-');
+                if (dash == std::string::npos) {
+                    return false;
+                }
+                std::string first_str = spec.substr(0, dash);
+                std::string last_str = spec.substr(dash + 1);
+                if (first_str.find_first_not_of("0123456789") != std::string::npos ||
+                    last_str.find_first_not_of("0123456789") != std::string::npos ||
+                    first_str.size() > 18 || last_str.size() > 18) {
+                    return false;
+                }
+                if (first_str.empty()) {
+                    // 后缀区间 -n 表示最后n个字节
+                    if (last_str.empty()) {
+                        return false;
+                    }
+                    int64_t suffix = std::stoll(last_str);
+                    if (suffix == 0 || fsize == 0) {
+                        continue;
+                    }
+                    ranges->emplace_back(std::max<int64_t>(0, fsize - suffix), fsize - 1);
+                    continue;
+                }
+                int64_t start = std::stoll(first_str);
+                int64_t end = last_str.empty() ? INT64_MAX : std::stoll(last_str);
+                if (end < start) {
+                    return false;
+                }
+                if (start >= fsize) {
+                    continue; // 无法满足的区间
+                }
+                ranges->emplace_back(start, std::min(end, fsize - 1));
+            }
+            return count > 0;
+        }
+
+        //
+        // 合并重叠或相邻的区间 按起点排序
+        // - 合并后的区间互不重叠 总长度不超过文件大小 重复的区间不会让同一段数据被读取、解压多次
+        //
+        static void MergeRanges(std::vector<std::pair<int64_t, int64_t>> *ranges) {
+            std::sort(ranges->begin(), ranges->end());
+            size_t n = 0;
+            for (auto &r : *ranges) {
+                if (n > 0 && r.first <= (*ranges)[n - 1].second + 1) {
+                    (*ranges)[n - 1].second = std::max((*ranges)[n - 1].second, r.second);
+                    continue;
+                }
+                (*ranges)[n++] = r;
+            }
+            ranges->resize(n);
+        }
+
+        //
+        // 生成multipart/byteranges的分隔符
+        //
+        static std::string MakeBoundary() {
+            static thread_local std::mt19937_64 rng(std::random_device{}());
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)rng());
+            return std::string("NAS_BYTERANGES_") + buf;
+        }
+
+        //
+        // 打开深度存储中整体压缩的旧版文件
+        // - 解压到普通存储目录下的临时文件 打开后立即删除 文件在fd关闭后释放
+        // - 返回值为fd 失败返回-1
+        //
+        static int OpenUnpacked(const StorageInfo &info) {
+            std::string tmp_path = Config::GetInstance()->GetLowStorageDir() + ".unpack.XXXXXX";
+            int tmp_fd = mkstemp(&tmp_path[0]);
+            if (tmp_fd == -1) {
+                return -1;
+            }
+            close(tmp_fd);
+            FileUtil packed(info.storage_path_);
+            if (packed.UnCompress(tmp_path) == false) {
+                unlink(tmp_path.c_str());
+                return -1;
+            }
+            int fd = open(tmp_path.c_str(), O_RDONLY);
+            unlink(tmp_path.c_str());
+            return fd;
+        }
+
+        //
+        // 开始流式发送块容器的各个区间parts
+        // - 使用分块传输编码 发送完一块后由StreamChunkCallback继续
+        // - boundary不为空时按multipart/byteranges发送
+        //
+        static void StreamBegin(struct evhttp_request *req, std::shared_ptr<BlockReader> reader,
+                                std::vector<std::pair<uint64_t, uint64_t>> parts, const std::string &boundary,
+                                int code, const char *reason) {
+            struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+            if (evcon == nullptr) {
+                evhttp_send_reply(req, HTTP_INTERNAL, NULL, NULL); // 客户端已经断开 只释放请求
+                return;
+            }
+            StreamContext &ctx = stream_contexts_[evcon];
+            ctx.req_ = req;
+            ctx.reader_ = std::move(reader);
+            ctx.id_ = ++stream_seq_;
+            ctx.next_ = ctx.end_ = 0;
+            ctx.parts_ = std::move(parts);
+            ctx.part_ = 0;
+            ctx.boundary_ = boundary;
+            evhttp_connection_set_closecb(evcon, ConnectionCloseCallback, NULL);
+            evhttp_send_reply_start(req, code, reason);
+            StreamChunkCallback(evcon, NULL);
+        }
+
+        //
+        // 上一块已经写入socket的回调 在IO线程中解压下一块
+        // - 一个区间发送完后开始下一个区间 multipart先单独发送分段头
+        // - 全部发送完后发送结束分隔符并结束响应
+        //
+        static void StreamChunkCallback(struct evhttp_connection *evcon, void *arg) {
+            auto it = stream_contexts_.find(evcon);
+            if (it == stream_contexts_.end()) {
+                return;
+            }
+            StreamContext &ctx = it->second;
+            while (ctx.next_ >= ctx.end_) {
+                if (ctx.part_ == ctx.parts_.size()) {
+                    struct evhttp_request *req = ctx.req_;
+                    if (ctx.boundary_.empty() == false) {
+                        struct evbuffer *tail = evbuffer_new();
+                        evbuffer_add_printf(tail, "\r\n--%s--\r\n", ctx.boundary_.c_str());
+                        ctx.boundary_.clear();
+                        evhttp_send_reply_chunk_with_cb(req, tail, StreamChunkCallback, NULL);
+                        evbuffer_free(tail);
+                        return;
+                    }
+                    stream_contexts_.erase(it);
+                    evhttp_send_reply_end(req);
+                    return;
+                }
+                ctx.next_ = ctx.parts_[ctx.part_].first;
+                ctx.end_ = ctx.parts_[ctx.part_].second;
+                ctx.part_++;
+                if (ctx.boundary_.empty() == false) {
+                    struct evbuffer *head = evbuffer_new();
+                    evbuffer_add_printf(head,
+                        "\r\n--%s\r\n"
+                        "Content-Type: application/octet-stream\r\n"
+                        "Content-Range: bytes %llu-%llu/%llu\r\n\r\n",
+                        ctx.boundary_.c_str(), (unsigned long long)ctx.next_, (unsigned long long)ctx.end_ - 1,
+                        (unsigned long long)ctx.reader_->RawSize());
+                    evhttp_send_reply_chunk_with_cb(ctx.req_, head, StreamChunkCallback, NULL);
+                    evbuffer_free(head);
+                    return;
+                }
+            }
+            std::shared_ptr<BlockReader> reader = ctx.reader_;
+            size_t index = reader->BlockIndex(ctx.next_);
+            uint64_t id = ctx.id_;
+            auto resume = io_.Resumer();
+            io_.Run([reader, index, evcon, id, resume]() {
+                LoadBlock(reader, index, [evcon, id, resume](const std::shared_ptr<const std::string> &block) {
+                    resume([evcon, id, block]() { StreamSend(evcon, id, block); });
+                });
+            });
+        }
+
+        //
+        // 在IO线程中读取并解压块容器的第index块 结果通过callback返回 失败时为nullptr
+        // - 先查块缓存 同一块的并发解压合并为一次 合并的请求在执行解压的IO线程中回调
+        // - N个客户端同时下载同一个冷文件时每块只解压一次
+        //
+        static void LoadBlock(const std::shared_ptr<BlockReader> &reader, size_t index,
+                              SingleFlight<std::shared_ptr<const std::string>>::Callback callback) {
+            std::string key = reader->Identity() + "#" + std::to_string(index);
+            std::shared_ptr<const std::string> block;
+            if (block_cache_.Get(key, &block)) {
+                callback(block);
+                return;
+            }
+            if (block_flights_.Join(key, callback) == false) {
+                return;
+            }
+            auto decoded = std::make_shared<std::string>();
+            if (reader->ReadBlock(index, decoded.get())) {
+                block = std::move(decoded);
+                block_cache_.Put(key, block);
+            }
+            block_flights_.Finish(key, block);
+        }
+
+        //
+        // 一块解压完成 发送其中属于请求区间的部分
+        // - 块由块缓存和其他下载共享 evbuffer_add_reference引用发送 不拷贝
+        // - 解压失败时已经无法修改状态码 关闭socket让客户端知道响应不完整 由连接关闭的回调清理
+        //
+        static void StreamSend(struct evhttp_connection *evcon, uint64_t id, const std::shared_ptr<const std::string> &block) {
+            auto it = stream_contexts_.find(evcon);
+            if (it == stream_contexts_.end() || it->second.id_ != id) {
+                return; // 解压期间连接已经关闭
+            }
+            StreamContext &ctx = it->second;
+            if (block == nullptr) {
+                shutdown(bufferevent_getfd(evhttp_connection_get_bufferevent(evcon)), SHUT_RDWR);
+                return;
+            }
+            size_t skip = ctx.next_ - ctx.reader_->BlockStart(ctx.reader_->BlockIndex(ctx.next_));
+            size_t len = std::min<uint64_t>(block->size() - skip, ctx.end_ - ctx.next_);
+            ctx.next_ += len;
+            struct evbuffer *chunk = evbuffer_new();
+            auto *ref = new std::shared_ptr<const std::string>(block);
+            if (evbuffer_add_reference(chunk, block->data() + skip, len, ReleaseBlock, ref) != 0) {
+                delete ref;
+                evbuffer_add(chunk, block->data() + skip, len);
+            }
+            evhttp_send_reply_chunk_with_cb(ctx.req_, chunk, StreamChunkCallback, NULL);
+            evbuffer_free(chunk);
+        }
+
+        //
+        // evbuffer_add_reference的释放回调 释放发送期间持有的块引用
+        //
+        static void ReleaseBlock(const void *data, size_t len, void *arg) {
+            delete (std::shared_ptr<const std::string> *)arg;
+        }
+
+        //
+        // 连接关闭的回调 清理未完成的上传和流式下载
+        //
+        static void ConnectionCloseCallback(struct evhttp_connection *evcon, void *arg) {
+            auto stream = stream_contexts_.find(evcon);
+            if (stream != stream_contexts_.end()) {
+                struct evhttp_request *req = stream->second.req_;
+                stream_contexts_.erase(stream);
+                if (evhttp_request_get_connection(req) == nullptr) {
+                    evhttp_send_reply_end(req); // 未完成的请求已经与连接分离 由这里释放
+                }
+            }
+            auto it = upload_contexts_.find(evcon);
+            if (it != upload_contexts_.end()) {
+                UploadAbort(&it->second);
+                upload_contexts_.erase(it);
+            }
+#if LIBEVENT_VERSION_NUMBER < 0x02020000
+            auto input = upload_inputs_.find(evcon);
+            if (input != upload_inputs_.end()) {
+                UploadAbort(&input->second.ctx_);
+                for (auto &ready : input->second.ready_) {
+                    UploadAbort(&ready.second);
+                }
+                upload_inputs_.erase(input);
+            }
+#endif
+        }
+
         //
         // 下载文件
+        // - 支持Range请求 单区间返回206和Content-Range 多区间返回multipart/byteranges
+        // - If-Range与当前ETag或Last-Modified不一致时忽略Range 返回整个文件
+        // - 支持If-None-Match/If-Modified-Since等条件请求 未修改时回复304
+        // - 文件内容通过evbuffer_file_segment加入输出缓冲区 由libevent用sendfile/mmap发送
+        // - 重叠或相邻的区间先合并 重复的区间不会让同一段数据发送多次
+        // - 深度存储中的块容器只解压区间覆盖的块 以分块传输编码逐块流式发送 多区间也不整体解压到内存
+        // - 命中内存缓存或文件缓存时直接在事件循环线程发送 访问时间在IO线程中更新
+        //   否则在IO线程中查找和打开文件 完成后回到事件循环线程发送
         //
         static void Download(struct evhttp_request *req, void *arg) {
-            StorageInfo info;
             std::string resource_path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
             resource_path = UrlDecode(resource_path);
-            data_.GetOneByURL(resource_path, &info);
+            auto src = std::make_shared<DownloadSource>();
+            if (content_cache_.Get(resource_path, &src->file_) || file_cache_.Get(resource_path, &src->file_)) {
+                time_t now = time(nullptr);
+                io_.Run([resource_path, now]() { data_.Touch(resource_path, now); }); // 可能追加日志 不在事件循环线程执行
+                SendSource(req, src.get());
+                return;
+            }
+            auto resume = io_.Resumer();
+            io_.Run([resource_path, req, resume]() {
+                FindSource(resource_path, [req, resume](const std::shared_ptr<const DownloadSource> &src) {
+                    resume([req, src]() { SendSource(req, src.get()); });
+                });
+            });
+        }
+
+        //
+        // 在IO线程中查找要下载的文件 同一个存储文件的并发请求合并为一次打开
+        // - 结果通过callback返回 合并的请求在执行打开的IO线程中回调 不占用等待的IO线程
+        //
+        static void FindSource(const std::string &url,
+                               SingleFlight<std::shared_ptr<const DownloadSource>>::Callback callback) {
+            // 在查找存储信息之前取得缓存的generation 期间的修改会使放入缓存失败
+            uint64_t generation = file_cache_.Generation(url);
+            uint64_t content_generation = content_cache_.Generation(url);
+            StorageInfo info;
+            if (data_.GetOneByURL(url, &info) == false) {
+                auto src = std::make_shared<DownloadSource>();
+                src->code_ = HTTP_NOTFOUND;
+                callback(src);
+                return;
+            }
+            data_.Touch(url, time(nullptr));
+            // 段文件中的小文件共用存储路径 按偏移区分
+            std::string key = info.pack_format_ == segment_needle_format ? info.storage_path_ + "@" + std::to_string(info.offset_)
+                                                                          : info.storage_path_;
+            if (download_flights_.Join(key, callback) == false) {
+                return;
+            }
+            // 上一次打开在本请求查缓存之后、加入之前刚刚完成时 结果已在缓存中 不再重复打开
+            auto src = std::make_shared<DownloadSource>();
+            if (content_cache_.Get(url, &src->file_) == false && file_cache_.Get(url, &src->file_) == false) {
+                download_opens_++;
+                OpenSource(url, info, generation, content_generation, src.get());
+            }
+            download_flights_.Finish(key, src);
+        }
+
+        //
+        // 在IO线程中打开要下载的文件 放入文件缓存
+        // - 块容器只读取footer和块索引 旧版整体压缩的文件解压到临时文件
+        // - 段文件中的小文件打开段文件 文件段从offset_开始
+        // - 内存缓存准入的小文件读出全部内容放入内存缓存 不再保持打开
+        //
+        static void OpenSource(const std::string &url, const StorageInfo &info, uint64_t generation,
+                               uint64_t content_generation, DownloadSource *src) {
+            auto file = std::make_shared<CachedFile>();
+            file->info_ = info;
             std::string download_path = info.storage_path_;
             FileUtil fileutil(download_path);
             if (fileutil.Exist() == false && info.storage_path_.find("deep_storage") != std::string::npos) {
-                evhttp_send_reply(req, HTTP_INTERNAL, NULL, NULL);
+                src->code_ = HTTP_INTERNAL;
+                return;
             }
-
-            bool retrans = false;
-            std::string old_etag;
-            auto if_range = evhttp_find_header(req->input_headers, "If-Range");
-            if (NULL != if_range) {
-                old_etag = if_range;
-                if (old_etag == GetETag(info)) {
-                    retrans = true;
+            int fd = -1;
+            uint64_t offset = 0;
+            if (info.pack_format_ == segment_needle_format) {
+                fd = open(download_path.c_str(), O_RDONLY | O_CLOEXEC);
+                offset = info.offset_;
+            }
+            else if (info.pack_format_ >= 0) {
+                auto reader = std::make_shared<BlockReader>();
+                if (reader->Open(download_path)) {
+                    file->fsize_ = reader->RawSize();
+                    if (LoadContent(url, content_generation, *file, src, [&](std::string *content) {
+                            return reader->Read(0, file->fsize_, content);
+                        })) {
+                        return;
+                    }
+                    file->reader_ = std::move(reader);
+                    file_cache_.Put(url, file, generation);
+                    src->file_ = std::move(file);
+                    return;
                 }
+                fd = OpenUnpacked(info);
             }
-            evbuffer *out_buffer = evhttp_request_get_output_buffer(req);
-            int fd = open(download_path.c_str(), O_RDONLY);
-            if (fd == -1) {
-                evhttp_send_reply(req, HTTP_INTERNAL, NULL, NULL);
+            else {
+                fd = open(download_path.c_str(), O_RDONLY | O_CLOEXEC);
+            }
+            struct stat st;
+            if (fd == -1 || fstat(fd, &st) == -1 ||
+                (info.pack_format_ == segment_needle_format && (uint64_t)st.st_size < info.offset_ + info.fsize_)) {
+                if (fd != -1) {
+                    close(fd);
+                }
+                src->code_ = HTTP_INTERNAL;
                 return;
             }
-            if (-1 == evbuffer_add_file(out_buffer, fd, 0, fileutil.FileSize())) {
+            file->fsize_ = info.pack_format_ == segment_needle_format ? info.fsize_ : st.st_size;
+            if (LoadContent(url, content_generation, *file, src, [&](std::string *content) {
+                    content->resize(file->fsize_);
+                    return StorageIo::Local()->ReadAt(fd, &(*content)[0], content->size(), offset);
+                })) {
+                close(fd);
+                return;
             }
-            evhttp_add_header(req->output_headers, "Accept-Ranges", "bytes");
-            evhttp_add_header(req->output_headers, "ETag", GetETag(info).c_str());
-            evhttp_add_header(req->output_headers, "Content-Type", "application/octet-stream");
-            if (retrans == false) {
-                evhttp_send_reply(req, HTTP_OK, "Success", NULL);
+            if (file->fsize_ > 0) {
+                // 文件段由各个响应共享 缓存和所有响应都释放后关闭fd
+                struct evbuffer_file_segment *seg = evbuffer_file_segment_new(fd, offset, file->fsize_, EVBUF_FS_CLOSE_ON_FREE);
+                if (seg == nullptr) {
+                    close(fd);
+                    src->code_ = HTTP_INTERNAL;
+                    return;
+                }
+                file->seg_.reset(seg, evbuffer_file_segment_free);
             }
             else {
-                evhttp_send_reply(req, 206, "breakpoint continuous transmission", NULL); // 区间请求响应的是206
+                close(fd);
             }
+            file_cache_.Put(url, file, generation);
+            src->file_ = std::move(file);
         }
 
         //
-        // 上传文件
+        // 内存缓存准入时读出文件内容放入内存缓存 并作为本次下载的来源
+        // - 返回false表示不放入内存缓存
         //
-        static void Upload(struct evhttp_request *req, void *arg) {
-            struct evbuffer *buf = evhttp_request_get_input_buffer(req);
-            if (buf == NULL) {
-                evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
-                return;
+        static bool LoadContent(const std::string &url, uint64_t generation, const CachedFile &opened,
+                                DownloadSource *src, std::function<bool(std::string *)> read) {
+            if (content_cache_.Admit(url, opened.fsize_) == false) {
+                return false;
+            }
+            auto content = std::make_shared<std::string>();
+            if (read(content.get()) == false) {
+                return false;
             }
-            size_t len = evbuffer_get_length(buf); // 获取请求体的长度
-            if (len == 0) {
-                evhttp_send_reply(req, HTTP_BADREQUEST, "file empty", NULL);
+            auto file = std::make_shared<CachedFile>();
+            file->info_ = opened.info_;
+            file->fsize_ = opened.fsize_;
+            file->content_ = std::move(content);
+            content_cache_.Put(url, file, generation);
+            src->file_ = std::move(file);
+            return true;
+        }
+
+        //
+        // evbuffer_add_reference的释放回调 释放发送期间持有的文件引用
+        //
+        static void ReleaseContent(const void *data, size_t len, void *arg) {
+            delete (std::shared_ptr<const CachedFile> *)arg;
+        }
+
+        //
+        // 回到事件循环线程 按Range组织响应并发送
+        //
+        static void SendSource(struct evhttp_request *req, const DownloadSource *src) {
+            if (src->code_ != HTTP_OK) {
+                evhttp_send_reply(req, src->code_, src->code_ == HTTP_NOTFOUND ? "Not Found" : NULL, NULL);
                 return;
             }
-            std::string content(len, 0);
-            if (evbuffer_copyout(buf, &content[0], len) == -1) {
-                evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
+            std::shared_ptr<const CachedFile> file = src->file_;
+            const StorageInfo &info = file->info_;
+            const std::shared_ptr<BlockReader> &reader = file->reader_;
+            struct evbuffer_file_segment *seg = file->seg_.get();
+            int64_t fsize = file->fsize_;
+            std::string etag = GetETag(info);
+
+            // 条件请求在Range之前处理
+            evhttp_add_header(req->output_headers, "Accept-Ranges", "bytes");
+            AddValidators(req, etag, info.mtime_, DownloadCacheControl());
+            int precondition = CheckPreconditions(req, etag, info.mtime_);
+            if (precondition == 304) {
+                evhttp_send_reply(req, 304, "Not Modified", NULL);
                 return;
             }
-            std::string filename = evhttp_find_header(req->input_headers, "Filename");
-            filename = base64_decode(filename);
-            std::string filetype = evhttp_find_header(req->input_headers, "StorageType");
-            std::string storage_path;
-            if (filetype == "deep") {
-                storage_path = Config::GetInstance()->GetDeepStorageDir();
+            if (precondition == 412) {
+                evhttp_send_reply(req, 412, "Precondition Failed", NULL);
+                return;
             }
-            else if (filetype == "low") {
-                storage_path = Config::GetInstance()->GetLowStorageDir();
+
+            // 判断是否按区间返回
+            std::vector<std::pair<int64_t, int64_t>> ranges;
+            bool partial = false;
+            auto range = evhttp_find_header(req->input_headers, "Range");
+            if (NULL != range) {
+                partial = true;
+                auto if_range = evhttp_find_header(req->input_headers, "If-Range");
+                time_t date;
+                if (NULL != if_range) {
+                    // If-Range可以是ETag(强比较)或日期(与Last-Modified完全相同才有效)
+                    bool valid = if_range[0] == '"' || if_range[0] == 'W' ? MatchETag(if_range, etag, false)
+                                                                           : ParseHttpDate(if_range, &date) && date == info.mtime_;
+                    if (valid == false) {
+                        partial = false; // 文件已经变化 重新传输整个文件
+                    }
+                }
+                if (partial && ParseRange(range, fsize, &ranges) == false) {
+                    partial = false; // 格式不合法的Range按普通请求处理
+                }
+                MergeRanges(&ranges);
             }
-            else {
-                evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
+
+            if (partial && ranges.empty()) {
+                std::string content_range = "bytes */" + std::to_string(fsize);
+                evhttp_add_header(req->output_headers, "Content-Range", content_range.c_str());
+                evhttp_send_reply(req, 416, "Range Not Satisfiable", NULL);
                 return;
             }
-            storage_path += filename;
-            FileUtil fileutil(storage_path);
-            if (fileutil.SetContent(content.c_str(), content.size()) == false) {
-                evhttp_send_reply(req, HTTP_INTERNAL, "Internal Error", NULL);
+
+            // 块容器在事件循环线程中不读取、解压 全部流式发送
+            if (reader) {
+                std::vector<std::pair<uint64_t, uint64_t>> parts;
+                std::string boundary;
+                if (partial == false) {
+                    parts.emplace_back(0, fsize);
+                    evhttp_add_header(req->output_headers, "Content-Type", "application/octet-stream");
+                }
+                else if (ranges.size() == 1) {
+                    parts.emplace_back(ranges[0].first, ranges[0].second + 1);
+                    std::string content_range = "bytes " + std::to_string(ranges[0].first) + "-" +
+                        std::to_string(ranges[0].second) + "/" + std::to_string(fsize);
+                    evhttp_add_header(req->output_headers, "Content-Range", content_range.c_str());
+                    evhttp_add_header(req->output_headers, "Content-Type", "application/octet-stream");
+                }
+                else {
+                    for (auto &r : ranges) {
+                        parts.emplace_back(r.first, r.second + 1);
+                    }
+                    boundary = MakeBoundary();
+                    std::string content_type = "multipart/byteranges; boundary=" + boundary;
+                    evhttp_add_header(req->output_headers, "Content-Type", content_type.c_str());
+                }
+                StreamBegin(req, reader, std::move(parts), boundary,
+                            partial ? 206 : HTTP_OK, partial ? "Partial Content" : "Success");
                 return;
             }
-            StorageInfo info;
-            info.storage_path_ = storage_path;
-            info.mtime_ = fileutil.GetLastModifyTime();
-            info.atime_ = fileutil.GetLastAccessTime();
+
+            evbuffer *out_buffer = evhttp_request_get_output_buffer(req);
+            auto add_range = [&](int64_t start, int64_t len) -> bool {
+                if (file->content_) {
+                    // 引用缓存中的内容 不拷贝 发送完后释放引用
+                    auto *ref = new std::shared_ptr<const CachedFile>(file);
+                    if (evbuffer_add_reference(out_buffer, file->content_->data() + start, len, ReleaseContent, ref) != 0) {
+                        delete ref;
+                        return false;
+                    }
+                    return true;
+                }
+                return evbuffer_add_file_segment(out_buffer, seg, start, len) == 0;
+            };
+            bool ok = true;
+            if (partial == false) {
+                if (fsize > 0 && add_range(0, fsize) == false) {
+                    ok = false;
+                }
+                evhttp_add_header(req->output_headers, "Content-Type", "application/octet-stream");
+            }
+            else if (ranges.size() == 1) {
+                int64_t start = ranges[0].first, end = ranges[0].second;
+                if (add_range(start, end - start + 1) == false) {
+                    ok = false;
+                }
+                std::string content_range = "bytes " + std::to_string(start) + "-" +
+                    std::to_string(end) + "/" + std::to_string(fsize);
+                evhttp_add_header(req->output_headers, "Content-Range", content_range.c_str());
+                evhttp_add_header(req->output_headers, "Content-Type", "application/octet-stream");
+            }
+            else {
+                std::string boundary = MakeBoundary();
+                for (auto &r : ranges) {
+                    evbuffer_add_printf(out_buffer,
+                        "\r\n--%s\r\n"
+                        "Content-Type: application/octet-stream\r\n"
+                        "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                        boundary.c_str(), (long long)r.first, (long long)r.second, (long long)fsize);
+                    if (add_range(r.first, r.second - r.first + 1) == false) {
+                        ok = false;
+                        break;
+                    }
+                }
+                evbuffer_add_printf(out_buffer, "\r\n--%s--\r\n", boundary.c_str());
+                std::string content_type = "multipart/byteranges; boundary=" + boundary;
+                evhttp_add_header(req->output_headers, "Content-Type", content_type.c_str());
+            }
+            if (ok == false) {
+                evbuffer_drain(out_buffer, evbuffer_get_length(out_buffer));
+                evhttp_send_reply(req, HTTP_INTERNAL, NULL, NULL);
+                return;
+            }
+            if (partial == false) {
+                evhttp_send_reply(req, HTTP_OK, "Success", NULL);
+            }
+            else {
+                evhttp_send_reply(req, 206, "Partial Content", NULL); // 区间请求响应的是206
+            }
+        }
+
+        //
+        // 写入JSON字符串 转义引号、反斜杠和控制字符
+        //
+        static void AddJsonString(struct evbuffer *buf, const std::string &str) {
+            evbuffer_add(buf, "\"", 1);
+            size_t start = 0;
+            for (size_t i = 0; i < str.size(); i++) {
+                unsigned char c = str[i];
+                if (c != '"' && c != '\\' && c >= 0x20) {
+                    continue;
+                }
+                evbuffer_add(buf, str.data() + start, i - start);
+                if (c == '"' || c == '\\') {
+                    evbuffer_add_printf(buf, "\\%c", c);
+                }
+                else {
+                    evbuffer_add_printf(buf, "\\u%04x", c);
+                }
+                start = i + 1;
+            }
+            evbuffer_add(buf, str.data() + start, str.size() - start);
+            evbuffer_add(buf, "\"", 1);
+        }
+
+        //
+        // 分页的文件列表 GET /api/files?cursor=&limit=&sort=&order=
+        // - sort为name(默认)、mtime或size order为asc(默认)或desc limit默认100 最大1000
+        // - cursor取上一页返回的next_cursor 没有更多记录时next_cursor为null
+        // - prefix只列出名字以prefix开头的文件(含各级子目录) 只支持按name升序
+        // - 由DataManager的有序索引定位 每次只读取一页 在IO线程中直接写成紧凑的JSON
+        //
+        static void FileListApi(struct evhttp_request *req) {
+            const size_t default_limit = 100, max_limit = 1000;
+            struct evkeyvalq params;
+            TAILQ_INIT(&params);
+            const char *query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+            if (query != NULL && evhttp_parse_query_str(query, &params) != 0) {
+                evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
+                return;
+            }
+            const char *cursor_param = evhttp_find_header(&params, "cursor");
+            const char *limit_param = evhttp_find_header(&params, "limit");
+            const char *sort_param = evhttp_find_header(&params, "sort");
+            const char *order_param = evhttp_find_header(&params, "order");
+            const char *prefix_param = evhttp_find_header(&params, "prefix");
+            std::string sort = sort_param ? sort_param : "name";
+            std::string order = order_param ? order_param : "asc";
+            std::string cursor_str = cursor_param ? cursor_param : "";
+            std::string prefix = prefix_param ? prefix_param : "";
+            uint64_t limit = default_limit;
+            bool ok = (limit_param == NULL || (ParseNumber(limit_param, &limit) && limit > 0 && limit <= max_limit)) &&
+                      (order == "asc" || order == "desc");
+            evhttp_clear_headers(&params);
+
+            DataManager::ListOrder list_order = DataManager::LIST_BY_URL;
+            if (sort == "mtime") {
+                list_order = DataManager::LIST_BY_MTIME;
+            }
+            else if (sort == "size") {
+                list_order = DataManager::LIST_BY_SIZE;
+            }
+            else if (sort != "name") {
+                ok = false;
+            }
+            if (!prefix.empty() && (list_order != DataManager::LIST_BY_URL || order != "asc")) {
+                ok = false;
+            }
+            // 游标按url排序时就是url 否则为 排序键:url
+            auto cursor = std::make_shared<DataManager::ListCursor>();
+            if (ok && !cursor_str.empty()) {
+                if (list_order == DataManager::LIST_BY_URL) {
+                    cursor->url_ = cursor_str;
+                }
+                else {
+                    size_t colon = cursor_str.find(':');
+                    ok = colon != std::string::npos && ParseNumber(cursor_str.substr(0, colon), &cursor->value_);
+                    if (ok) {
+                        cursor->url_ = cursor_str.substr(colon + 1);
+                    }
+                }
+            }
+            if (ok == false) {
+                evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
+                return;
+            }
+            bool desc = order == "desc";
+            bool has_cursor = !cursor_str.empty();
+            struct evbuffer *body = evbuffer_new();
+            if (body == nullptr) {
+                evhttp_send_reply(req, HTTP_INTERNAL, NULL, NULL);
+                return;
+            }
+            io_.Post([body, list_order, desc, cursor, has_cursor, limit, prefix]() {
+                std::vector<StorageInfo> page;
+                bool more = false;
+                if (prefix.empty()) {
+                    data_.List(list_order, desc, has_cursor ? cursor.get() : nullptr, limit, &page, &more);
+                }
+                else {
+                    std::string url_prefix = Config::GetInstance()->GetDownloadPrefix() + prefix;
+                    data_.ListPrefix(url_prefix, cursor->url_, limit, &page, &more);
+                }
+                AddFilePage(body, list_order, page, more);
+            }, [req, body]() {
+                evbuffer_add_buffer(evhttp_request_get_output_buffer(req), body);
+                evbuffer_free(body);
+                evhttp_add_header(req->output_headers, "Content-Type", "application/json");
+                evhttp_add_header(req->output_headers, "Cache-Control", "no-cache");
+                evhttp_send_reply(req, HTTP_OK, "Success", NULL);
+            });
+        }
+
+        //
+        // 一页文件列表写成JSON
+        // {"files":[{"name":..,"url":..,"size":..,"mtime":..,"storage":"low"|"deep"}],"next_cursor":..}
+        //
+        static void AddFilePage(struct evbuffer *buf, DataManager::ListOrder order,
+                                const std::vector<StorageInfo> &page, bool more) {
+            const std::string &prefix = Config::GetInstance()->GetDownloadPrefix();
+            evbuffer_add(buf, "{\"files\":[", 10);
+            for (size_t i = 0; i < page.size(); i++) {
+                const StorageInfo &info = page[i];
+                std::string name = info.url_.compare(0, prefix.size(), prefix) == 0 ? info.url_.substr(prefix.size()) : info.url_;
+                evbuffer_add(buf, i == 0 ? "{" : ",{", i == 0 ? 1 : 2);
+                AddFileFields(buf, name, info);
+                evbuffer_add(buf, "}", 1);
+            }
+            evbuffer_add(buf, "],\"next_cursor\":", 16);
+            if (more && !page.empty()) {
+                const StorageInfo &last = page.back();
+                std::string cursor = last.url_;
+                if (order != DataManager::LIST_BY_URL) {
+                    cursor = std::to_string(DataManager::SortValue(order, last)) + ":" + last.url_;
+                }
+                AddJsonString(buf, cursor);
+            }
+            else {
+                evbuffer_add(buf, "null", 4);
+            }
+            evbuffer_add(buf, "}", 1);
+        }
+
+        //
+        // 文件的JSON字段 "name":..,"url":..,"size":..,"mtime":..,"storage":"low"|"deep"
+        //
+        static void AddFileFields(struct evbuffer *buf, const std::string &name, const StorageInfo &info) {
+            const std::string &deep_dir = Config::GetInstance()->GetDeepStorageDir();
+            bool deep = info.storage_path_.compare(0, deep_dir.size(), deep_dir) == 0;
+            evbuffer_add(buf, "\"name\":", 7);
+            AddJsonString(buf, name);
+            evbuffer_add(buf, ",\"url\":", 7);
+            AddJsonString(buf, info.url_);
+            evbuffer_add_printf(buf, ",\"size\":%llu,\"mtime\":%lld,\"storage\":\"%s\"",
+                                (unsigned long long)info.fsize_, (long long)info.mtime_, deep ? "deep" : "low");
+        }
+
+        //
+        // 目录列表 GET /api/dir?path=&cursor=&limit=
+        // - path为空表示根目录 否则以'/'结尾 如 photos/2024/
+        // - 按名字顺序列出直接子项 子目录以'/'结尾 并给出其下各级的文件数
+        // - cursor取上一页返回的next_cursor 即上一页最后一项的名字 limit默认100 最大1000
+        // {"path":..,"entries":[{"name":"sub/","type":"dir","count":..},{"name":..,"type":"file","url":..,...}],"next_cursor":..}
+        //
+        static void DirectoryApi(struct evhttp_request *req) {
+            const size_t default_limit = 100, max_limit = 1000;
+            struct evkeyvalq params;
+            TAILQ_INIT(&params);
+            const char *query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+            if (query != NULL && evhttp_parse_query_str(query, &params) != 0) {
+                evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
+                return;
+            }
+            const char *path_param = evhttp_find_header(&params, "path");
+            const char *cursor_param = evhttp_find_header(&params, "cursor");
+            const char *limit_param = evhttp_find_header(&params, "limit");
+            std::string path = path_param ? path_param : "";
+            std::string cursor = cursor_param ? cursor_param : "";
+            uint64_t limit = default_limit;
+            bool ok = (limit_param == NULL || (ParseNumber(limit_param, &limit) && limit > 0 && limit <= max_limit)) &&
+                      (path.empty() || (path.back() == '/' && ValidFileName(path.substr(0, path.size() - 1))));
+            evhttp_clear_headers(&params);
+            if (ok == false) {
+                evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
+                return;
+            }
+            struct evbuffer *body = evbuffer_new();
+            if (body == nullptr) {
+                evhttp_send_reply(req, HTTP_INTERNAL, NULL, NULL);
+                return;
+            }
+            io_.Post([body, path, cursor, limit]() {
+                std::vector<DataManager::DirEntry> entries;
+                bool more = false;
+                data_.ListDirectory(Config::GetInstance()->GetDownloadPrefix() + path, cursor, limit, &entries, &more);
+                evbuffer_add(body, "{\"path\":", 8);
+                AddJsonString(body, path);
+                evbuffer_add(body, ",\"entries\":[", 12);
+                for (size_t i = 0; i < entries.size(); i++) {
+                    const DataManager::DirEntry &entry = entries[i];
+                    evbuffer_add(body, i == 0 ? "{" : ",{", i == 0 ? 1 : 2);
+                    if (entry.dir_) {
+                        evbuffer_add(body, "\"name\":", 7);
+                        AddJsonString(body, entry.name_);
+                        evbuffer_add_printf(body, ",\"type\":\"dir\",\"count\":%llu", (unsigned long long)entry.count_);
+                    }
+                    else {
+                        AddFileFields(body, entry.name_, entry.info_);
+                        evbuffer_add(body, ",\"type\":\"file\"", 14);
+                    }
+                    evbuffer_add(body, "}", 1);
+                }
+                evbuffer_add(body, "],\"next_cursor\":", 16);
+                if (more && !entries.empty()) {
+                    AddJsonString(body, entries.back().name_);
+                }
+                else {
+                    evbuffer_add(body, "null", 4);
+                }
+                evbuffer_add(body, "}", 1);
+            }, [req, body]() {
+                evbuffer_add_buffer(evhttp_request_get_output_buffer(req), body);
+                evbuffer_free(body);
+                evhttp_add_header(req->output_headers, "Content-Type", "application/json");
+                evhttp_add_header(req->output_headers, "Cache-Control", "no-cache");
+                evhttp_send_reply(req, HTTP_OK, "Success", NULL);
+            });
+        }
+
+        //
+        // 运行统计 JSON格式
+        // - memory_cache: 小文件内存缓存的命中次数、未命中次数、命中率、已用字节数、文件数和容量
+        // - download_open: 未命中缓存的下载实际打开/解压文件的次数 和合并到其他请求的次数
+        // - block_decode: 流式下载实际解压块的次数、合并到其他请求的次数 块缓存的命中和未命中次数
+        // - chunk_store: 分块数、分块占用的字节数、写入的分块数、其中重复的分块数和去重节省的字节数
+        // - segment_store: 段数、段占用的字节数、追加的小文件数、压缩的段数和回收的字节数
+        // - validation: 启动校验是否完成、已校验的记录数、删除的记录数和按文件更新的记录数
+        //
+        static void Stats(struct evhttp_request *req) {
+            ContentCache::Stats stats = content_cache_.GetStats();
+            Json::Value root;
+            Json::Value &cache = root["memory_cache"];
+            cache["hits"] = (Json::UInt64)stats.hits_;
+            cache["misses"] = (Json::UInt64)stats.misses_;
+            uint64_t lookups = stats.hits_ + stats.misses_;
+            cache["hit_ratio"] = lookups == 0 ? 0.0 : (double)stats.hits_ / lookups;
+            cache["used_bytes"] = (Json::UInt64)stats.used_;
+            cache["entries"] = (Json::UInt64)stats.entries_;
+            cache["capacity_bytes"] = (Json::UInt64)stats.capacity_;
+            Json::Value &open = root["download_open"];
+            open["executions"] = (Json::UInt64)download_opens_.load();
+            open["coalesced"] = (Json::UInt64)download_flights_.Coalesced();
+            Json::Value &decode = root["block_decode"];
+            decode["executions"] = (Json::UInt64)block_flights_.Executions();
+            decode["coalesced"] = (Json::UInt64)block_flights_.Coalesced();
+            decode["cache_hits"] = (Json::UInt64)block_cache_.Hits();
+            decode["cache_misses"] = (Json::UInt64)block_cache_.Misses();
+            ChunkStore::Stats chunk_stats = chunk_store_.GetStats();
+            Json::Value &chunks = root["chunk_store"];
+            chunks["chunks"] = (Json::UInt64)chunk_stats.chunks_;
+            chunks["stored_bytes"] = (Json::UInt64)chunk_stats.bytes_;
+            chunks["puts"] = (Json::UInt64)chunk_stats.puts_;
+            chunks["duplicates"] = (Json::UInt64)chunk_stats.duplicates_;
+            chunks["duplicate_bytes"] = (Json::UInt64)chunk_stats.duplicate_bytes_;
+            SegmentStore::Stats segment_stats = segment_store_.GetStats();
+            Json::Value &segments = root["segment_store"];
+            segments["segments"] = (Json::UInt64)segment_stats.segments_;
+            segments["stored_bytes"] = (Json::UInt64)segment_stats.bytes_;
+            segments["appended"] = (Json::UInt64)segment_stats.appended_;
+            segments["compacted"] = (Json::UInt64)segment_stats.compacted_;
+            segments["reclaimed_bytes"] = (Json::UInt64)segment_stats.reclaimed_bytes_;
+            DataManager::ValidateStats validate_stats = data_.GetValidateStats();
+            Json::Value &validation = root["validation"];
+            validation["done"] = validate_stats.done_;
+            validation["checked"] = (Json::UInt64)validate_stats.checked_;
+            validation["purged"] = (Json::UInt64)validate_stats.purged_;
+            validation["refreshed"] = (Json::UInt64)validate_stats.refreshed_;
+            std::string content;
+            JSON_util::Serialize(root, content);
+            evbuffer_add(evhttp_request_get_output_buffer(req), content.data(), content.size());
+            evhttp_add_header(req->output_headers, "Content-Type", "application/json");
+            evhttp_send_reply(req, HTTP_OK, "Success", NULL);
+        }
+
+        //
+        // 根据请求头Filename和StorageType得到文件的存储路径
+        // - Filename可以是以'/'分隔的多级路径 如 photos/2024/a.jpg 存储在存储目录下对应的子目录中
+        // - 请求头缺失、文件名不合法或存储类型不合法返回false
+        // - 深度存储下的tiered_dir目录存放分层归档的文件 不能作为上传路径
+        //
+        static bool GetUploadPath(struct evhttp_request *req, std::string *storage_path) {
+            const char *filename_header = evhttp_find_header(req->input_headers, "Filename");
+            const char *filetype_header = evhttp_find_header(req->input_headers, "StorageType");
+            if (filename_header == NULL || filetype_header == NULL) {
+                return false;
+            }
+            std::string filename = base64_decode(std::string(filename_header));
+            std::string filetype = filetype_header;
+            if (ValidFileName(filename) == false) {
+                return false;
+            }
+            if (filetype == "deep") {
+                if (filename.compare(0, filename.find('/'), TieringService::tiered_dir) == 0) {
+                    return false;
+                }
+                *storage_path = Config::GetInstance()->GetDeepStorageDir();
+            }
+            else if (filetype == "low") {
+                *storage_path = Config::GetInstance()->GetLowStorageDir();
+            }
+            else {
+                return false;
+            }
+            *storage_path += filename;
+            return true;
+        }
+
+        //
+        // 读取请求头Upload-Hash(内容SHA-256的十六进制)和Upload-Length(文件大小)
+        // - 都没有时返回true 只有一个或格式不正确返回false
+        //
+        static bool GetUploadHash(struct evhttp_request *req, UploadContext *ctx) {
+            const char *hash = evhttp_find_header(req->input_headers, "Upload-Hash");
+            const char *length = evhttp_find_header(req->input_headers, "Upload-Length");
+            if (hash == NULL && length == NULL) {
+                return true;
+            }
+            return hash != NULL && length != NULL && Sha256::FromHex(hash, &ctx->expect_hash_) &&
+                   ParseNumber(length, &ctx->expect_size_);
+        }
+
+        //
+        // 文件名的每一级都不能为空、.或.. 不能以'/'开头或结尾 不能包含'\0'
+        //
+        static bool ValidFileName(const std::string &filename) {
+            if (filename.empty() || filename.find('\0') != std::string::npos) {
+                return false;
+            }
+            size_t start = 0;
+            while (true) {
+                size_t slash = filename.find('/', start);
+                std::string part = filename.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+                if (part.empty() || part == "." || part == "..") {
+                    return false;
+                }
+                if (slash == std::string::npos) {
+                    return true;
+                }
+                start = slash + 1;
+            }
+        }
+
+        //
+        // 存储路径相对于存储目录的文件名 即url中下载前缀之后的部分
+        //
+        static std::string StorageName(const std::string &storage_path) {
+            for (const std::string &dir : {Config::GetInstance()->GetLowStorageDir(), Config::GetInstance()->GetDeepStorageDir()}) {
+                if (storage_path.compare(0, dir.size(), dir) == 0) {
+                    return storage_path.substr(dir.size());
+                }
+            }
+            return FileUtil(storage_path).GetFileName();
+        }
+
+        //
+        // 开始一次上传 在存储目录下创建临时文件
+        // - 返回值为HTTP状态码 HTTP_OK表示成功
+        // - Content-Length不超过segment_max_file时不创建临时文件 请求体留在内存中 提交时追加到段文件
+        //
+        static int UploadBegin(struct evhttp_request *req, UploadContext *ctx) {
+            if (GetUploadPath(req, &ctx->storage_path_) == false || GetUploadHash(req, ctx) == false) {
+                return HTTP_BADREQUEST;
+            }
+            const char *length = evhttp_find_header(req->input_headers, "Content-Length");
+            uint64_t content_length = 0;
+            bool small = length != NULL && ParseNumber(length, &content_length) && content_length <= segment_store_.MaxFile();
+            if (small == false && UploadCreateTemp(ctx) == false) {
+                return HTTP_INTERNAL;
+            }
+            ctx->pending_ = evbuffer_new();
+            if (ctx->pending_ == nullptr) {
+                UploadAbort(ctx);
+                return HTTP_INTERNAL;
+            }
+            return HTTP_OK;
+        }
+
+        //
+        // 在存储目录下创建临时文件
+        // - 临时文件和最终文件在同一目录下 保证rename是原子的 多级路径先创建所在的目录
+        //
+        static bool UploadCreateTemp(UploadContext *ctx) {
+            if (FileUtil(ctx->storage_path_).CreateParentDirectory() == false) {
+                return false;
+            }
+            ctx->tmp_path_ = ctx->storage_path_ + ".uploading.XXXXXX";
+            ctx->fd_ = mkstemp(&ctx->tmp_path_[0]);
+            if (ctx->fd_ == -1) {
+                return false;
+            }
+            if (Config::GetInstance()->GetChunkDedup()) {
+                ctx->chunks_ = std::make_shared<ChunkWriter>(&chunk_store_);
+                if (ctx->chunks_->Open(ctx->tmp_path_) == false) {
+                    UploadAbort(ctx);
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //
+        // 将buf中的数据从*offset处写入fd 写入的数据从buf中移除 *offset随之前移
+        // - buf中最多max_batch段连续内存作为一批定位写请求 通过当前线程的存储IO后端提交 不拷贝数据
+        //
+        static bool WriteBuffer(int fd, struct evbuffer *buf, uint64_t *offset) {
+            const int max_batch = 16;
+            StorageIo *io = StorageIo::Local();
+            while (evbuffer_get_length(buf) > 0) {
+                struct evbuffer_iovec vec[max_batch];
+                int n = std::min(evbuffer_peek(buf, -1, NULL, vec, max_batch), max_batch);
+                IoRequest requests[max_batch];
+                uint64_t end = *offset;
+                for (int i = 0; i < n; i++) {
+                    requests[i].fd_ = fd;
+                    requests[i].buf_ = vec[i].iov_base;
+                    requests[i].len_ = vec[i].iov_len;
+                    requests[i].offset_ = end;
+                    requests[i].write_ = true;
+                    end += vec[i].iov_len;
+                }
+                io->Submit(requests, n);
+                for (int i = 0; i < n; i++) {
+                    IoRequest &r = requests[i];
+                    if (r.result_ < 0 && r.result_ != -EINTR && r.result_ != -EAGAIN) {
+                        return false;
+                    }
+                    size_t done = r.result_ < 0 ? 0 : r.result_;
+                    if (done < r.len_ && io->WriteAt(r.fd_, (char *)r.buf_ + done, r.len_ - done, r.offset_ + done) == false) {
+                        return false; // 短写 补写剩余部分
+                    }
+                }
+                evbuffer_drain(buf, end - *offset);
+                *offset = end;
+            }
+            return true;
+        }
+
+        //
+        // 将pending_中的数据全部写入临时文件 分块去重时存入分块存储
+        //
+        static bool UploadFlush(UploadContext *ctx) {
+            if (ctx->chunks_) {
+                return ChunkBuffer(ctx->chunks_.get(), ctx->pending_, &ctx->written_);
+            }
+            HashBuffer(&ctx->sha_, ctx->pending_);
+            return WriteBuffer(ctx->fd_, ctx->pending_, &ctx->written_);
+        }
+
+        //
+        // 把buf中的数据追加到摘要 不移除数据
+        //
+        static void HashBuffer(Sha256 *sha, struct evbuffer *buf) {
+            int n = evbuffer_peek(buf, -1, NULL, NULL, 0);
+            std::vector<struct evbuffer_iovec> vec(n);
+            n = evbuffer_peek(buf, -1, NULL, vec.data(), n);
+            for (int i = 0; i < n; i++) {
+                sha->Update(vec[i].iov_base, vec[i].iov_len);
+            }
+        }
+
+        //
+        // 计算fd中[0, size)的内容的SHA-256
+        //
+        static bool HashFile(int fd, uint64_t size, std::string *hash) {
+            const size_t piece = 1024 * 1024;
+            std::string buf;
+            Sha256 sha;
+            for (uint64_t offset = 0; offset < size; offset += buf.size()) {
+                buf.resize(std::min<uint64_t>(piece, size - offset));
+                if (StorageIo::Local()->ReadAt(fd, &buf[0], buf.size(), offset) == false) {
+                    return false;
+                }
+                sha.Update(buf.data(), buf.size());
+            }
+            *hash = sha.Final();
+            return true;
+        }
+
+        //
+        // 将buf中的数据追加到分块写入器 追加的数据从buf中移除
+        //
+        static bool ChunkBuffer(ChunkWriter *chunks, struct evbuffer *buf, uint64_t *offset) {
+            const int max_batch = 16;
+            while (evbuffer_get_length(buf) > 0) {
+                struct evbuffer_iovec vec[max_batch];
+                int n = std::min(evbuffer_peek(buf, -1, NULL, vec, max_batch), max_batch);
+                size_t len = 0;
+                for (int i = 0; i < n; i++) {
+                    if (chunks->Append((const char *)vec[i].iov_base, vec[i].iov_len) == false) {
+                        return false;
+                    }
+                    len += vec[i].iov_len;
+                }
+                evbuffer_drain(buf, len);
+                *offset += len;
+            }
+            return true;
+        }
+
+        //
+        // 将收到的数据移入pending_ 超过upload_buffer_size就写盘
+        // - evbuffer_add_buffer只移动数据块 不拷贝数据
+        //
+        static void UploadWrite(UploadContext *ctx, struct evbuffer *in) {
+            size_t len = evbuffer_get_length(in);
+            if (ctx->failed_) {
+                evbuffer_drain(in, len);
+                return;
+            }
+            ctx->received_ += len;
+            evbuffer_add_buffer(ctx->pending_, in);
+            size_t buffer_size = Config::GetInstance()->GetUploadBufferSize();
+            if (evbuffer_get_length(ctx->pending_) >= buffer_size) {
+                if ((ctx->fd_ == -1 && UploadCreateTemp(ctx) == false) || UploadFlush(ctx) == false) {
+                    ctx->failed_ = true;
+                    evbuffer_drain(ctx->pending_, evbuffer_get_length(ctx->pending_));
+                }
+            }
+        }
+
+        //
+        // 写入剩余数据并关闭临时文件 得到内容哈希
+        // - 失败时删除临时文件
+        //
+        static bool UploadFinish(UploadContext *ctx) {
+            bool ret = !ctx->failed_ && UploadFlush(ctx);
+            if (ret && ctx->chunks_) {
+                ret = ctx->chunks_->Finish();
+            }
+            if (close(ctx->fd_) != 0) {
+                ret = false;
+            }
+            ctx->fd_ = -1;
+            evbuffer_free(ctx->pending_);
+            ctx->pending_ = nullptr;
+            if (ret == false) {
+                if (ctx->chunks_) {
+                    ctx->chunks_->Abort();
+                }
+                unlink(ctx->tmp_path_.c_str());
+                return false;
+            }
+            ctx->hash_ = ctx->chunks_ ? ctx->chunks_->Digest() : ctx->sha_.Final();
+            return true;
+        }
+
+        //
+        // 放弃上传 删除临时文件
+        //
+        static void UploadAbort(UploadContext *ctx) {
+            if (ctx->chunks_) {
+                ctx->chunks_->Abort(); // 释放已经存入的分块
+                ctx->chunks_.reset();
+            }
+            if (ctx->fd_ != -1) {
+                close(ctx->fd_);
+                unlink(ctx->tmp_path_.c_str());
+                ctx->fd_ = -1;
+            }
+            if (ctx->pending_) {
+                evbuffer_free(ctx->pending_);
+                ctx->pending_ = nullptr;
+            }
+        }
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02020000
+        //
+        // 新请求创建时的回调 在请求头解析完成后判断是否为上传请求
+        //
+        static int NewRequestCallback(struct evhttp_request *req, void *arg) {
+            evhttp_request_set_header_cb(req, UploadHeaderCallback);
+            return 0;
+        }
+
+        //
+        // 请求头解析完成的回调
+        // - 上传请求在这里创建临时文件并设置请求体的分块回调 请求体不再整体缓存在内存中
+        // - 失败时不做处理 由Upload按整体缓存的请求体处理并回复错误
+        //
+        static int UploadHeaderCallback(struct evhttp_request *req, void *arg) {
+            if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+                return 0;
+            }
+            std::string path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+            if (UrlDecode(path) != "/upload") {
+                return 0;
+            }
+            UploadContext ctx;
+            if (UploadBegin(req, &ctx) != HTTP_OK) {
+                return 0;
+            }
+            struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+            upload_contexts_[evcon] = ctx;
+            evhttp_connection_set_closecb(evcon, ConnectionCloseCallback, NULL);
+            evhttp_request_set_chunked_cb(req, UploadChunkCallback);
+            return 0;
+        }
+
+        //
+        // 收到一段请求体的回调 写入临时文件
+        //
+        static void UploadChunkCallback(struct evhttp_request *req, void *arg) {
+            auto it = upload_contexts_.find(evhttp_request_get_connection(req));
+            if (it == upload_contexts_.end()) {
+                return;
+            }
+            UploadWrite(&it->second, evhttp_request_get_input_buffer(req));
+        }
+
+        //
+        // 取出UploadHeaderCallback为这个请求创建的上传
+        //
+        static bool TakeUploadContext(struct evhttp_request *req, UploadContext *ctx) {
+            auto it = upload_contexts_.find(evhttp_request_get_connection(req));
+            if (it == upload_contexts_.end()) {
+                return false;
+            }
+            *ctx = it->second;
+            upload_contexts_.erase(it);
+            return true;
+        }
+#else
+        //
+        // 为新连接创建bufferevent 在它的输入缓冲区上注册UploadInputCallback
+        // - 注册失败时返回NULL 由evhttp自己创建 上传请求体整体缓存
+        //
+        static struct bufferevent *UploadBevCallback(struct event_base *base, void *arg) {
+            struct bufferevent *bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+            if (bev != nullptr && evbuffer_add_cb(bufferevent_get_input(bev), UploadInputCallback, bev) == nullptr) {
+                bufferevent_free(bev);
+                return nullptr;
+            }
+            return bev;
+        }
+
+        //
+        // 连接的输入缓冲区变化的回调 在evhttp的读回调之前处理新读入的数据
+        // - libevent 2.1没有在读取请求体之前介入的接口 这里自己按请求头划分请求 见UploadSplit
+        // - 缓冲区前部是之前处理过、evhttp还没有读取的数据 保持不动
+        // - evhttp创建连接时把连接设为bufferevent回调的参数 由此找到连接 连接关闭时清理请求流
+        //
+        static void UploadInputCallback(struct evbuffer *input, const struct evbuffer_cb_info *info, void *arg) {
+            thread_local bool busy = false; // 下面修改输入缓冲区时会再次触发这个回调
+            if (info->n_added == 0 || busy) {
+                return;
+            }
+            bufferevent_data_cb readcb, writecb;
+            bufferevent_event_cb eventcb;
+            void *cbarg = nullptr;
+            bufferevent_getcb((struct bufferevent *)arg, &readcb, &writecb, &eventcb, &cbarg);
+            struct evhttp_connection *evcon = (struct evhttp_connection *)cbarg;
+            if (evcon == nullptr) {
+                return;
+            }
+            auto it = upload_inputs_.find(evcon);
+            if (it == upload_inputs_.end()) {
+                it = upload_inputs_.emplace(evcon, UploadInput()).first;
+                evhttp_connection_set_closecb(evcon, ConnectionCloseCallback, NULL);
+            }
+            UploadInput &in = it->second;
+            if (in.stage_ == UploadInput::RAW) {
+                return;
+            }
+            if (in.stage_ == UploadInput::PASS && info->n_added <= in.left_) {
+                in.left_ -= info->n_added;
+                in.stage_ = in.left_ == 0 ? UploadInput::HEAD : UploadInput::PASS;
+                return;
+            }
+            busy = true;
+            size_t old = evbuffer_get_length(input) - info->n_added;
+            if (in.stage_ == UploadInput::BODY && old == 0 && info->n_added < in.left_) {
+                in.left_ -= info->n_added;
+                UploadWrite(&in.ctx_, input); // 只有请求体 整体移走
+                busy = false;
+                return;
+            }
+            struct evbuffer *fresh = evbuffer_new();
+            struct evbuffer *out = evbuffer_new();
+            if (fresh != nullptr && out != nullptr) {
+                evbuffer_remove_buffer(input, out, old);
+                evbuffer_add_buffer(fresh, input);
+                UploadSplit(&in, (struct bufferevent *)arg, fresh, out);
+                evbuffer_add_buffer(input, out);
+            }
+            else {
+                in.stage_ = UploadInput::RAW; // 无法划分 之后全部交给evhttp
+            }
+            if (fresh != nullptr) {
+                evbuffer_free(fresh);
+            }
+            if (out != nullptr) {
+                evbuffer_free(out);
+            }
+            busy = false;
+        }
+
+        //
+        // 按请求划分新读入的数据fresh 交给evhttp的数据追加到out
+        // - 请求头超过64KB时不再划分 交给evhttp处理
+        //
+        static void UploadSplit(UploadInput *in, struct bufferevent *bev, struct evbuffer *fresh, struct evbuffer *out) {
+            const size_t max_head = 64 * 1024;
+            while (evbuffer_get_length(fresh) > 0) {
+                size_t len = evbuffer_get_length(fresh);
+                if (in->stage_ == UploadInput::RAW) {
+                    evbuffer_add_buffer(out, fresh);
+                }
+                else if (in->stage_ == UploadInput::PASS) {
+                    size_t n = std::min<uint64_t>(len, in->left_);
+                    evbuffer_remove_buffer(fresh, out, n);
+                    in->left_ -= n;
+                    if (in->left_ == 0) {
+                        in->stage_ = UploadInput::HEAD;
+                    }
+                }
+                else if (in->stage_ == UploadInput::BODY) {
+                    if (len <= in->left_) {
+                        in->left_ -= len;
+                        UploadWrite(&in->ctx_, fresh);
+                    }
+                    else {
+                        struct evbuffer *body = evbuffer_new();
+                        if (body == nullptr) {
+                            in->ctx_.failed_ = true; // 丢弃这个上传 由UploadCommit回复错误
+                            evbuffer_drain(fresh, in->left_);
+                        }
+                        else {
+                            evbuffer_remove_buffer(fresh, body, in->left_);
+                            UploadWrite(&in->ctx_, body);
+                            evbuffer_free(body);
+                        }
+                        in->left_ = 0;
+                    }
+                    if (in->left_ == 0) {
+                        in->ready_.emplace_back(in->seq_, in->ctx_);
+                        in->ctx_ = UploadContext();
+                        evbuffer_add(out, in->head_.data(), in->head_.size());
+                        in->head_.clear();
+                        in->stage_ = UploadInput::HEAD;
+                    }
+                }
+                else {
+                    size_t size = in->head_.size();
+                    in->head_.resize(size + len);
+                    evbuffer_remove(fresh, &in->head_[size], len);
+                    size_t end = HeadEnd(in->head_);
+                    if (end == std::string::npos) {
+                        if (in->head_.size() > max_head) {
+                            evbuffer_add(out, in->head_.data(), in->head_.size());
+                            in->head_.clear();
+                            in->stage_ = UploadInput::RAW;
+                        }
+                        continue;
+                    }
+                    evbuffer_prepend(fresh, in->head_.data() + end, in->head_.size() - end);
+                    in->head_.resize(end);
+                    UploadRoute(in, bev, out);
+                }
+            }
+        }
+
+        //
+        // 请求头结束(第一个空行之后)的位置 还不完整时返回npos
+        //
+        static size_t HeadEnd(const std::string &head) {
+            size_t pos = 0;
+            while (true) {
+                size_t eol = head.find('\n', pos);
+                if (eol == std::string::npos) {
+                    return std::string::npos;
+                }
+                if (eol == pos || (eol == pos + 1 && head[pos] == '\r')) {
+                    return eol + 1;
+                }
+                pos = eol + 1;
+            }
+        }
+
+        //
+        // 一个完整的请求头到达后决定如何处理它的请求体
+        // - 带Content-Length的POST /upload且UploadBegin成功 扣留请求头 请求体由UploadSplit写入临时文件
+        //   客户端等待100 Continue时由这里回复 只在输出缓冲区为空时回复 不会插入到其他响应中间
+        // - 带Transfer-Encoding或Content-Length无效 之后的数据全部交给evhttp
+        // - 其余请求原样交给evhttp 跳过Content-Length字节的请求体
+        //
+        static void UploadRoute(UploadInput *in, struct bufferevent *bev, struct evbuffer *out) {
+            std::vector<std::string> lines;
+            for (size_t pos = 0; pos < in->head_.size();) {
+                size_t eol = in->head_.find('\n', pos);
+                std::string line = in->head_.substr(pos, eol - pos);
+                if (line.empty() == false && line.back() == '\r') {
+                    line.pop_back();
+                }
+                lines.push_back(line);
+                pos = eol + 1;
+            }
+            lines.pop_back(); // 结束的空行
+            std::string method, uri, version;
+            if (lines.empty() == false) {
+                size_t sp1 = lines[0].find(' ');
+                size_t sp2 = sp1 == std::string::npos ? std::string::npos : lines[0].find(' ', sp1 + 1);
+                if (sp2 != std::string::npos) {
+                    method = lines[0].substr(0, sp1);
+                    uri = lines[0].substr(sp1 + 1, sp2 - sp1 - 1);
+                    version = lines[0].substr(sp2 + 1);
+                }
+            }
+            struct evhttp_request *req = evhttp_request_new(NULL, NULL);
+            bool folded = false, chunked = false;
+            int lengths = 0;
+            std::string length, expect;
+            for (size_t i = 1; i < lines.size(); i++) {
+                size_t colon = lines[i].find(':');
+                if (lines[i][0] == ' ' || lines[i][0] == '\t' || colon == std::string::npos) {
+                    folded = true;
+                    continue;
+                }
+                std::string name = lines[i].substr(0, colon);
+                size_t start = lines[i].find_first_not_of(" \t", colon + 1);
+                std::string value = start == std::string::npos ? "" : lines[i].substr(start);
+                value.erase(value.find_last_not_of(" \t") + 1);
+                if (evutil_ascii_strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+                    chunked = true;
+                }
+                else if (evutil_ascii_strcasecmp(name.c_str(), "Content-Length") == 0) {
+                    lengths++;
+                    length = value;
+                }
+                else if (evutil_ascii_strcasecmp(name.c_str(), "Expect") == 0) {
+                    expect = value;
+                }
+                if (req != nullptr) {
+                    evhttp_add_header(evhttp_request_get_input_headers(req), name.c_str(), value.c_str());
+                }
+            }
+            uint64_t content_length = 0;
+            if (chunked || lengths > 1 || (lengths == 1 && ParseNumber(length, &content_length) == false)) {
+                if (req != nullptr) {
+                    evhttp_request_free(req);
+                }
+                evbuffer_add(out, in->head_.data(), in->head_.size());
+                in->head_.clear();
+                in->stage_ = UploadInput::RAW;
+                return;
+            }
+            bool upload = req != nullptr && method == "POST" && content_length > 0 && folded == false &&
+                          (expect.empty() || evutil_ascii_strcasecmp(expect.c_str(), "100-continue") == 0);
+            if (upload) {
+                struct evhttp_uri *parsed = evhttp_uri_parse_with_flags(uri.c_str(), EVHTTP_URI_NONCONFORMANT);
+                const char *path = parsed == nullptr ? nullptr : evhttp_uri_get_path(parsed);
+                upload = path != nullptr && UrlDecode(path) == "/upload";
+                if (parsed != nullptr) {
+                    evhttp_uri_free(parsed);
+                }
+            }
+            UploadContext ctx;
+            if (upload && UploadBegin(req, &ctx) == HTTP_OK) {
+                evhttp_request_free(req);
+                // 改写请求头 去掉Content-Length和Expect 带上序号
+                std::string head = lines[0] + "\r\n";
+                for (size_t i = 1; i < lines.size(); i++) {
+                    std::string name = lines[i].substr(0, lines[i].find(':'));
+                    if (evutil_ascii_strcasecmp(name.c_str(), "Content-Length") != 0 &&
+                        evutil_ascii_strcasecmp(name.c_str(), "Expect") != 0 &&
+                        evutil_ascii_strcasecmp(name.c_str(), "Upload-Spool") != 0) {
+                        head += lines[i] + "\r\n";
+                    }
+                }
+                in->head_ = head + "Content-Length: 0\r\nUpload-Spool: " + std::to_string(++in->seq_) + "\r\n\r\n";
+                in->ctx_ = ctx;
+                in->left_ = content_length;
+                in->stage_ = UploadInput::BODY;
+                if (expect.empty() == false && version == "HTTP/1.1" && evbuffer_get_length(bufferevent_get_output(bev)) == 0) {
+                    // evhttp读取请求期间关闭了写事件 直接写socket 写不进去时客户端超时后照常发送请求体
+                    send(bufferevent_getfd(bev), "HTTP/1.1 100 Continue\r\n\r\n", 25, MSG_NOSIGNAL);
+                }
+                return;
+            }
+            if (req != nullptr) {
+                evhttp_request_free(req);
+            }
+            evbuffer_add(out, in->head_.data(), in->head_.size());
+            in->head_.clear();
+            in->left_ = content_length;
+            in->stage_ = content_length > 0 ? UploadInput::PASS : UploadInput::HEAD;
+        }
+
+        //
+        // 取出UploadInputCallback为这个请求接收的上传 请求头中的Upload-Spool是它的序号
+        //
+        static bool TakeUploadContext(struct evhttp_request *req, UploadContext *ctx) {
+            const char *spool = evhttp_find_header(req->input_headers, "Upload-Spool");
+            auto it = upload_inputs_.find(evhttp_request_get_connection(req));
+            if (spool == NULL || it == upload_inputs_.end() || it->second.ready_.empty() ||
+                std::to_string(it->second.ready_.front().first) != spool) {
+                return false;
+            }
+            *ctx = it->second.ready_.front().second;
+            it->second.ready_.pop_front();
+            return true;
+        }
+#endif
+
+        //
+        // 上传文件
+        // - libevent 2.2及以上 请求体已在UploadChunkCallback中流式写入临时文件
+        // - libevent 2.1 带Content-Length的请求体已在UploadInputCallback中流式写入临时文件
+        // - 其余情况(如chunked请求体)由evhttp整体缓存 这里交给IO线程写盘
+        //   请求体超过upload_max_body_size时evhttp直接回复413 不会调用这里
+        //
+        static void Upload(struct evhttp_request *req, void *arg) {
+            auto ctx = std::make_shared<UploadContext>();
+            if (TakeUploadContext(req, ctx.get()) == false) {
+                if (GetUploadPath(req, &ctx->storage_path_) == false || GetUploadHash(req, ctx.get()) == false) {
+                    evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
+                    return;
+                }
+                // 请求体移入pending_ 在IO线程中创建临时文件并写盘
+                ctx->pending_ = evbuffer_new();
+                if (ctx->pending_ == nullptr) {
+                    evhttp_send_reply(req, HTTP_INTERNAL, "Internal Error", NULL);
+                    return;
+                }
+                struct evbuffer *in = evhttp_request_get_input_buffer(req);
+                ctx->received_ = evbuffer_get_length(in);
+                evbuffer_add_buffer(ctx->pending_, in);
+            }
+            auto code = std::make_shared<int>(HTTP_OK);
+            io_.Post([ctx, code]() { *code = UploadCommit(ctx.get()); }, [req, ctx, code]() {
+                if (*code == HTTP_OK) {
+                    evhttp_send_reply(req, HTTP_OK, "Success", NULL);
+                }
+                else if (*code == HTTP_NOTFOUND) {
+                    evhttp_send_reply(req, HTTP_NOTFOUND, "Content Not Found", NULL);
+                }
+                else if (*code == HTTP_BADREQUEST) {
+                    evhttp_send_reply(req, HTTP_BADREQUEST, ctx->received_ == 0 ? "file empty" : "Hash Mismatch", NULL);
+                }
+                else {
+                    evhttp_send_reply(req, HTTP_INTERNAL, "Internal Error", NULL);
+                }
+            });
+        }
+
+        //
+        // 在IO线程中完成上传 写入剩余数据 rename为最终文件并记录存储信息
+        // - 返回值为HTTP状态码
+        // - 分块去重时只有与已存储的分块不同的数据写盘 临时文件是引用这些分块的清单
+        // - 没有请求体但给出了Upload-Hash时秒传 没有相同内容返回404 客户端再带上请求体上传
+        // - 给出了Upload-Hash时请求体的哈希或大小与之不符返回400 不保存
+        // - 还没有创建临时文件的小文件追加到段文件
+        //
+        static int UploadCommit(UploadContext *ctx) {
+            if (ctx->received_ == 0) {
+                UploadAbort(ctx);
+                if (ctx->expect_hash_.empty()) {
+                    return HTTP_BADREQUEST;
+                }
+                return InstantUpload(ctx->storage_path_, ctx->expect_hash_, ctx->expect_size_) ? HTTP_OK : HTTP_NOTFOUND;
+            }
+            if (ctx->fd_ == -1 && ctx->received_ <= segment_store_.MaxFile()) {
+                return UploadNeedle(ctx);
+            }
+            if (ctx->fd_ == -1 && UploadCreateTemp(ctx) == false) {
+                UploadAbort(ctx);
+                return HTTP_INTERNAL;
+            }
+            if (UploadFinish(ctx) == false) {
+                return HTTP_INTERNAL;
+            }
+            int pack_format = ctx->chunks_ ? chunk_manifest_format : -1;
+            if (HashMismatch(ctx)) {
+                if (ctx->chunks_) {
+                    ReleaseManifest(ctx->tmp_path_);
+                }
+                unlink(ctx->tmp_path_.c_str());
+                return HTTP_BADREQUEST;
+            }
+            if (PublishUpload(ctx->tmp_path_, ctx->storage_path_, pack_format, ctx->received_, ctx->hash_) == false) {
+                return HTTP_INTERNAL;
+            }
+            return HTTP_OK;
+        }
+
+        //
+        // 给出了Upload-Hash时 请求体的哈希或大小是否与之不符
+        //
+        static bool HashMismatch(const UploadContext *ctx) {
+            return ctx->expect_hash_.empty() == false && (ctx->hash_ != ctx->expect_hash_ || ctx->received_ != ctx->expect_size_);
+        }
+
+        //
+        // 把内存中的小文件追加到段文件并记录存储信息 不创建临时文件
+        // - 返回值为HTTP状态码
+        //
+        static int UploadNeedle(UploadContext *ctx) {
+            size_t len = evbuffer_get_length(ctx->pending_);
+            const char *data = (const char *)evbuffer_pullup(ctx->pending_, -1);
+            ctx->hash_ = Sha256::Digest(data, len);
+            int code = HTTP_OK;
+            std::string segment_path;
+            uint64_t offset = 0;
+            if (HashMismatch(ctx)) {
+                code = HTTP_BADREQUEST;
+            }
+            else if (segment_store_.Append(data, len, &segment_path, &offset) == false) {
+                code = HTTP_INTERNAL;
+            }
+            else {
+                if (PublishNeedle(ctx->storage_path_, segment_path, offset, len, ctx->hash_) == false) {
+                    code = HTTP_INTERNAL;
+                }
+                segment_store_.Done(segment_path);
+            }
+            UploadAbort(ctx);
+            return code;
+        }
+
+        //
+        // 秒传 已有内容哈希和大小都相同的文件时 在storage_path建立指向同一份数据的硬链接并记录存储信息
+        // - 清单被多个存储信息引用时分块按引用它的存储信息计数 链接清单时增加引用
+        // - 持有publish_mutex_ 链接和增加引用期间源清单不会被覆盖释放
+        // - 段文件中的小文件不能硬链接 复制为新的小文件
+        // - 没有相同内容或无法建立硬链接(如不在同一文件系统)时返回false
+        //
+        static bool InstantUpload(const std::string &storage_path, const std::string &hash, uint64_t size) {
+            StorageInfo src;
+            std::string tmp_path = storage_path + ".uploading.XXXXXX";
+            {
+                std::unique_lock<std::mutex> lock(publish_mutex_);
+                if (data_.FindByHash(hash, size, &src) == false) {
+                    return false;
+                }
+                if (src.pack_format_ == segment_needle_format) {
+                    lock.unlock();
+                    return CopyNeedle(storage_path, src);
+                }
+                if (FileUtil(storage_path).CreateParentDirectory() == false) {
+                    return false;
+                }
+                int fd = mkstemp(&tmp_path[0]); // 只用于取得不重复的文件名
+                if (fd == -1) {
+                    return false;
+                }
+                close(fd);
+                unlink(tmp_path.c_str());
+                if (link(src.storage_path_.c_str(), tmp_path.c_str()) != 0) {
+                    return false;
+                }
+                if (src.pack_format_ == chunk_manifest_format) {
+                    BlockReader reader;
+                    std::vector<std::pair<std::string, uint32_t>> chunks;
+                    if (reader.Open(tmp_path) == false || reader.Chunks(&chunks) == false) {
+                        unlink(tmp_path.c_str());
+                        return false;
+                    }
+                    for (auto &chunk : chunks) {
+                        chunk_store_.AddRef(chunk.first, chunk.second);
+                    }
+                }
+            }
+            return PublishUpload(tmp_path, storage_path, src.pack_format_, src.fsize_, hash);
+        }
+
+        //
+        // 把段文件中的小文件src复制到当前段 记录为storage_path对应的url
+        //
+        static bool CopyNeedle(const std::string &storage_path, const StorageInfo &src) {
+            std::string data, segment_path;
+            uint64_t offset = 0;
+            if (SegmentStore::Read(src, &data) == false ||
+                segment_store_.Append(data.data(), data.size(), &segment_path, &offset) == false) {
+                return false;
+            }
+            bool ret = PublishNeedle(storage_path, segment_path, offset, data.size(), src.hash_);
+            segment_store_.Done(segment_path);
+            return ret;
+        }
+
+        //
+        // 把上传完成的临时文件rename为最终文件并记录存储信息
+        // - pack_format不小于0时临时文件是块容器或分块去重的清单 raw_size为原文件大小
+        // - 记录新的存储信息后清理同一url原来的存储文件 见DropStored
+        // - 持有publish_mutex_ 同一url的并发提交不会重复释放同一个旧清单
+        // - 失败时删除临时文件 rename之后记录失败的把文件移回临时路径再删除 不留下没有存储信息的文件
+        // - 旧文件就在storage_path时先硬链接一份 记录失败时移回原处 存储信息仍指向完整的旧文件
+        //
+        static bool PublishUpload(const std::string &tmp_path, const std::string &storage_path, int pack_format,
+                                  uint64_t raw_size, const std::string &hash) {
+            std::string url = Config::GetInstance()->GetDownloadPrefix() + StorageName(storage_path);
+            std::lock_guard<std::mutex> lock(publish_mutex_);
+            StorageInfo old;
+            std::vector<std::pair<std::string, uint32_t>> old_chunks;
+            bool exist = FindStored(url, &old, &old_chunks);
+            std::string backup_path;
+            bool backup_ok = true;
+            if (exist && old.storage_path_ == storage_path && FileUtil(storage_path).Exist()) {
+                backup_path = storage_path + ".old.XXXXXX";
+                int fd = mkstemp(&backup_path[0]); // 只用于取得不重复的文件名
+                backup_ok = fd != -1 && close(fd) == 0 && unlink(backup_path.c_str()) == 0 &&
+                            link(storage_path.c_str(), backup_path.c_str()) == 0;
+            }
+            bool renamed = backup_ok && rename(tmp_path.c_str(), storage_path.c_str()) == 0;
+            if (renamed && RecordUpload(storage_path, pack_format, raw_size, hash)) {
+                if (backup_path.empty() == false) {
+                    unlink(backup_path.c_str());
+                }
+                if (exist) {
+                    DropStored(old, old_chunks, storage_path);
+                }
+                if (pack_format == chunk_manifest_format && chunk_refs_loaded_ == false) {
+                    counted_manifests_[url] = storage_path; // 分块已由Put或秒传计入 LoadChunkRefs不再重复计入
+                }
+                return true;
+            }
+            if (renamed) {
+                rename(storage_path.c_str(), tmp_path.c_str());
+            }
+            if (backup_path.empty() == false) {
+                if (renamed) {
+                    rename(backup_path.c_str(), storage_path.c_str());
+                }
+                else {
+                    unlink(backup_path.c_str());
+                }
+            }
+            if (pack_format == chunk_manifest_format) {
+                ReleaseManifest(tmp_path);
+            }
+            unlink(tmp_path.c_str());
+            return false;
+        }
+
+        //
+        // 记录追加到段文件中的小文件的存储信息
+        // - 与PublishUpload一样在publish_mutex_内清理同一url原来的存储文件
+        //
+        static bool PublishNeedle(const std::string &storage_path, const std::string &segment_path, uint64_t offset,
+                                  uint64_t size, const std::string &hash) {
+            StorageInfo info;
+            info.url_ = Config::GetInstance()->GetDownloadPrefix() + StorageName(storage_path);
+            info.storage_path_ = segment_path;
+            info.offset_ = offset;
+            info.fsize_ = size;
+            info.pack_format_ = segment_needle_format;
+            info.mtime_ = info.atime_ = time(nullptr);
+            info.hash_ = hash;
+            std::lock_guard<std::mutex> lock(publish_mutex_);
+            StorageInfo old;
+            std::vector<std::pair<std::string, uint32_t>> old_chunks;
+            bool exist = FindStored(info.url_, &old, &old_chunks);
+            if (data_.Insert(info) == false) {
+                return false;
+            }
+            if (exist) {
+                DropStored(old, old_chunks, segment_path);
+            }
+            return true;
+        }
+
+        //
+        // 读取url原来的存储信息 是清单时读出它引用的分块
+        // - url不存在返回false
+        //
+        static bool FindStored(const std::string &url, StorageInfo *old, std::vector<std::pair<std::string, uint32_t>> *old_chunks) {
+            if (data_.GetOneByURL(url, old) == false) {
+                return false;
+            }
+            if (old->pack_format_ == chunk_manifest_format) {
+                BlockReader reader;
+                if (reader.Open(old->storage_path_) == false || reader.Chunks(old_chunks) == false) {
+                    old_chunks->clear(); // 读不出的旧清单不释放 分块在下次启动时由Sweep清理
+                }
+            }
+            return true;
+        }
+
+        //
+        // url记录了新的存储信息后清理原来的存储文件
+        // - 释放旧清单的分块引用 引用计数重建完成之前只释放已经计入的清单
+        // - 旧文件不在新的存储路径时删除 如分层后的块容器、改存到段文件中的文件
+        // - 段文件中的旧数据不删除 由段压缩回收
+        //
+        static void DropStored(const StorageInfo &old, const std::vector<std::pair<std::string, uint32_t>> &old_chunks,
+                               const std::string &storage_path) {
+            bool counted = chunk_refs_loaded_;
+            if (counted == false && old.pack_format_ == chunk_manifest_format) {
+                auto it = counted_manifests_.find(old.url_);
+                counted = it != counted_manifests_.end() && it->second == old.storage_path_;
+                if (it != counted_manifests_.end()) {
+                    counted_manifests_.erase(it);
+                }
+            }
+            if (counted) {
+                for (auto &chunk : old_chunks) {
+                    chunk_store_.Release(chunk.first);
+                }
+            }
+            if (old.storage_path_ != storage_path && old.pack_format_ != segment_needle_format) {
+                unlink(old.storage_path_.c_str());
+            }
+        }
+
+        //
+        // 释放清单引用的全部分块
+        //
+        static void ReleaseManifest(const std::string &path) {
+            BlockReader reader;
+            std::vector<std::pair<std::string, uint32_t>> chunks;
+            if (reader.Open(path) && reader.Chunks(&chunks)) {
+                for (auto &chunk : chunks) {
+                    chunk_store_.Release(chunk.first);
+                }
+            }
+        }
+
+        //
+        // 记录上传完成的文件的存储信息
+        // - pack_format不小于0时存储文件是块容器或分块去重的清单 记录原文件大小raw_size
+        //
+        static bool RecordUpload(const std::string &storage_path, int pack_format, uint64_t raw_size,
+                                 const std::string &hash) {
+            FileUtil fileutil(storage_path);
+            StorageInfo info;
+            info.storage_path_ = storage_path;
+            info.mtime_ = fileutil.GetLastModifyTime();
+            info.atime_ = fileutil.GetLastAccessTime();
             info.fsize_ = fileutil.FileSize();
+            if (pack_format >= 0) {
+                info.fsize_ = raw_size;
+                info.pack_format_ = pack_format;
+            }
+            info.hash_ = hash;
             Config *config = Config::GetInstance();
-            info.url_ = config->GetDownloadPrefix() + fileutil.GetFileName();
-            if (data_.Insert(info) == false) {
-                evhttp_send_reply(req, HTTP_INTERNAL, "Internal Error", NULL);
+            info.url_ = config->GetDownloadPrefix() + StorageName(storage_path);
+            return data_.Insert(info);
+        }
+
+        //
+        // 分块上传会话
+        // - POST /upload/session 请求头Filename和StorageType同普通上传 Upload-Length为文件总大小 返回会话id
+        // - PUT /upload/session/<id> 请求头Content-Range: bytes start-end/total 指定请求体在文件中的位置
+        // - GET /upload/session/<id> 查询已收到的区间 客户端断线后据此只补传缺失的部分
+        // - POST /upload/session/<id>/commit 全部收到后rename为最终文件并记录存储信息
+        //   失败时会话的临时文件仍在则回复500 可以再次提交 临时文件已被删除则移除会话 回复410 需要重新上传
+        // - DELETE /upload/session/<id> 放弃上传
+        // - 会话在所有工作线程间共享 分块可以通过多个连接并行上传
+        // - 每个分块的请求体整体缓存在内存中 libevent 2.1下不能超过upload_max_body_size
+        //
+        static void UploadSessionRoute(struct evhttp_request *req, const std::string &path) {
+            const std::string prefix = "/upload/session";
+            const std::string commit_suffix = "/commit";
+            enum evhttp_cmd_type cmd = evhttp_request_get_command(req);
+            if (path == prefix) {
+                if (cmd != EVHTTP_REQ_POST) {
+                    evhttp_send_reply(req, 405, "Method Not Allowed", NULL);
+                    return;
+                }
+                SessionCreate(req);
                 return;
             }
-            evhttp_send_reply(req, HTTP_OK, "Success", NULL);
+            std::string id = path.substr(prefix.size() + 1);
+            bool commit = false;
+            if (id.size() > commit_suffix.size() &&
+                id.compare(id.size() - commit_suffix.size(), commit_suffix.size(), commit_suffix) == 0) {
+                id.resize(id.size() - commit_suffix.size());
+                commit = true;
+            }
+            std::shared_ptr<UploadSession> session = upload_sessions_.Get(id);
+            if (session == nullptr) {
+                evhttp_send_reply(req, HTTP_NOTFOUND, "Not Found", NULL);
+                return;
+            }
+            if (commit && cmd == EVHTTP_REQ_POST) {
+                SessionCommit(req, session);
+            }
+            else if (commit == false && cmd == EVHTTP_REQ_PUT) {
+                SessionWrite(req, session);
+            }
+            else if (commit == false && cmd == EVHTTP_REQ_GET) {
+                std::unique_lock<std::mutex> lock(session->mutex_);
+                std::string status = SessionStatus(session.get());
+                lock.unlock();
+                SessionReply(req, status, HTTP_OK, "Success");
+            }
+            else if (commit == false && cmd == EVHTTP_REQ_DELETE) {
+                io_.Post([id]() { upload_sessions_.Remove(id, true); },
+                         [req]() { evhttp_send_reply(req, 204, "No Content", NULL); });
+            }
+            else {
+                evhttp_send_reply(req, 405, "Method Not Allowed", NULL);
+            }
+        }
+
+        //
+        // 会话状态 ranges为已收到的区间[start, end) 调用方持有会话的mutex_
+        //
+        static std::string SessionStatus(UploadSession *session) {
+            Json::Value root;
+            root["session"] = session->id_;
+            root["size"] = (Json::UInt64)session->size_;
+            root["received"] = (Json::UInt64)session->Received();
+            root["ranges"] = Json::Value(Json::arrayValue);
+            for (auto &r : session->received_) {
+                Json::Value range(Json::arrayValue);
+                range.append((Json::UInt64)r.first);
+                range.append((Json::UInt64)r.second);
+                root["ranges"].append(range);
+            }
+            std::string content;
+            JSON_util::Serialize(root, content, "");
+            return content;
+        }
+
+        static void SessionReply(struct evhttp_request *req, const std::string &status, int code, const char *reason) {
+            evbuffer_add(evhttp_request_get_output_buffer(req), status.data(), status.size());
+            evhttp_add_header(req->output_headers, "Content-Type", "application/json");
+            evhttp_send_reply(req, code, reason, NULL);
+        }
+
+        //
+        // 解析不超过18位的十进制数
+        //
+        static bool ParseNumber(const std::string &str, uint64_t *value) {
+            if (str.empty() || str.size() > 18 || str.find_first_not_of("0123456789") != std::string::npos) {
+                return false;
+            }
+            *value = std::stoull(str);
+            return true;
+        }
+
+        //
+        // 创建会话 在IO线程中创建并预分配临时文件
+        //
+        static void SessionCreate(struct evhttp_request *req) {
+            std::string storage_path;
+            const char *length = evhttp_find_header(req->input_headers, "Upload-Length");
+            uint64_t size = 0;
+            if (GetUploadPath(req, &storage_path) == false || length == NULL ||
+                ParseNumber(length, &size) == false || size == 0) {
+                evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
+                return;
+            }
+            auto session = std::make_shared<std::shared_ptr<UploadSession>>();
+            io_.Post([storage_path, size, session]() { *session = upload_sessions_.Create(storage_path, size); },
+                     [req, session]() {
+                if (*session == nullptr) {
+                    evhttp_send_reply(req, HTTP_INTERNAL, "Internal Error", NULL);
+                    return;
+                }
+                std::string location = "/upload/session/" + (*session)->id_;
+                evhttp_add_header(req->output_headers, "Location", location.c_str());
+                std::unique_lock<std::mutex> lock((*session)->mutex_);
+                std::string status = SessionStatus(session->get());
+                lock.unlock();
+                SessionReply(req, status, 201, "Created");
+            });
+        }
+
+        //
+        // 写入一个分块 请求体在IO线程中定位写入临时文件 写完后记录区间
+        //
+        static void SessionWrite(struct evhttp_request *req, std::shared_ptr<UploadSession> session) {
+            struct evbuffer *in = evhttp_request_get_input_buffer(req);
+            size_t len = evbuffer_get_length(in);
+            const char *header = evhttp_find_header(req->input_headers, "Content-Range");
+            std::string range = header == NULL ? "" : header;
+            const std::string unit = "bytes ";
+            size_t dash = range.find('-');
+            size_t slash = range.find('/');
+            uint64_t start = 0, last = 0, total = 0;
+            if (range.compare(0, unit.size(), unit) != 0 || dash == std::string::npos || slash == std::string::npos ||
+                dash > slash || ParseNumber(range.substr(unit.size(), dash - unit.size()), &start) == false ||
+                ParseNumber(range.substr(dash + 1, slash - dash - 1), &last) == false ||
+                (range.substr(slash + 1) != "*" && (ParseNumber(range.substr(slash + 1), &total) == false || total != session->size_)) ||
+                last < start || last >= session->size_ || len != last - start + 1) {
+                evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(session->mutex_);
+                if (session->closed_) {
+                    evhttp_send_reply(req, HTTP_NOTFOUND, "Not Found", NULL);
+                    return;
+                }
+                session->writing_++;
+                session->active_ = time(nullptr);
+            }
+            // 请求体移入独立的缓冲区 evbuffer_add_buffer只移动数据块 不拷贝数据
+            struct evbuffer *data = evbuffer_new();
+            evbuffer_add_buffer(data, in);
+            auto ok = std::make_shared<bool>(false);
+            io_.Post([session, data, start, ok]() {
+                uint64_t offset = start;
+                *ok = WriteBuffer(session->fd_, data, &offset);
+            }, [req, session, data, start, len, ok]() {
+                evbuffer_free(data);
+                std::unique_lock<std::mutex> lock(session->mutex_);
+                session->writing_--;
+                session->active_ = time(nullptr);
+                if (*ok == false) {
+                    lock.unlock();
+                    evhttp_send_reply(req, HTTP_INTERNAL, "Internal Error", NULL);
+                    return;
+                }
+                session->AddRange(start, start + len);
+                std::string status = SessionStatus(session.get());
+                lock.unlock();
+                SessionReply(req, status, HTTP_OK, "Success");
+            });
+        }
+
+        //
+        // 提交会话
+        // - 还有分块在写入或没有收到全部数据时返回409和当前状态
+        // - 分块去重时把临时文件分块存入分块存储 发布清单后删除临时文件
+        // - 提交时计算内容哈希 记录在存储信息中供秒传查找
+        // - 发布失败时会话保持打开 客户端可以重试提交
+        //
+        static void SessionCommit(struct evhttp_request *req, std::shared_ptr<UploadSession> session) {
+            {
+                std::unique_lock<std::mutex> lock(session->mutex_);
+                if (session->closed_) {
+                    lock.unlock();
+                    evhttp_send_reply(req, HTTP_NOTFOUND, "Not Found", NULL);
+                    return;
+                }
+                if (session->writing_ > 0 || session->Complete() == false) {
+                    std::string status = SessionStatus(session.get());
+                    lock.unlock();
+                    SessionReply(req, status, 409, "Conflict");
+                    return;
+                }
+                session->closed_ = true; // 之后到达的分块不再写入
+            }
+            auto code = std::make_shared<int>(HTTP_OK);
+            io_.Post([session, code]() {
+                bool ok;
+                bool dedup = Config::GetInstance()->GetChunkDedup();
+                if (dedup) {
+                    std::string manifest_path = session->tmp_path_ + ".manifest";
+                    ChunkWriter chunks(&chunk_store_);
+                    ok = chunks.Open(manifest_path) && chunks.AppendFile(session->fd_, session->size_) && chunks.Finish() &&
+                         PublishUpload(manifest_path, session->storage_path_, chunk_manifest_format, session->size_,
+                                       chunks.Digest());
+                }
+                else {
+                    std::string hash;
+                    ok = HashFile(session->fd_, session->size_, &hash);
+                    if (ok && PublishUpload(session->tmp_path_, session->storage_path_, -1, 0, hash) == false) {
+                        // 临时文件已被删除 会话不能再提交
+                        upload_sessions_.Remove(session->id_, false);
+                        *code = 410;
+                        return;
+                    }
+                }
+                if (ok == false) {
+                    std::lock_guard<std::mutex> lock(session->mutex_);
+                    session->closed_ = false;
+                    *code = HTTP_INTERNAL;
+                    return;
+                }
+                upload_sessions_.Remove(session->id_, dedup);
+            }, [req, code]() {
+                if (*code == HTTP_OK) {
+                    evhttp_send_reply(req, HTTP_OK, "Success", NULL);
+                }
+                else if (*code == 410) {
+                    evhttp_send_reply(req, 410, "Upload Lost", NULL);
+                }
+                else {
+                    evhttp_send_reply(req, HTTP_INTERNAL, "Internal Error", NULL);
+                }
+            });
         }
         
         //
         // 显示文件列表
+        // - ETag由启动时间、文件列表版本和模板版本组成 客户端缓存的页面仍然有效时回复304 不重新生成
+        //   模板不包含文件列表时(页面通过/api/files加载)不随文件列表变化
+        // - 在IO线程中渲染到新的evbuffer 回到事件循环线程后整体移入输出缓冲区 不拷贝数据
         //
         static void ListShow(struct evhttp_request *req, void *arg) {
-            // 读取文件管理器文件
-            std::vector<StorageInfo> arry;
-            data_.GetInfo(&arry);
-
-            // 读取模板文件
-            std::ifstream templateFile("index.html");
-            std::string templateContent(
-                (std::istreambuf_iterator<char>(templateFile)),
-                std::istreambuf_iterator<char>());
-            
-            // 替换模板中的占位符
-            templateContent = std::regex_replace(templateContent,
-                std::regex("\\{\\{FILE_LIST\\}\\}"),
-                generateModernFileList(arry));
-            // 替换模板中的占位符
-            templateContent = std::regex_replace(templateContent,
-                std::regex("\\{\\{BACKEND_URL\\}\\}"),
-                "http://"+storage::Config::GetInstance()->GetServerIp()+":"+std::to_string(storage::Config::GetInstance()->GetServerPort()));
-            
-            // 获取请求的输出evbuffer
-            struct evbuffer *buf = evhttp_request_get_output_buffer(req);
-            evbuffer_add(buf, (const void *)templateContent.c_str(), templateContent.size());
-            evhttp_add_header(req->output_headers, "Content-Type", "text/html;charset=utf-8");
-            evhttp_send_reply(req, HTTP_OK, NULL, NULL);
+            const char *header = evhttp_find_header(req->input_headers, "If-None-Match");
+            std::string if_none_match = header == NULL ? "" : header;
+            uint64_t version = list_template_.Uses(LIST_FILE_LIST) ? list_version_.load() : 0;
+            std::string etag = "\"list-" + std::to_string(start_time_) + "-" + std::to_string(version) + "-" +
+                               std::to_string(list_template_.Version()) + "\"";
+            AddValidators(req, etag, 0, "no-cache");
+            if (!if_none_match.empty() && MatchETag(if_none_match, etag, true)) {
+                evhttp_send_reply(req, 304, "Not Modified", NULL);
+                return;
+            }
+            struct evbuffer *page = evbuffer_new();
+            if (page == nullptr) {
+                evhttp_send_reply(req, HTTP_INTERNAL, NULL, NULL);
+                return;
+            }
+            io_.Post([page]() { RenderList(page); }, [req, page]() {
+                evbuffer_add_buffer(evhttp_request_get_output_buffer(req), page);
+                evbuffer_free(page);
+                evhttp_add_header(req->output_headers, "Content-Type", "text/html;charset=utf-8");
+                evhttp_send_reply(req, HTTP_OK, NULL, NULL);
+            });
+        }
+
+        static void RenderList(struct evbuffer *buf) {
+            static const std::string backend_url = "http://" + Config::GetInstance()->GetServerIp() + ":" +
+                                                   std::to_string(Config::GetInstance()->GetServerPort());
+            list_template_.Render(buf, [](struct evbuffer *out, int placeholder) {
+                if (placeholder == LIST_FILE_LIST) {
+                    AddFileList(out);
+                }
+                else {
+                    evbuffer_add(out, backend_url.data(), backend_url.size());
+                }
+            });
         }
     };
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace storage
+{
+    //
+    // SHA-256 (FIPS 180-4)
+    // - void Update(const void *data, size_t len) 追加数据
+    // - std::string Final() 返回32字节的摘要 之后不能再Update
+    // - static std::string Digest(const void *data, size_t len) 一次计算整段数据的摘要
+    // - static std::string Hex(const std::string &digest) 摘要转为小写十六进制
+    // - static bool FromHex(const std::string &hex, std::string *digest) 64位十六进制转为摘要 格式不正确返回false
+    //
+    class Sha256
+    {
+    private:
+        uint32_t state_[8];
+        uint8_t block_[64];
+        size_t block_len_ = 0;
+        uint64_t total_ = 0;
+    public:
+        Sha256() {
+            static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+            memcpy(state_, init, sizeof(state_));
+        }
+
+        void Update(const void *data, size_t len) {
+            const uint8_t *p = (const uint8_t *)data;
+            total_ += len;
+            if (block_len_ > 0) {
+                size_t n = std::min(len, sizeof(block_) - block_len_);
+                memcpy(block_ + block_len_, p, n);
+                block_len_ += n;
+                p += n;
+                len -= n;
+                if (block_len_ < sizeof(block_)) {
+                    return;
+                }
+                Transform(block_);
+                block_len_ = 0;
+            }
+            for (; len >= 64; p += 64, len -= 64) {
+                Transform(p);
+            }
+            memcpy(block_, p, len);
+            block_len_ = len;
+        }
+
+        std::string Final() {
+            uint64_t bits = total_ * 8;
+            uint8_t pad[72] = {0x80};
+            size_t pad_len = (block_len_ < 56 ? 56 : 120) - block_len_;
+            for (int i = 0; i < 8; i++) {
+                pad[pad_len + i] = (uint8_t)(bits >> (56 - 8 * i));
+            }
+            Update(pad, pad_len + 8);
+            std::string digest(32, '\0');
+            for (int i = 0; i < 8; i++) {
+                for (int j = 0; j < 4; j++) {
+                    digest[i * 4 + j] = (char)(state_[i] >> (24 - 8 * j));
+                }
+            }
+            return digest;
+        }
+
+        static std::string Digest(const void *data, size_t len) {
+            Sha256 sha;
+            sha.Update(data, len);
+            return sha.Final();
+        }
+
+        static std::string Hex(const std::string &digest) {
+            static const char digits[] = "0123456789abcdef";
+            std::string hex(digest.size() * 2, '0');
+            for (size_t i = 0; i < digest.size(); i++) {
+                hex[i * 2] = digits[(uint8_t)digest[i] >> 4];
+                hex[i * 2 + 1] = digits[(uint8_t)digest[i] & 0xf];
+            }
+            return hex;
+        }
+
+        static bool FromHex(const std::string &hex, std::string *digest) {
+            if (hex.size() != 64) {
+                return false;
+            }
+            std::string out(32, '\0');
+            for (size_t i = 0; i < hex.size(); i++) {
+                char c = hex[i];
+                int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+                if (v < 0) {
+                    return false;
+                }
+                out[i / 2] = (char)((uint8_t)out[i / 2] << 4 | v);
+            }
+            *digest = std::move(out);
+            return true;
+        }
+
+    private:
+        static uint32_t Rotr(uint32_t x, int n) {
+            return (x >> n) | (x << (32 - n));
+        }
+
+        void Transform(const uint8_t *block) {
+            static const uint32_t k[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+            uint32_t w[64];
+            for (int i = 0; i < 16; i++) {
+                w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+                       (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+            }
+            for (int i = 16; i < 64; i++) {
+                uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+            uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+            uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+            for (int i = 0; i < 64; i++) {
+                uint32_t s1 = Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25);
+                uint32_t ch = (e & f) ^ (~e & g);
+                uint32_t t1 = h + s1 + ch + k[i] + w[i];
+                uint32_t s0 = Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22);
+                uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+                uint32_t t2 = s0 + maj;
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+            state_[0] += a;
+            state_[1] += b;
+            state_[2] += c;
+            state_[3] += d;
+            state_[4] += e;
+            state_[5] += f;
+            state_[6] += g;
+            state_[7] += h;
+        }
+    };
+}
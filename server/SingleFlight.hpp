@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace storage
+{
+    //
+    // 相同key的并发任务合并为一次执行
+    // - bool Join(const std::string &key, Callback callback) 加入key对应的执行
+    //   返回true表示当前没有同key的执行 调用方负责执行并在完成后调用Finish
+    //   返回false表示已经有执行在进行 结果产生后回调callback 调用方不需要等待
+    // - void Finish(const std::string &key, const T &result) 以结果回调所有加入的调用方 回调在调用Finish的线程中执行
+    // - Executions()/Coalesced() 实际执行的次数和被合并的次数
+    //
+    template <typename T>
+    class SingleFlight
+    {
+    public:
+        typedef std::function<void(const T &)> Callback;
+    private:
+        std::mutex mutex_;
+        std::unordered_map<std::string, std::vector<Callback>> waiting_;
+        std::atomic<uint64_t> executions_{0};
+        std::atomic<uint64_t> coalesced_{0};
+    public:
+        bool Join(const std::string &key, Callback callback) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = waiting_.find(key);
+            if (it != waiting_.end()) {
+                it->second.push_back(std::move(callback));
+                coalesced_++;
+                return false;
+            }
+            waiting_[key].push_back(std::move(callback));
+            executions_++;
+            return true;
+        }
+
+        void Finish(const std::string &key, const T &result) {
+            std::vector<Callback> callbacks;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = waiting_.find(key);
+                if (it == waiting_.end()) {
+                    return;
+                }
+                callbacks.swap(it->second);
+                waiting_.erase(it);
+            }
+            for (auto &callback : callbacks) {
+                callback(result);
+            }
+        }
+
+        uint64_t Executions() const {
+            return executions_;
+        }
+
+        uint64_t Coalesced() const {
+            return coalesced_;
+        }
+    };
+}
@@ -0,0 +1,377 @@
+#pragma once
+#include "Config.hpp"
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace storage
+{
+    //
+    // 一次定位读写请求
+    //
+    struct IoRequest
+    {
+        int fd_ = -1;
+        void *buf_ = nullptr;
+        size_t len_ = 0;
+        uint64_t offset_ = 0;
+        bool write_ = false;
+        int buf_index_ = -1; // 注册缓冲区的编号 -1表示普通内存
+        ssize_t result_ = 0; // 完成后为读写的字节数 失败为-errno
+    };
+
+    //
+    // 存储IO后端
+    // 每个线程使用自己的后端实例 实例不是线程安全的
+    // - void Submit(IoRequest *requests, size_t n) 批量提交读写请求并等待全部完成 可能短读写
+    // - int AcquireBuffer(size_t size, char **data) 取一块注册缓冲区 没有时返回-1
+    // - bool ReadAt/WriteAt(...) 完整读写len字节 处理短读写
+    // - static void InitThread() 为当前线程按storage_io配置创建后端 只在IO线程启动时调用
+    //   io_uring的环形队列和注册缓冲区每个线程一份 不为事件循环和计算线程创建
+    // - static StorageIo *Local() 当前线程的后端 没有调用InitThread或io_uring不可用时使用共享的posix实现
+    //
+    class StorageIo
+    {
+    public:
+        virtual ~StorageIo() {}
+        virtual const char *Name() const = 0;
+        virtual void Submit(IoRequest *requests, size_t n) = 0;
+
+        virtual int AcquireBuffer(size_t, char **) {
+            return -1;
+        }
+        virtual void ReleaseBuffer(int) {}
+
+        bool ReadAt(int fd, void *buf, size_t len, uint64_t offset, int buf_index = -1) {
+            return Complete(fd, (char *)buf, len, offset, false, buf_index);
+        }
+
+        bool WriteAt(int fd, const void *buf, size_t len, uint64_t offset, int buf_index = -1) {
+            return Complete(fd, (char *)buf, len, offset, true, buf_index);
+        }
+
+        static std::unique_ptr<StorageIo> Create(const std::string &name, size_t buffers, size_t buffer_size);
+        static void InitThread();
+        static StorageIo *Local();
+
+    private:
+        inline static thread_local std::unique_ptr<StorageIo> local_;
+
+        bool Complete(int fd, char *buf, size_t len, uint64_t offset, bool write, int buf_index) {
+            while (len > 0) {
+                IoRequest request;
+                request.fd_ = fd;
+                request.buf_ = buf;
+                request.len_ = len;
+                request.offset_ = offset;
+                request.write_ = write;
+                request.buf_index_ = buf_index;
+                Submit(&request, 1);
+                if (request.result_ == -EINTR || request.result_ == -EAGAIN) {
+                    continue;
+                }
+                if (request.result_ <= 0) {
+                    return false; // 出错或读到文件末尾
+                }
+                buf += request.result_;
+                len -= request.result_;
+                offset += request.result_;
+            }
+            return true;
+        }
+    };
+
+    //
+    // pread/pwrite实现 逐个同步执行
+    // - 没有状态 可以被多个线程共用
+    //
+    class PosixIo : public StorageIo
+    {
+    public:
+        const char *Name() const override {
+            return "posix";
+        }
+
+        void Submit(IoRequest *requests, size_t n) override {
+            for (size_t i = 0; i < n; i++) {
+                IoRequest &r = requests[i];
+                ssize_t ret;
+                do {
+                    ret = r.write_ ? pwrite(r.fd_, r.buf_, r.len_, r.offset_) : pread(r.fd_, r.buf_, r.len_, r.offset_);
+                } while (ret == -1 && errno == EINTR);
+                r.result_ = ret == -1 ? -errno : ret;
+            }
+        }
+    };
+
+    //
+    // io_uring实现 直接使用系统调用 不依赖liburing
+    // - 一批请求写入提交队列后只调用一次io_uring_enter
+    // - 创建时注册若干块缓冲区 使用注册缓冲区的请求以READ_FIXED/WRITE_FIXED提交 内核不必每次固定页面
+    // - 不注册文件 每批更新文件槽位要多一次系统调用 抵消了节省的fget 而fd号关闭后会被复用 不能长期缓存在槽位中
+    // - io_uring_enter持续失败时放弃未提交的请求 已提交的请求等不到完成时把环形队列标记为不可用 之后改用pread/pwrite
+    //
+    class UringIo : public StorageIo
+    {
+    private:
+        int ring_fd_ = -1;
+        unsigned entries_ = 0;
+        void *sq_ptr_ = MAP_FAILED;
+        size_t sq_size_ = 0;
+        void *cq_ptr_ = MAP_FAILED;
+        size_t cq_size_ = 0;
+        struct io_uring_sqe *sqes_ = (struct io_uring_sqe *)MAP_FAILED;
+        size_t sqes_size_ = 0;
+        unsigned *sq_tail_ = nullptr;
+        unsigned *sq_mask_ = nullptr;
+        unsigned *sq_array_ = nullptr;
+        unsigned *cq_head_ = nullptr;
+        unsigned *cq_tail_ = nullptr;
+        unsigned *cq_mask_ = nullptr;
+        struct io_uring_cqe *cqes_ = nullptr;
+        bool broken_ = false; // 有请求的完成状态未知 环形队列不能再使用
+        PosixIo posix_;
+        std::vector<bool> done_; // 本批请求是否已完成
+        std::vector<char *> buffers_;
+        std::vector<bool> buffer_used_;
+        size_t buffer_size_ = 0;
+    public:
+        UringIo(unsigned entries, size_t buffers, size_t buffer_size) {
+            struct io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            int fd = syscall(__NR_io_uring_setup, entries, &p);
+            if (fd < 0) {
+                return;
+            }
+            ring_fd_ = fd;
+            entries_ = p.sq_entries;
+            sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+            bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap) {
+                sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+            }
+            sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if (sq_ptr_ == MAP_FAILED) {
+                Close();
+                return;
+            }
+            cq_ptr_ = single_mmap ? sq_ptr_ :
+                mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr_ == MAP_FAILED) {
+                Close();
+                return;
+            }
+            sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+            sqes_ = (struct io_uring_sqe *)mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (sqes_ == MAP_FAILED) {
+                Close();
+                return;
+            }
+            char *sq = (char *)sq_ptr_, *cq = (char *)cq_ptr_;
+            sq_tail_ = (unsigned *)(sq + p.sq_off.tail);
+            sq_mask_ = (unsigned *)(sq + p.sq_off.ring_mask);
+            sq_array_ = (unsigned *)(sq + p.sq_off.array);
+            cq_head_ = (unsigned *)(cq + p.cq_off.head);
+            cq_tail_ = (unsigned *)(cq + p.cq_off.tail);
+            cq_mask_ = (unsigned *)(cq + p.cq_off.ring_mask);
+            cqes_ = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+            RegisterBuffers(buffers, buffer_size);
+        }
+        ~UringIo() {
+            Close();
+        }
+
+        bool Ok() const {
+            return ring_fd_ != -1;
+        }
+
+        const char *Name() const override {
+            return "io_uring";
+        }
+
+        void Submit(IoRequest *requests, size_t n) override {
+            if (broken_) {
+                posix_.Submit(requests, n);
+                return;
+            }
+            while (n > 0) {
+                size_t batch = std::min<size_t>(n, entries_);
+                SubmitBatch(requests, batch);
+                requests += batch;
+                n -= batch;
+            }
+        }
+
+        int AcquireBuffer(size_t size, char **data) override {
+            if (size > buffer_size_) {
+                return -1;
+            }
+            for (size_t i = 0; i < buffers_.size(); i++) {
+                if (buffer_used_[i] == false) {
+                    buffer_used_[i] = true;
+                    *data = buffers_[i];
+                    return i;
+                }
+            }
+            return -1;
+        }
+
+        void ReleaseBuffer(int index) override {
+            if (index >= 0 && (size_t)index < buffer_used_.size()) {
+                buffer_used_[index] = false;
+            }
+        }
+
+    private:
+        //
+        // 注册缓冲区 超出RLIMIT_MEMLOCK等原因失败时不使用注册缓冲区
+        //
+        void RegisterBuffers(size_t count, size_t size) {
+            buffer_size_ = size;
+            std::vector<struct iovec> iovs;
+            for (size_t i = 0; i < count; i++) {
+                void *buf = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (buf == MAP_FAILED) {
+                    break;
+                }
+                buffers_.push_back((char *)buf);
+                iovs.push_back({buf, size});
+            }
+            if (iovs.empty() ||
+                syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, iovs.data(), iovs.size()) != 0) {
+                FreeBuffers();
+                return;
+            }
+            buffer_used_.assign(buffers_.size(), false);
+        }
+
+        void FreeBuffers() {
+            for (char *buf : buffers_) {
+                munmap(buf, buffer_size_);
+            }
+            buffers_.clear();
+            buffer_used_.clear();
+            buffer_size_ = 0;
+        }
+
+        void SubmitBatch(IoRequest *requests, size_t n) {
+            unsigned tail = *sq_tail_; // 只有本线程写sq_tail_
+            for (size_t i = 0; i < n; i++) {
+                IoRequest &r = requests[i];
+                unsigned index = tail & *sq_mask_;
+                struct io_uring_sqe *sqe = &sqes_[index];
+                memset(sqe, 0, sizeof(*sqe));
+                bool registered = r.buf_index_ >= 0;
+                if (r.write_) {
+                    sqe->opcode = registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+                }
+                else {
+                    sqe->opcode = registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+                }
+                sqe->fd = r.fd_;
+                sqe->addr = (uint64_t)(uintptr_t)r.buf_;
+                sqe->len = std::min<size_t>(r.len_, 1u << 30); // 超过的部分由调用方按短读写处理
+                sqe->off = r.offset_;
+                sqe->buf_index = registered ? r.buf_index_ : 0;
+                sqe->user_data = i;
+                sq_array_[index] = index;
+                tail++;
+            }
+            __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+            const int max_retries = 100;
+            done_.assign(n, false);
+            size_t submitted = 0, completed = 0, total = n;
+            int retries = 0;
+            while (completed < total) {
+                int ret = syscall(__NR_io_uring_enter, ring_fd_, total - submitted, total - completed,
+                                  IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (ret < 0) {
+                    int err = errno;
+                    if (err == EINTR || ((err == EAGAIN || err == EBUSY) && ++retries < max_retries)) {
+                        continue;
+                    }
+                    if (submitted < total) {
+                        // 内核按顺序取走请求 收回还没提交的部分 只等待已提交的完成
+                        __atomic_store_n(sq_tail_, tail - (unsigned)(total - submitted), __ATOMIC_RELEASE);
+                        for (size_t i = submitted; i < total; i++) {
+                            requests[i].result_ = -err;
+                            done_[i] = true;
+                        }
+                        tail -= total - submitted;
+                        total = submitted;
+                        retries = 0;
+                        continue;
+                    }
+                    // 已提交的请求等不到完成 之后的完成事件无法对应请求 不再使用环形队列
+                    broken_ = true;
+                    for (size_t i = 0; i < n; i++) {
+                        if (done_[i] == false) {
+                            requests[i].result_ = -EIO;
+                        }
+                    }
+                    return;
+                }
+                retries = 0;
+                submitted += ret;
+                unsigned head = *cq_head_;
+                unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+                while (head != cq_tail) {
+                    struct io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+                    if (cqe->user_data < n && done_[cqe->user_data] == false) {
+                        requests[cqe->user_data].result_ = cqe->res;
+                        done_[cqe->user_data] = true;
+                        completed++;
+                    }
+                    head++;
+                }
+                __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            }
+        }
+
+        void Close() {
+            if (sqes_ != MAP_FAILED) {
+                munmap(sqes_, sqes_size_);
+            }
+            if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+                munmap(cq_ptr_, cq_size_);
+            }
+            if (sq_ptr_ != MAP_FAILED) {
+                munmap(sq_ptr_, sq_size_);
+            }
+            sqes_ = (struct io_uring_sqe *)MAP_FAILED;
+            cq_ptr_ = sq_ptr_ = MAP_FAILED;
+            if (ring_fd_ != -1) {
+                close(ring_fd_);
+                ring_fd_ = -1;
+            }
+            FreeBuffers();
+        }
+    };
+
+    inline std::unique_ptr<StorageIo> StorageIo::Create(const std::string &name, size_t buffers, size_t buffer_size) {
+        if (name == "io_uring") {
+            std::unique_ptr<UringIo> uring(new UringIo(64, buffers, buffer_size));
+            if (uring->Ok()) {
+                return uring;
+            }
+        }
+        return std::unique_ptr<StorageIo>(new PosixIo());
+    }
+
+    inline void StorageIo::InitThread() {
+        local_ = Create(Config::GetInstance()->GetStorageIo(), Config::GetInstance()->GetIoUringBuffers(),
+                        Config::GetInstance()->GetDeepBlockSize());
+    }
+
+    inline StorageIo *StorageIo::Local() {
+        static PosixIo posix;
+        return local_ ? local_.get() : &posix;
+    }
+}
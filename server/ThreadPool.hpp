@@ -0,0 +1,117 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace storage
+{
+    //
+    // 固定大小的线程池
+    // - ThreadPool(size_t threads, std::function<void()> on_start) on_start在每个工作线程启动时调用一次
+    // - void Submit(std::function<void()> task) 提交任务
+    // - std::future<R> Async(F func) 提交任务并返回其结果的future
+    // - size_t Size() 工作线程数
+    // - size_t Pending() 排队中和执行中的任务数
+    // - void Stop() 丢弃排队中的任务 等待执行中的任务结束
+    //
+    class ThreadPool
+    {
+    private:
+        std::vector<std::thread> workers_;
+        std::deque<std::function<void()>> tasks_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        size_t size_ = 0;
+        size_t running_ = 0;
+        bool stop_ = false;
+    public:
+        explicit ThreadPool(size_t threads, std::function<void()> on_start = nullptr) {
+            if (threads == 0) {
+                threads = 1;
+            }
+            size_ = threads;
+            for (size_t i = 0; i < threads; i++) {
+                workers_.emplace_back([this, on_start]() {
+                    if (on_start) {
+                        on_start();
+                    }
+                    Run();
+                });
+            }
+        }
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+        ~ThreadPool() {
+            Stop();
+        }
+
+        void Submit(std::function<void()> task) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stop_) {
+                    return;
+                }
+                tasks_.push_back(std::move(task));
+            }
+            cond_.notify_one();
+        }
+
+        template <typename F>
+        auto Async(F func) -> std::future<decltype(func())> {
+            typedef decltype(func()) R;
+            auto task = std::make_shared<std::packaged_task<R()>>(std::move(func));
+            std::future<R> future = task->get_future();
+            Submit([task]() { (*task)(); });
+            return future;
+        }
+
+        size_t Size() const {
+            return size_;
+        }
+
+        size_t Pending() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return tasks_.size() + running_;
+        }
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stop_) {
+                    return;
+                }
+                stop_ = true;
+                tasks_.clear();
+            }
+            cond_.notify_all();
+            for (auto &worker : workers_) {
+                if (worker.joinable()) {
+                    worker.join();
+                }
+            }
+        }
+
+    private:
+        void Run() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                cond_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+                if (stop_) {
+                    return;
+                }
+                std::function<void()> task = std::move(tasks_.front());
+                tasks_.pop_front();
+                running_++;
+                lock.unlock();
+                task();
+                lock.lock();
+                running_--;
+            }
+        }
+    };
+}
@@ -0,0 +1,274 @@
+#pragma once
+#include "DataManager.hpp"
+#include "ThreadPool.hpp"
+#include "BlockContainer.hpp"
+#include "CodecPlanner.hpp"
+#include <chrono>
+#include <unordered_set>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+namespace storage
+{
+    //
+    // 速率限制器
+    // 按速率给每次请求排定时间 请求的字节数超过剩余额度时睡眠到轮到自己为止
+    // - void Acquire(uint64_t bytes) 申请bytes字节的额度
+    //
+    class RateLimiter
+    {
+    private:
+        uint64_t rate_; // 字节/秒 0表示不限速
+        std::mutex mutex_;
+        std::chrono::steady_clock::time_point next_; // 下一个请求可以开始的时间
+    public:
+        explicit RateLimiter(uint64_t rate) : rate_(rate), next_(std::chrono::steady_clock::now()) {}
+
+        void Acquire(uint64_t bytes) {
+            if (rate_ == 0) {
+                return;
+            }
+            std::chrono::steady_clock::time_point start;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto now = std::chrono::steady_clock::now();
+                if (next_ < now - std::chrono::seconds(1)) {
+                    next_ = now - std::chrono::seconds(1); // 空闲时最多积攒1秒的额度
+                }
+                start = next_;
+                next_ += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>((double)bytes / rate_));
+            }
+            std::this_thread::sleep_until(start);
+        }
+    };
+
+    //
+    // 冷热分层服务
+    // 后台线程定期扫描DataManager 把普通存储中超过tiering_idle_seconds未访问的文件
+    // 在线程池中压缩到深度存储 然后原子地替换存储信息中的storage_path_并删除原文件
+    // - 工作线程以最低的CPU和IO优先级运行 读写磁盘受tiering_rate_limit限速 不影响事件循环
+    // - 单个文件的各块在codec_pool_中并行压缩 大文件的归档速度随核数增加
+    // - void Start() 启动扫描线程
+    // - void Stop() 停止扫描并等待压缩任务结束
+    // - void Scan() 扫描一次 提交需要压缩的文件
+    //
+    class TieringService
+    {
+    private:
+        DataManager *data_;
+        int64_t idle_seconds_;
+        int scan_interval_;
+        size_t max_pending_; // 排队的压缩任务上限 其余的留到下次扫描
+        RateLimiter limiter_;
+        CodecPlanner planner_;
+        ThreadPool codec_pool_; // 并行压缩单个文件的各块
+        ThreadPool pool_;
+        std::thread scanner_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::unordered_set<std::string> running_; // 已提交的url 防止重复压缩
+        bool stop_ = false;
+    public:
+        static constexpr const char *tiered_dir = ".tiered";
+
+        explicit TieringService(DataManager *data)
+            : data_(data),
+              idle_seconds_(Config::GetInstance()->GetTieringIdleSeconds()),
+              scan_interval_(Config::GetInstance()->GetTieringScanInterval()),
+              max_pending_(1024),
+              limiter_(Config::GetInstance()->GetTieringRateLimit()),
+              planner_(Config::GetInstance()->GetCompressPolicy(), Config::GetInstance()->GetBundleFormat(),
+                       Config::GetInstance()->GetCompressMinRatio()),
+              codec_pool_(Config::GetInstance()->GetCompressThreads(), LowerPriority),
+              pool_(Config::GetInstance()->GetTieringThreads(), LowerPriority) {}
+        ~TieringService() {
+            Stop();
+        }
+
+        void Start() {
+            if (idle_seconds_ <= 0) {
+                return; // 未开启分层
+            }
+            scanner_ = std::thread([this]() {
+                std::unique_lock<std::mutex> lock(mutex_);
+                while (!stop_) {
+                    lock.unlock();
+                    Scan();
+                    lock.lock();
+                    cond_.wait_for(lock, std::chrono::seconds(scan_interval_), [this]() { return stop_; });
+                }
+            });
+        }
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cond_.notify_all();
+            if (scanner_.joinable()) {
+                scanner_.join();
+            }
+            pool_.Stop();
+        }
+
+        //
+        // 扫描一次 提交需要压缩的文件
+        // - 只处理普通存储中未压缩的文件
+        // - 分块去重的清单(chunk_dedup)和段文件中的小文件pack_format_不小于0 不参与分层
+        //   它们的内容在分块存储或段文件中 与其他文件共用 不能按单个文件归档
+        //
+        void Scan() {
+            time_t now = time(nullptr);
+            std::string low_dir = Config::GetInstance()->GetLowStorageDir();
+            std::vector<StorageInfo> candidates;
+            size_t budget = max_pending_ > pool_.Pending() ? max_pending_ - pool_.Pending() : 0;
+            data_->ForEach([&](const StorageInfo &info) {
+                if (candidates.size() >= budget) {
+                    return;
+                }
+                if (info.pack_format_ < 0 &&
+                    info.storage_path_.compare(0, low_dir.size(), low_dir) == 0 &&
+                    now - info.atime_ >= idle_seconds_) {
+                    candidates.push_back(info);
+                }
+            });
+            for (auto &info : candidates) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (stop_ || running_.insert(info.url_).second == false) {
+                        continue;
+                    }
+                }
+                pool_.Submit([this, info]() {
+                    Archive(info);
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    running_.erase(info.url_);
+                });
+            }
+        }
+
+        //
+        // 归档文件所在的目录 位于深度存储下 上传的文件名不能以tiered_dir开头
+        //
+        static std::string TieredDir() {
+            return Config::GetInstance()->GetDeepStorageDir() + tiered_dir + "/";
+        }
+
+        //
+        // 把当前线程的CPU和IO优先级降到最低 也用于其他后台任务
+        //
+        static void LowerPriority() {
+            pid_t tid = syscall(SYS_gettid);
+            setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SYS_ioprio_set
+            const int ioprio_class_idle = 3, ioprio_class_shift = 13, ioprio_who_process = 1;
+            syscall(SYS_ioprio_set, ioprio_who_process, tid, ioprio_class_idle << ioprio_class_shift);
+#endif
+        }
+
+    private:
+        bool Stopping() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return stop_;
+        }
+
+        //
+        // 把文件逐块读出 在codec_pool_中并行压缩为块容器tmp_path
+        // - 失败或服务停止时删除tmp_path
+        //
+        bool WriteContainer(const StorageInfo &info, int format, const std::string &tmp_path) {
+            uint32_t block_size = Config::GetInstance()->GetDeepBlockSize();
+            int fd = open(info.storage_path_.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                return false;
+            }
+            BlockWriter writer;
+            if (writer.Open(tmp_path, format, block_size, &codec_pool_) == false) {
+                close(fd);
+                return false;
+            }
+            std::string block;
+            bool ok = true;
+            while (ok && Stopping() == false) {
+                limiter_.Acquire(block_size); // 读
+                block.resize(block_size);
+                size_t len = 0;
+                while (len < block_size) {
+                    ssize_t n = read(fd, &block[len], block_size - len);
+                    if (n == -1 && errno == EINTR) {
+                        continue;
+                    }
+                    if (n <= 0) {
+                        ok = (n == 0);
+                        break;
+                    }
+                    len += n;
+                }
+                if (ok == false || len == 0) {
+                    break;
+                }
+                block.resize(len);
+                limiter_.Acquire(len); // 写 按原大小估计
+                ok = writer.Append(std::move(block));
+                if (len < block_size) {
+                    break;
+                }
+            }
+            close(fd);
+            return ok && Stopping() == false && writer.Finish(); // 失败时writer析构删除临时文件
+        }
+
+        //
+        // 压缩一个文件到深度存储
+        // - 由planner_按样本为文件选择压缩格式 记录在存储信息的pack_format_中
+        // - 按deep_block_size逐块读取 在codec_pool_中并行压缩为块容器 内存占用与文件大小无关
+        // - 服务停止时放弃未完成的归档
+        // - 归档文件写在深度存储下的tiered_dir目录中 上传不能使用该目录 与上传的文件不会重名
+        // - 先用mkstemp占用唯一的临时文件名 写完后link到加了后缀的最终路径 目标已存在时放弃 不覆盖任何文件
+        // - 存储信息替换成功后删除原文件 失败则删除压缩文件
+        // - 多级路径的文件在tiered_dir下保持相同的子目录
+        //
+        void Archive(const StorageInfo &info) {
+            int format = planner_.Choose(info.storage_path_);
+            std::string name = info.storage_path_.substr(Config::GetInstance()->GetLowStorageDir().size());
+            std::string tmp_path = TieredDir() + name + ".XXXXXX";
+            if (FileUtil(tmp_path).CreateParentDirectory() == false) {
+                return;
+            }
+            int fd = mkstemp(&tmp_path[0]);
+            if (fd == -1) {
+                return;
+            }
+            close(fd);
+            std::string deep_path;
+            bool ok = false;
+            if (format < 0) {
+                // 不值得压缩的文件直接硬链接到深度存储 不在同一文件系统时写成不压缩的块容器
+                deep_path = tmp_path + ".raw";
+                ok = link(info.storage_path_.c_str(), deep_path.c_str()) == 0;
+                if (ok == false) {
+                    format = bundle::RAW;
+                }
+            }
+            if (format >= 0) {
+                deep_path = tmp_path + ".bundle";
+                ok = WriteContainer(info, format, tmp_path) && link(tmp_path.c_str(), deep_path.c_str()) == 0;
+            }
+            unlink(tmp_path.c_str());
+            if (ok == false) {
+                return;
+            }
+            StorageInfo new_info = info;
+            new_info.storage_path_ = deep_path;
+            new_info.pack_format_ = format;
+            if (data_->Replace(info, new_info)) {
+                unlink(info.storage_path_.c_str());
+            }
+            else {
+                unlink(deep_path.c_str()); // 压缩期间文件被重新上传或删除
+            }
+        }
+    };
+}
@@ -0,0 +1,208 @@
+#pragma once
+#include "Config.hpp"
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <map>
+#include <random>
+#include <unordered_map>
+
+namespace storage
+{
+    //
+    // 可续传的分块上传会话
+    // - 创建时在目标存储目录下预分配完整大小的临时文件
+    // - 各个分块按偏移定位写入 可以通过多个连接并行上传
+    // - received_记录已写入的区间 相邻或重叠的区间合并
+    //
+    struct UploadSession
+    {
+        std::string id_;
+        std::string storage_path_; // 提交后的存储路径
+        std::string tmp_path_;
+        int fd_ = -1;
+        uint64_t size_ = 0;
+        std::mutex mutex_;
+        std::map<uint64_t, uint64_t> received_; // 起始偏移 -> 结束偏移(不含)
+        int writing_ = 0;                       // 正在写入的分块数
+        bool closed_ = false;                   // 已提交或已取消 不再接受分块
+        time_t active_ = 0;                     // 最近一次活动的时间
+
+        ~UploadSession() {
+            if (fd_ != -1) {
+                close(fd_); // 最后一个引用释放后才关闭 写入中的分块不会写到复用的fd上
+            }
+        }
+
+        //
+        // 记录已写入的区间[start, end) 调用方持有mutex_
+        //
+        void AddRange(uint64_t start, uint64_t end) {
+            auto it = received_.upper_bound(start);
+            if (it != received_.begin()) {
+                auto prev = std::prev(it);
+                if (prev->second >= start) {
+                    start = prev->first;
+                    end = std::max(end, prev->second);
+                    it = received_.erase(prev);
+                }
+            }
+            while (it != received_.end() && it->first <= end) {
+                end = std::max(end, it->second);
+                it = received_.erase(it);
+            }
+            received_[start] = end;
+        }
+
+        //
+        // 是否已经收到全部数据 调用方持有mutex_
+        //
+        bool Complete() const {
+            return received_.size() == 1 && received_.begin()->first == 0 && received_.begin()->second == size_;
+        }
+
+        uint64_t Received() const {
+            uint64_t total = 0;
+            for (auto &r : received_) {
+                total += r.second - r.first;
+            }
+            return total;
+        }
+    };
+
+    //
+    // 上传会话管理
+    // - std::shared_ptr<UploadSession> Create(const std::string &storage_path, uint64_t size) 创建会话并预分配临时文件
+    // - std::shared_ptr<UploadSession> Get(const std::string &id) 按id查找会话
+    // - void Remove(const std::string &id, bool discard) 移除会话 discard为true时删除临时文件
+    // - 超过upload_session_timeout没有活动的会话在创建新会话时清理
+    // - 会话只保存在内存中 启动时删除上次遗留的临时文件
+    //
+    class UploadSessionManager
+    {
+    private:
+        std::mutex mutex_;
+        std::unordered_map<std::string, std::shared_ptr<UploadSession>> sessions_;
+        int64_t timeout_;
+        const std::string tmp_prefix = ".upload-session-";
+        static const size_t id_len = 32;
+    public:
+        UploadSessionManager() : timeout_(Config::GetInstance()->GetUploadSessionTimeout()) {
+            RemoveStale(Config::GetInstance()->GetLowStorageDir());
+            RemoveStale(Config::GetInstance()->GetDeepStorageDir());
+        }
+
+        //
+        // 创建会话
+        // - 返回nullptr表示临时文件创建或预分配失败
+        //
+        std::shared_ptr<UploadSession> Create(const std::string &storage_path, uint64_t size) {
+            Expire();
+            auto session = std::make_shared<UploadSession>();
+            session->id_ = MakeId();
+            session->storage_path_ = storage_path;
+            size_t slash = storage_path.find_last_of('/');
+            std::string dir = slash == std::string::npos ? "" : storage_path.substr(0, slash + 1);
+            session->tmp_path_ = dir + tmp_prefix + session->id_;
+            session->size_ = size;
+            session->active_ = time(nullptr);
+            if (FileUtil(session->tmp_path_).CreateParentDirectory() == false) {
+                return nullptr;
+            }
+            session->fd_ = open(session->tmp_path_.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (session->fd_ == -1) {
+                return nullptr;
+            }
+            // 预分配空间 磁盘空间不足时在创建时就失败 不支持fallocate的文件系统退化为ftruncate
+            int ret = posix_fallocate(session->fd_, 0, size);
+            if (ret == EOPNOTSUPP || ret == EINVAL) {
+                ret = ftruncate(session->fd_, size) == 0 ? 0 : errno;
+            }
+            if (ret != 0) {
+                unlink(session->tmp_path_.c_str());
+                return nullptr;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            sessions_[session->id_] = session;
+            return session;
+        }
+
+        std::shared_ptr<UploadSession> Get(const std::string &id) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = sessions_.find(id);
+            if (it == sessions_.end()) {
+                return nullptr;
+            }
+            return it->second;
+        }
+
+        void Remove(const std::string &id, bool discard) {
+            std::shared_ptr<UploadSession> session;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = sessions_.find(id);
+                if (it == sessions_.end()) {
+                    return;
+                }
+                session = it->second;
+                sessions_.erase(it);
+            }
+            std::lock_guard<std::mutex> lock(session->mutex_);
+            session->closed_ = true;
+            if (discard) {
+                unlink(session->tmp_path_.c_str());
+            }
+        }
+
+    private:
+        //
+        // 清理超时的会话
+        //
+        void Expire() {
+            time_t now = time(nullptr);
+            std::vector<std::string> expired;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto &it : sessions_) {
+                    std::lock_guard<std::mutex> session_lock(it.second->mutex_);
+                    if (it.second->writing_ == 0 && now - it.second->active_ > timeout_) {
+                        expired.push_back(it.first);
+                    }
+                }
+            }
+            for (auto &id : expired) {
+                Remove(id, true);
+            }
+        }
+
+        //
+        // 删除目录及其子目录下上次运行遗留的会话临时文件
+        // - 临时文件与目标文件在同一目录 多级路径的上传会留在子目录中
+        //
+        void RemoveStale(const std::string &dir) {
+            DIR *d = opendir(dir.c_str());
+            if (d == nullptr) {
+                return;
+            }
+            struct dirent *entry;
+            while ((entry = readdir(d)) != nullptr) {
+                std::string name = entry->d_name;
+                if (entry->d_type == DT_DIR && name != "." && name != "..") {
+                    RemoveStale(dir + name + "/");
+                }
+                else if (name.size() == tmp_prefix.size() + id_len && name.compare(0, tmp_prefix.size(), tmp_prefix) == 0 &&
+                    name.find_first_not_of("0123456789abcdef", tmp_prefix.size()) == std::string::npos) {
+                    unlink((dir + name).c_str());
+                }
+            }
+            closedir(d);
+        }
+
+        static std::string MakeId() {
+            static thread_local std::mt19937_64 rng(std::random_device{}());
+            char buf[id_len + 1];
+            snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)rng(), (unsigned long long)rng());
+            return std::string(buf, id_len);
+        }
+    };
+}
@@ -14,8 +14,11 @@
 #include <iostream>
 #include <string>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <vector>
 #include <fstream>
+#include <filesystem>
 
 namespace storage
 {
@@ -33,6 +36,8 @@ namespace storage
     // - bool SetContent(const char *content, size_t len) : 将文件内容写入到FileUtil对象的filename_
     // - bool Compress(const std::string &content, int format) : 压缩文件并写入到FileUtil对象的filename_
     // - bool UnCompress(std::string &download_path) : 解压文件
+    // - bool CreateParentDirectory() : 创建文件所在的各级目录
+    // - bool SyncParentDirectory() : fsync文件所在的目录
     class FileUtil
     {
     private:
@@ -201,7 +206,35 @@ namespace storage
 
         ///////////////////////////////////////////
         // 目录操作
-        // 以下三个函数使用c++17中文件系统给的库函数实现
+        // 以下函数使用c++17中文件系统给的库函数实现
+
+        //
+        // 创建文件所在的各级目录 用于多级路径的文件
+        // - 目录已存在时返回true
+        //
+        bool CreateParentDirectory() {
+            std::filesystem::path parent = std::filesystem::path(filename_).parent_path();
+            if (parent.empty()) {
+                return true;
+            }
+            std::error_code ec;
+            std::filesystem::create_directories(parent, ec);
+            return !ec && std::filesystem::is_directory(parent, ec);
+        }
+
+        //
+        // fsync文件所在的目录 让目录中新建、rename的文件名在断电后仍然存在
+        //
+        bool SyncParentDirectory() {
+            std::string parent = std::filesystem::path(filename_).parent_path().string();
+            int fd = open(parent.empty() ? "." : parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd == -1) {
+                return false;
+            }
+            bool ok = fsync(fd) == 0;
+            close(fd);
+            return ok;
+        }
     };
     
     //
@@ -217,11 +250,12 @@ namespace storage
         // - 返回值为false表示失败
         // - root为json对象
         // - content为序列化后的字符串
-        static bool Serialize(const Json::Value &root, std::string &content)
+        // - indentation为缩进 传入空字符串时输出单行的紧凑json
+        static bool Serialize(const Json::Value &root, std::string &content, const std::string &indentation = "\t")
         {
             Json::StreamWriterBuilder wbuilder;
             wbuilder["emitUTF8"] = true; // 支持中文
-            wbuilder["indentation"] = "\t";
+            wbuilder["indentation"] = indentation;
             content = Json::writeString(wbuilder, root);
             return true;
         }
@@ -0,0 +1,438 @@
+//
+// 性能基准
+// 用法: ./bench datamanager [条目数] [最大线程数]
+//       ./bench compress [数据大小MB] [最大线程数]
+//       ./bench storageio [数据大小MB] [块大小KB]
+//       ./bench singleflight [并发请求数] [轮数]
+// - datamanager: DataManager在多线程下的查找/更新吞吐 95%查找 5%更新
+// - compress: 块容器按不同压缩格式和线程数压缩/解压的吞吐 MB/s
+// - storageio: posix和io_uring后端批量顺序写/随机读的吞吐和每批延迟
+// - singleflight: 在服务器运行目录中执行 通过HTTP同时下载同一个新上传的块容器
+//   检查每轮只打开一次、并发的流共用解压的块、所有请求都得到完整内容
+//
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <stdlib.h>
+#include "DataManager.hpp"
+#include "BlockContainer.hpp"
+#include "StorageIo.hpp"
+#include "base64.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+static void BenchDataManager(size_t entries, int max_threads)
+{
+    char dir[] = "/tmp/nas_bench_XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        std::cerr << "mkdtemp failed" << std::endl;
+        return;
+    }
+    std::string storage_info = std::string(dir) + "/storage.data";
+    {
+        storage::DataManager data(storage_info);
+        storage::StorageInfo info;
+        info.mtime_ = info.atime_ = time(nullptr);
+        info.fsize_ = 1024;
+        for (size_t i = 0; i < entries; i++) {
+            info.url_ = "/download/file_" + std::to_string(i);
+            info.storage_path_ = "./low_storage/file_" + std::to_string(i);
+            data.Insert(info);
+        }
+        data.Store();
+
+        std::cout << "datamanager entries=" << entries << std::endl;
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            std::atomic<bool> stop(false);
+            std::atomic<uint64_t> total(0);
+            std::vector<std::thread> workers;
+            for (int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]() {
+                    std::mt19937_64 rng(t);
+                    storage::StorageInfo out;
+                    uint64_t ops = 0;
+                    while (!stop.load(std::memory_order_relaxed)) {
+                        size_t k = rng() % entries;
+                        std::string url = "/download/file_" + std::to_string(k);
+                        if (rng() % 100 < 5) {
+                            out.url_ = url;
+                            out.storage_path_ = "./low_storage/file_" + std::to_string(k);
+                            out.mtime_ = out.atime_ = time(nullptr);
+                            out.fsize_ = 1024;
+                            data.Insert(out);
+                        }
+                        else {
+                            data.GetOneByURL(url, &out);
+                        }
+                        ops++;
+                    }
+                    total += ops;
+                });
+            }
+            auto start = std::chrono::steady_clock::now();
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            stop = true;
+            for (auto &w : workers) {
+                w.join();
+            }
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "  threads=" << threads << " ops/s=" << (uint64_t)(total / secs) << std::endl;
+        }
+    }
+    std::string cmd = std::string("rm -rf ") + dir;
+    if (system(cmd.c_str()) != 0) {}
+}
+
+//
+// 生成可压缩的测试数据 单词文本中夹杂少量随机字节
+//
+static std::string MakeSample(size_t size)
+{
+    static const char *words[] = {"storage", "deep", "low", "bundle", "download", "upload", "block",
+                                  "index", "journal", "tiering", "\n", " ", "2024", "nas"};
+    std::mt19937_64 rng(42);
+    std::string sample;
+    sample.reserve(size + 16);
+    while (sample.size() < size) {
+        if (rng() % 16 == 0) {
+            sample.push_back((char)rng());
+        }
+        else {
+            sample += words[rng() % (sizeof(words) / sizeof(words[0]))];
+        }
+    }
+    sample.resize(size);
+    return sample;
+}
+
+static void BenchCompress(size_t size_mb, int max_threads)
+{
+    const uint32_t block_size = 1024 * 1024;
+    const unsigned formats[] = {bundle::LZ4F, bundle::LZ4, bundle::ZSTDF, bundle::ZSTD,
+                                bundle::MINIZ, bundle::BROTLI9, bundle::LZMA20};
+    std::string sample = MakeSample(size_mb * 1024 * 1024);
+    char path[] = "/tmp/nas_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        std::cerr << "mkstemp failed" << std::endl;
+        return;
+    }
+    close(fd);
+
+    std::cout << "compress size=" << size_mb << "MB block=" << block_size << std::endl;
+    for (unsigned format : formats) {
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            storage::ThreadPool pool(threads);
+            auto start = std::chrono::steady_clock::now();
+            storage::BlockWriter writer;
+            bool ok = writer.Open(path, format, block_size, threads > 1 ? &pool : nullptr);
+            for (size_t off = 0; ok && off < sample.size(); off += block_size) {
+                ok = writer.Append(sample.substr(off, block_size));
+            }
+            ok = ok && writer.Finish();
+            double pack_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            storage::BlockReader reader;
+            std::string out;
+            start = std::chrono::steady_clock::now();
+            ok = ok && reader.Open(path) && reader.Read(0, reader.RawSize(), &out, threads > 1 ? &pool : nullptr);
+            double unpack_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (ok == false || out != sample) {
+                std::cout << "  " << bundle::name_of(format) << " threads=" << threads << " failed" << std::endl;
+                continue;
+            }
+            struct stat st;
+            stat(path, &st);
+            std::cout << "  " << bundle::name_of(format) << " threads=" << threads
+                      << " pack MB/s=" << (uint64_t)(size_mb / pack_secs)
+                      << " unpack MB/s=" << (uint64_t)(size_mb / unpack_secs)
+                      << " ratio=" << (double)st.st_size / sample.size() << std::endl;
+        }
+    }
+    unlink(path);
+}
+
+static double Percentile(std::vector<double> &samples, double p)
+{
+    if (samples.empty()) {
+        return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+}
+
+static void BenchStorageIo(size_t size_mb, size_t block_kb)
+{
+    const size_t batch = 16;
+    const size_t block_size = block_kb * 1024;
+    size_t blocks = size_mb * 1024 / block_kb;
+    std::string data = MakeSample(block_size * batch);
+
+    std::cout << "storageio size=" << size_mb << "MB block=" << block_kb << "KB batch=" << batch << std::endl;
+    for (std::string name : {"posix", "io_uring"}) {
+        auto io = storage::StorageIo::Create(name, batch, block_size);
+        if (name != io->Name()) {
+            std::cout << "  " << name << " unavailable" << std::endl;
+            continue;
+        }
+        char path[] = "/tmp/nas_bench_XXXXXX";
+        int fd = mkstemp(path);
+        if (fd == -1) {
+            std::cerr << "mkstemp failed" << std::endl;
+            return;
+        }
+        // 使用注册缓冲区时先把数据放进去
+        std::vector<char *> bufs(batch);
+        std::vector<int> indexes(batch);
+        for (size_t i = 0; i < batch; i++) {
+            indexes[i] = io->AcquireBuffer(block_size, &bufs[i]);
+            if (indexes[i] < 0) {
+                bufs[i] = &data[i * block_size];
+            }
+            else {
+                memcpy(bufs[i], &data[i * block_size], block_size);
+            }
+        }
+
+        for (bool write : {true, false}) {
+            std::mt19937_64 rng(1);
+            std::vector<double> latency;
+            bool ok = true;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t done = 0; ok && done < blocks; done += batch) {
+                storage::IoRequest requests[batch];
+                size_t n = std::min(batch, blocks - done);
+                for (size_t i = 0; i < n; i++) {
+                    uint64_t block = write ? done + i : rng() % blocks; // 顺序写 随机读
+                    requests[i].fd_ = fd;
+                    requests[i].buf_ = bufs[i];
+                    requests[i].len_ = block_size;
+                    requests[i].offset_ = block * block_size;
+                    requests[i].write_ = write;
+                    requests[i].buf_index_ = indexes[i];
+                }
+                auto t0 = std::chrono::steady_clock::now();
+                io->Submit(requests, n);
+                latency.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+                for (size_t i = 0; i < n; i++) {
+                    ok = ok && requests[i].result_ == (ssize_t)block_size;
+                }
+            }
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "  " << name << (write ? " write" : " read ")
+                      << (ok ? "" : " failed")
+                      << " MB/s=" << (uint64_t)(size_mb / secs)
+                      << " p50_us=" << (uint64_t)Percentile(latency, 0.5)
+                      << " p99_us=" << (uint64_t)Percentile(latency, 0.99) << std::endl;
+        }
+        for (size_t i = 0; i < batch; i++) {
+            io->ReleaseBuffer(indexes[i]);
+        }
+        close(fd);
+        unlink(path);
+    }
+}
+
+//
+// 发送一个HTTP/1.0请求并读到连接关闭
+// - fd为已连接的socket 返回状态码 失败返回-1 body为响应体
+//
+static int HttpExchange(int fd, const std::string &request, std::string *body)
+{
+    for (size_t sent = 0; sent < request.size();) {
+        ssize_t n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    std::string response;
+    char buf[65536];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        response.append(buf, n);
+    }
+    size_t head_end = response.find("\r\n\r\n");
+    if (n < 0 || head_end == std::string::npos || response.compare(0, 5, "HTTP/") != 0) {
+        return -1;
+    }
+    *body = response.substr(head_end + 4);
+    return atoi(response.c_str() + response.find(' ') + 1);
+}
+
+static int HttpConnect(const std::string &ip, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip.c_str(), &addr.sin_addr);
+    if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static int HttpRequest(const std::string &ip, int port, const std::string &request, std::string *body)
+{
+    int fd = HttpConnect(ip, port);
+    if (fd == -1) {
+        return -1;
+    }
+    int code = HttpExchange(fd, request, body);
+    close(fd);
+    return code;
+}
+
+//
+// 读取/stats中的一个计数 如download_open.executions
+//
+static uint64_t ReadStat(const std::string &ip, int port, const char *group, const char *name)
+{
+    std::string body;
+    Json::Value root;
+    if (HttpRequest(ip, port, "GET /stats HTTP/1.0\r\n\r\n", &body) != 200 ||
+        storage::JSON_util::UnSerialize(body, root) == false) {
+        return 0;
+    }
+    return root[group][name].asUInt64();
+}
+
+//
+// 统计url以prefix开头的文件中已经在深度存储中的个数
+//
+static size_t CountDeep(const std::string &ip, int port, const std::string &prefix)
+{
+    std::string body;
+    Json::Value root;
+    if (HttpRequest(ip, port, "GET /api/files?limit=1000&prefix=" + prefix + " HTTP/1.0\r\n\r\n", &body) != 200 ||
+        storage::JSON_util::UnSerialize(body, root) == false) {
+        return 0;
+    }
+    size_t deep = 0;
+    for (auto &file : root["files"]) {
+        deep += file["storage"].asString() == "deep" ? 1 : 0;
+    }
+    return deep;
+}
+
+//
+// 通过HTTP驱动运行中的服务器(Storage.conf中的地址 在服务器的运行目录中执行)
+// - 先上传rounds个普通存储的文件 等待分层把它们压缩为块容器 服务器需把tiering_idle_seconds和tiering_scan_interval设得很小
+// - 每轮threads个连接先建立好 再同时请求下载同一个分层后的文件
+// - 检查download_open.executions每轮只增加1 即FindSource把并发下载合并为一次OpenSource
+// - 检查流式下载解压的块数少于threads个下载各自解压的块数 即并发的流共用解压结果
+// - 检查所有下载得到的内容都正确 任一项不满足返回false
+//
+static bool BenchSingleFlight(size_t threads, size_t rounds)
+{
+    storage::Config *config = storage::Config::GetInstance();
+    std::string ip = config->GetServerIp();
+    int port = config->GetServerPort();
+    const size_t block_size = config->GetDeepBlockSize();
+    std::string sample = MakeSample(8 * block_size);
+    size_t blocks = sample.size() / block_size;
+    std::string prefix = "bench_singleflight_" + std::to_string(time(nullptr)) + "_";
+    for (size_t round = 0; round < rounds; round++) {
+        std::string body;
+        std::string upload = "POST /upload HTTP/1.0\r\nFilename: " + base64_encode(prefix + std::to_string(round)) +
+                             "\r\nStorageType: low\r\nContent-Length: " + std::to_string(sample.size()) + "\r\n\r\n" + sample;
+        if (HttpRequest(ip, port, upload, &body) != 200) {
+            std::cerr << "upload failed, is the server running?" << std::endl;
+            return false;
+        }
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+    while (CountDeep(ip, port, prefix) < rounds) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            std::cerr << "files not tiered within 60s, set tiering_idle_seconds and tiering_scan_interval to 1" << std::endl;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    uint64_t opens = 0, decodes = 0;
+    size_t wrong = 0, bad_rounds = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+        uint64_t opens_before = ReadStat(ip, port, "download_open", "executions");
+        uint64_t decodes_before = ReadStat(ip, port, "block_decode", "executions");
+        std::string request = "GET " + config->GetDownloadPrefix() + prefix + std::to_string(round) + " HTTP/1.0\r\n\r\n";
+        std::atomic<size_t> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; i++) {
+            workers.emplace_back([&]() {
+                int fd = HttpConnect(ip, port);
+                ready++;
+                while (go == false) {
+                    std::this_thread::yield();
+                }
+                std::string content;
+                if (fd == -1 || HttpExchange(fd, request, &content) != 200 || content != sample) {
+                    wrong++;
+                }
+                if (fd != -1) {
+                    close(fd);
+                }
+            });
+        }
+        while (ready < threads) {
+            std::this_thread::yield();
+        }
+        go = true;
+        for (auto &w : workers) {
+            w.join();
+        }
+        uint64_t round_opens = ReadStat(ip, port, "download_open", "executions") - opens_before;
+        uint64_t round_decodes = ReadStat(ip, port, "block_decode", "executions") - decodes_before;
+        if (round_opens != 1 || round_decodes == 0 || round_decodes >= threads * blocks) {
+            bad_rounds++;
+        }
+        opens += round_opens;
+        decodes += round_decodes;
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    bool ok = bad_rounds == 0 && wrong == 0;
+    std::cout << "singleflight threads=" << threads << " rounds=" << rounds << " blocks=" << blocks
+              << " opens=" << opens << " block_decodes=" << decodes << " unshared=" << threads * blocks * rounds
+              << " wrong=" << wrong << " ms/round=" << secs * 1000 / rounds << (ok ? " ok" : " FAILED") << std::endl;
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string mode = argc > 1 ? argv[1] : "datamanager";
+    if (mode == "datamanager") {
+        size_t entries = argc > 2 ? std::stoull(argv[2]) : 100000;
+        int max_threads = argc > 3 ? std::stoi(argv[3]) : (int)std::thread::hardware_concurrency();
+        BenchDataManager(entries, max_threads);
+    }
+    else if (mode == "compress") {
+        size_t size_mb = argc > 2 ? std::stoull(argv[2]) : 256;
+        int max_threads = argc > 3 ? std::stoi(argv[3]) : (int)std::thread::hardware_concurrency();
+        BenchCompress(size_mb, max_threads);
+    }
+    else if (mode == "storageio") {
+        size_t size_mb = argc > 2 ? std::stoull(argv[2]) : 1024;
+        size_t block_kb = argc > 3 ? std::stoull(argv[3]) : 128;
+        BenchStorageIo(size_mb, block_kb);
+    }
+    else if (mode == "singleflight") {
+        size_t threads = argc > 2 ? std::stoull(argv[2]) : 32;
+        size_t rounds = argc > 3 ? std::stoull(argv[3]) : 20;
+        return BenchSingleFlight(threads, rounds) ? 0 : 1;
+    }
+    else {
+        std::cerr << "usage: " << argv[0] << " datamanager [entries] [max_threads]" << std::endl;
+        std::cerr << "       " << argv[0] << " compress [size_mb] [max_threads]" << std::endl;
+        std::cerr << "       " << argv[0] << " storageio [size_mb] [block_kb]" << std::endl;
+        std::cerr << "       " << argv[0] << " singleflight [threads] [rounds]" << std::endl;
+        return 1;
+    }
+    return 0;
+}